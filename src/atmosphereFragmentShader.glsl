@@ -0,0 +1,142 @@
+#version 330 core
+
+const float PI = 3.14159265;
+// Table sizes and mappings as in main.cpp (Atmospheric scattering)
+const vec2 kTransmittanceSize = vec2(256.0, 64.0); // mu, r
+const float kScatteringNu = 8.0;
+const float kScatteringMuS = 32.0;
+const float kScatteringMu = 128.0;
+const float kScatteringR = 32.0;
+const float kMinMuS = -0.2;
+
+uniform mat4 viewMat;
+uniform mat4 projMat;
+uniform float logDepthScale; // 1 / log2(1 + far), for the LOG_DEPTH variant (no glClipControl / float depth buffer)
+uniform sampler2D atmosphereTransmittance; // To the top of the atmosphere, by (mu, r)
+uniform sampler3D atmosphereScattering;    // Single scattering: Rayleigh in rgb, Mie's red in alpha
+uniform vec2 atmosphereRadii;    // Ground and top, in km
+uniform vec3 rayleighScattering; // Per km at the ground
+uniform float miePhaseG;
+
+in vec3 fRay;
+flat in vec3 fCameraKm;
+flat in vec3 fSunDirection;
+flat in float fKmToWorld;
+
+layout(location = 0, index = 0) out vec4 color;         // Added
+layout(location = 0, index = 1) out vec4 transmittance; // Multiplies what lies behind
+
+float unitToTexCoord(float x, float size) { return 0.5 / size + x * (1.0 - 1.0 / size); }
+float safeSqrt(float a) { return sqrt(max(a, 0.0)); }
+
+float distanceToTop(float r, float mu) {
+    float top = atmosphereRadii.y;
+    return max(-r * mu + safeSqrt(r * r * (mu * mu - 1.0) + top * top), 0.0);
+}
+float distanceToBottom(float r, float mu) {
+    float bottom = atmosphereRadii.x;
+    return max(-r * mu - safeSqrt(r * r * (mu * mu - 1.0) + bottom * bottom), 0.0);
+}
+bool rayIntersectsGround(float r, float mu) {
+    float bottom = atmosphereRadii.x;
+    return mu < 0.0 && r * r * (mu * mu - 1.0) + bottom * bottom >= 0.0;
+}
+
+vec3 transmittanceToTop(float r, float mu) {
+    float bottom = atmosphereRadii.x, top = atmosphereRadii.y;
+    float H = sqrt(top * top - bottom * bottom);
+    float rho = safeSqrt(r * r - bottom * bottom);
+    float dMin = top - r, dMax = rho + H;
+    float xMu = (distanceToTop(r, mu) - dMin) / (dMax - dMin);
+    return texture(atmosphereTransmittance, vec2(unitToTexCoord(xMu, kTransmittanceSize.x),
+                                                 unitToTexCoord(rho / H, kTransmittanceSize.y))).rgb;
+}
+
+// Transmittance from (r, mu) to the ground, which the ray hits
+vec3 transmittanceToGround(float r, float mu) {
+    float d = distanceToBottom(r, mu);
+    float rD = clamp(sqrt(d * d + 2.0 * r * mu * d + r * r), atmosphereRadii.x, atmosphereRadii.y);
+    float muD = clamp((r * mu + d) / rD, -1.0, 1.0);
+    return min(transmittanceToTop(rD, -muD) / max(transmittanceToTop(r, -mu), vec3(1.0e-6)), vec3(1.0));
+}
+
+// Single scattering along the ray (r, mu) with the Sun at muS, nu from it
+vec4 scattering(float r, float mu, float muS, float nu, bool intersectsGround) {
+    float bottom = atmosphereRadii.x, top = atmosphereRadii.y;
+    float H = sqrt(top * top - bottom * bottom);
+    float rho = safeSqrt(r * r - bottom * bottom);
+    float uR = unitToTexCoord(rho / H, kScatteringR);
+
+    // Rays to the ground fill the lower half of mu, rays to the sky the upper half
+    float rMu = r * mu;
+    float discriminant = rMu * rMu - r * r + bottom * bottom;
+    float uMu;
+    if (intersectsGround) {
+        float d = -rMu - safeSqrt(discriminant);
+        float dMin = r - bottom, dMax = rho;
+        uMu = 0.5 - 0.5 * unitToTexCoord(dMax == dMin ? 0.0 : (d - dMin) / (dMax - dMin), kScatteringMu / 2.0);
+    } else {
+        float d = -rMu + safeSqrt(discriminant + H * H);
+        float dMin = top - r, dMax = rho + H;
+        uMu = 0.5 + 0.5 * unitToTexCoord((d - dMin) / (dMax - dMin), kScatteringMu / 2.0);
+    }
+
+    float dMin = top - bottom, dMax = H;
+    float alpha = (distanceToTop(bottom, muS) - dMin) / (dMax - dMin);
+    float A = (distanceToTop(bottom, kMinMuS) - dMin) / (dMax - dMin);
+    float uMuS = unitToTexCoord(max(1.0 - alpha / A, 0.0) / (1.0 + alpha), kScatteringMuS);
+
+    // nu between the two slices around it
+    float x = (nu + 1.0) * 0.5 * (kScatteringNu - 1.0);
+    float slice = min(floor(x), kScatteringNu - 2.0);
+    vec4 s0 = texture(atmosphereScattering, vec3((slice + uMuS) / kScatteringNu, uMu, uR));
+    vec4 s1 = texture(atmosphereScattering, vec3((slice + 1.0 + uMuS) / kScatteringNu, uMu, uR));
+    return mix(s0, s1, x - slice);
+}
+
+float rayleighPhase(float nu) { return 3.0 / (16.0 * PI) * (1.0 + nu * nu); }
+// Cornette-Shanks
+float miePhase(float nu) {
+    float g = miePhaseG;
+    float k = 3.0 / (8.0 * PI) * (1.0 - g * g) / (2.0 + g * g);
+    return k * (1.0 + nu * nu) / pow(1.0 + g * g - 2.0 * g * nu, 1.5);
+}
+
+void main() {
+    // Where the view ray enters the top sphere; from the point closest to the
+    // center, which stays accurate however far the camera is
+    vec3 v = normalize(fRay);
+    float top = atmosphereRadii.y;
+    float b = dot(fCameraKm, v);
+    vec3 closest = fCameraKm - b * v;
+    float halfChord = top * top - dot(closest, closest);
+    if (halfChord <= 0.0 || -b + sqrt(halfChord) <= 0.0)
+        discard; // Misses the atmosphere, or it is behind
+    halfChord = sqrt(halfChord);
+    float entry = -b - halfChord;
+    vec3 origin = entry > 0.0 ? closest - halfChord * v : fCameraKm;
+
+    float r = clamp(length(origin), atmosphereRadii.x, top);
+    float mu = clamp(dot(origin, v) / r, -1.0, 1.0);
+    float muS = clamp(dot(origin, fSunDirection) / r, -1.0, 1.0);
+    float nu = clamp(dot(v, fSunDirection), -1.0, 1.0);
+    bool intersectsGround = rayIntersectsGround(r, mu);
+
+    // Mie's green and blue from its red and Rayleigh's ratios between channels
+    vec4 s = scattering(r, mu, muS, nu, intersectsGround);
+    vec3 mie = s.r > 0.0 ? s.rgb * (s.a / s.r) * (rayleighScattering.r / rayleighScattering) : vec3(0.0);
+    color = vec4(s.rgb * rayleighPhase(nu) + mie * miePhase(nu), 0.0);
+    transmittance = vec4(intersectsGround ? transmittanceToGround(r, mu) : transmittanceToTop(r, mu), 1.0);
+
+    // Depth where the ray enters, or the camera's own once inside
+    if (entry > 0.0) {
+        vec4 clip = projMat * vec4(mat3(viewMat) * (v * entry * fKmToWorld), 1.0);
+#ifdef LOG_DEPTH
+        gl_FragDepth = 1.0 - log2(1.0 + clip.w) * logDepthScale;
+#else
+        gl_FragDepth = clip.z / clip.w;
+#endif
+    } else {
+        gl_FragDepth = 1.0;
+    }
+}
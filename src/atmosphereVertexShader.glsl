@@ -0,0 +1,46 @@
+// Camera-facing quad around the top of a body's atmosphere, or the whole screen
+// once the camera is inside it; the fragment shader looks the scattering up.
+#version 330 core
+
+layout(location = 0) in vec3 aPos;      // Quad corner, in [-1, 1] (z unused)
+layout(location = 3) in mat4 aModelMat; // Per draw (locations 3-6): center and radius of the body
+
+uniform mat4 viewMat;
+uniform mat4 projMat;
+uniform vec3 lightPos;        // Light position (sun's position)
+uniform vec2 atmosphereRadii; // Ground and top of the atmosphere, in km
+
+out vec3 fRay;               // View ray through the fragment, in world axes (not normalized)
+flat out vec3 fCameraKm;     // Camera relative to the body's center, in km
+flat out vec3 fSunDirection;
+flat out float fKmToWorld;
+
+void main()
+{
+    vec3 center = (viewMat * aModelMat[3]).xyz;
+    float kmToWorld = length(aModelMat[0].xyz) / atmosphereRadii.x;
+    float radius = atmosphereRadii.y * kmToWorld;
+    float distance = length(center);
+    mat3 viewToWorld = transpose(mat3(viewMat));
+
+    // Relative to the center, so that nothing cancels however far it is
+    fCameraKm = -(viewToWorld * center) / kmToWorld;
+    fSunDirection = normalize(lightPos - aModelMat[3].xyz);
+    fKmToWorld = kmToWorld;
+
+    if (distance < 1.01 * radius) {
+        // Inside, or so close that the quad would blow up: the whole screen
+        fRay = viewToWorld * vec3(aPos.x / projMat[0][0], aPos.y / projMat[1][1], -1.0);
+        gl_Position = vec4(aPos.xy, 0.0, 1.0);
+        return;
+    }
+
+    // As in impostorVertexShader.glsl: the silhouette of the top sphere
+    vec3 forward = center / distance;
+    vec3 right = normalize(cross(forward, abs(forward.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0)));
+    vec3 up = cross(right, forward);
+    float halfSize = radius * distance / sqrt(distance * distance - radius * radius);
+    vec3 corner = center + (right * aPos.x + up * aPos.y) * halfSize;
+    fRay = viewToWorld * corner;
+    gl_Position = projMat * vec4(corner, 1.0);
+}
@@ -0,0 +1,37 @@
+// One step down the bloom pyramid (dual filter): the center and four diagonal
+// bilinear taps cover a 4x4 texel footprint of the level above.
+#version 330 core
+
+uniform sampler2D sourceTexture; // Scene (first step) or the previous level
+uniform vec2 texelSize;          // 1 / allocated size of the source
+uniform vec2 uvMin;              // Centers of the first and last texels drawn in the source:
+uniform vec2 uvMax;              // the rest of it is stale
+uniform bool prefilter;          // First step: keep only what is brighter than the threshold
+uniform float threshold;
+uniform float knee;              // Width of the soft transition around the threshold
+
+in vec2 fTexCoord;
+
+out vec4 color;
+
+vec3 sampleSource(vec2 uv) {
+    return texture(sourceTexture, clamp(uv, uvMin, uvMax)).rgb;
+}
+
+void main() {
+    vec3 sum = sampleSource(fTexCoord) * 4.0;
+    sum += sampleSource(fTexCoord - texelSize);
+    sum += sampleSource(fTexCoord + texelSize);
+    sum += sampleSource(fTexCoord + vec2(texelSize.x, -texelSize.y));
+    sum += sampleSource(fTexCoord - vec2(texelSize.x, -texelSize.y));
+    vec3 c = sum * 0.125;
+
+    if (prefilter) {
+        // Quadratic knee: no hard edge where the brightness crosses the threshold
+        float brightness = max(c.r, max(c.g, c.b));
+        float soft = clamp(brightness - threshold + knee, 0.0, 2.0 * knee);
+        soft = soft * soft / (4.0 * knee + 1.0e-5);
+        c *= max(soft, brightness - threshold) / max(brightness, 1.0e-5);
+    }
+    color = vec4(c, 1.0);
+}
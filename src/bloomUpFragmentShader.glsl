@@ -0,0 +1,29 @@
+// One step up the bloom pyramid (dual filter): a tent of eight bilinear taps of
+// the smaller level, added onto the level it is drawn into.
+#version 330 core
+
+uniform sampler2D sourceTexture; // Smaller level
+uniform vec2 texelSize;          // 1 / allocated size of the source
+uniform vec2 uvMin;              // Centers of the first and last texels drawn in the source
+uniform vec2 uvMax;
+
+in vec2 fTexCoord;
+
+out vec4 color;
+
+vec3 sampleSource(vec2 uv) {
+    return texture(sourceTexture, clamp(uv, uvMin, uvMax)).rgb;
+}
+
+void main() {
+    vec2 h = 0.5 * texelSize;
+    vec3 sum = sampleSource(fTexCoord + vec2(-2.0 * h.x, 0.0));
+    sum += sampleSource(fTexCoord + vec2(2.0 * h.x, 0.0));
+    sum += sampleSource(fTexCoord + vec2(0.0, -2.0 * h.y));
+    sum += sampleSource(fTexCoord + vec2(0.0, 2.0 * h.y));
+    sum += sampleSource(fTexCoord + vec2(-h.x, h.y)) * 2.0;
+    sum += sampleSource(fTexCoord + vec2(h.x, h.y)) * 2.0;
+    sum += sampleSource(fTexCoord + vec2(h.x, -h.y)) * 2.0;
+    sum += sampleSource(fTexCoord + vec2(-h.x, -h.y)) * 2.0;
+    color = vec4(sum / 12.0, 1.0); // Blended additively
+}
@@ -1,40 +1,51 @@
 #version 330 core
 
 uniform vec3 camPos;         // Camera position
-uniform vec3 lightPos;       // Light position (sun's position)
-uniform sampler2D texture1;  // Texture sampler
-uniform vec3 objectColor;    // Color of the object (planet)
-uniform bool useTexture;     // Flag to determine whether to use texture
-uniform bool isSun;          // Flag to determine if the object is the sun
+uniform sampler2DArray bodyTextures; // Body texture array bound for this draw
+uniform float logDepthScale; // 1 / log2(1 + far), for the LOG_DEPTH variant (no glClipControl / float depth buffer)
+uniform float emissiveIntensity; // Radiance of emissive materials (above 1 into an HDR target)
 
 in vec3 fPosition; // Fragment position in world space
 in vec3 fNormal;   // Fragment normal in world space
 in vec2 fTexCoord; // Fragment texture coordinate
+flat in vec3 fObjectColor; // Color of the object (planet)
+flat in uint fMaterial; // Slot in the material table
+flat in uint fShadows;  // Occluder list: first | count << 24, and flags (see vertexShader.glsl)
+flat in vec3 fCenter;
+flat in vec4 fRingPlane;
+in float fDepthW;  // View distance
+
+// Per material: x = layer in the bound array, y = textured, z = emissive (the sun)
+layout(std140) uniform Materials {
+    ivec4 materials[16];
+};
 
 out vec4 color; // shader output: color of this fragment
 
 void main() {
     vec3 n = normalize(fNormal);
-    vec3 l = normalize(lightPos - fPosition); // Light direction from light source to fragment
-    vec3 v = normalize(camPos - fPosition);   // View direction
-    vec3 r = reflect(-l, n);                  // Reflected light direction
+    vec3 v = normalize(camPos - fPosition); // View direction
 
+    ivec4 material = materials[fMaterial];
     vec3 baseColor;
-    if (useTexture) {
-        baseColor = texture(texture1, fTexCoord).rgb;
+    if (material.y != 0) {
+        baseColor = texture(bodyTextures, vec3(fTexCoord, float(material.x))).rgb;
     } else {
-        baseColor = objectColor;
+        baseColor = fObjectColor;
     }
 
     vec3 lighting;
-    if (isSun) {
-        lighting = baseColor * vec3(0.8, 0.8, 0.8); // Sun is lit by only its own ambient lighting
+    if (material.z != 0) {
+        lighting = baseColor * emissiveIntensity; // Sun is lit by only its own emission
     } else {
-        vec3 ambient = baseColor * vec3(0.5, 0.5, 0.5); // Ambient light
-        vec3 diffuse = baseColor * vec3(1.0, 1.0, 1.0) * max(dot(n, l), 0.0); // Diffuse light
-        vec3 specular = vec3(0.5, 0.5, 0.5) * pow(max(dot(r, v), 0.0), 32); // Specular light
-        lighting = ambient + diffuse + specular; // Combine lighting components
+        lighting = shadeBody(fPosition, n, v, baseColor, fShadows, fCenter, fRingPlane, fDepthW); // See lighting.glsl
     }
 
     color = vec4(lighting, 1.0); // Final color (RGBA from RGB)
+
+#ifdef LOG_DEPTH
+    // Reversed depth: 1 at the camera, 0 at the far distance. Written in this variant
+    // only, since writing gl_FragDepth turns early depth testing off.
+    gl_FragDepth = 1.0 - log2(1.0 + fDepthW) * logDepthScale;
+#endif
 }
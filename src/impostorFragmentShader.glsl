@@ -0,0 +1,82 @@
+#version 330 core
+
+uniform mat4 viewMat;
+uniform mat4 projMat;
+uniform vec3 camPos;         // Camera position
+uniform sampler2DArray bodyTextures; // Body texture array bound for this draw
+uniform float logDepthScale; // 1 / log2(1 + far), for the LOG_DEPTH variant (no glClipControl / float depth buffer)
+uniform float emissiveIntensity; // Radiance of emissive materials (above 1 into an HDR target)
+
+in vec2 fOffset;
+flat in vec4 fSphere;
+flat in vec3 fRight;
+flat in vec3 fUp;
+flat in mat3 fViewToLocal;
+flat in vec3 fCenterWorld;
+flat in vec3 fObjectColor;
+flat in uint fMaterial;
+flat in uint fShadows;
+flat in vec4 fRingPlane;
+
+// Per material: x = layer in the bound array, y = textured, z = emissive (the sun)
+layout(std140) uniform Materials {
+    ivec4 materials[16];
+};
+
+out vec4 color;
+
+void main() {
+    // Eye ray through this fragment, solved in the plane of the ray and the center
+    // with quantities relative to the sphere: no cancellation however far it is
+    float distance = length(fSphere.xyz);
+    float radius = fSphere.w;
+    vec3 forward = fSphere.xyz / distance;
+    float s = length(fOffset);
+    vec3 along = s > 0.0 ? (fRight * fOffset.x + fUp * fOffset.y) / s : fRight;
+    float rayLength = sqrt(distance * distance + s * s);
+    vec3 rayDir = (distance * forward + s * along) / rayLength;
+    vec3 perpendicular = (distance * along - s * forward) / rayLength;
+    float closest = distance * s / rayLength; // Distance from the center to the ray
+    float inside = radius * radius - closest * closest;
+
+    // Front hit, from the center; clamped so that derivatives stay defined until the discard
+    vec3 hit = closest * perpendicular - sqrt(max(inside, 0.0)) * rayDir;
+    vec3 normalView = hit / radius;
+    vec3 n = normalize(transpose(mat3(viewMat)) * normalView);
+    vec3 position = fCenterWorld + n * radius;
+
+    // Same parametrization as Mesh::genSphere: u = atan(x, z) / 2pi, v = acos(y) / pi
+    vec3 local = normalize(fViewToLocal * normalView);
+    vec2 uv = vec2(fract(atan(local.x, local.z) / (2.0 * PI)), acos(clamp(local.y, -1.0, 1.0)) / PI);
+    // u wraps at the seam: there, use the derivatives of u shifted by half a turn
+    float uShifted = fract(uv.x + 0.5) - 0.5;
+    vec2 dx = vec2(abs(dFdx(uv.x)) <= abs(dFdx(uShifted)) ? dFdx(uv.x) : dFdx(uShifted), dFdx(uv.y));
+    vec2 dy = vec2(abs(dFdy(uv.x)) <= abs(dFdy(uShifted)) ? dFdy(uv.x) : dFdy(uShifted), dFdy(uv.y));
+
+    ivec4 material = materials[fMaterial];
+    vec3 baseColor;
+    if (material.y != 0) {
+        baseColor = textureGrad(bodyTextures, vec3(uv, float(material.x)), dx, dy).rgb;
+    } else {
+        baseColor = fObjectColor;
+    }
+    if (inside < 0.0)
+        discard;
+
+    vec3 v = normalize(camPos - position);
+    vec3 lighting;
+    if (material.z != 0) {
+        lighting = baseColor * emissiveIntensity;
+    } else {
+        lighting = shadeBody(position, n, v, baseColor, fShadows, fCenterWorld, fRingPlane, -(fSphere.z + hit.z));
+    }
+    color = vec4(lighting, 1.0);
+
+    // Depth of the hit, not of the quad
+    vec4 clip = projMat * vec4(fSphere.xyz + hit, 1.0);
+#ifdef LOG_DEPTH
+    gl_FragDepth = 1.0 - log2(1.0 + clip.w) * logDepthScale;
+#else
+    gl_FragDepth = clip.z / clip.w;
+#endif
+}
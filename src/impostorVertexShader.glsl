@@ -0,0 +1,49 @@
+// Camera-facing quad around a body; the fragment shader ray-casts the sphere inside it.
+#version 330 core
+
+layout(location = 0) in vec3 aPos;      // Quad corner, in [-1, 1] (z unused)
+layout(location = 3) in mat4 aModelMat; // Per draw (locations 3-6): center and radius of the unit sphere
+layout(location = 7) in vec4 aColor;
+layout(location = 8) in uint aMaterial;
+layout(location = 9) in uint aShadows;
+
+uniform mat4 viewMat;
+uniform mat4 projMat;
+uniform vec3 ringAxis; // Normal of the ring plane, in the frame of the planet
+
+out vec2 fOffset;            // From the sphere center, in the quad plane (right, up)
+flat out vec4 fSphere;       // View-space center, radius
+flat out vec3 fRight;        // Quad axes in view space, orthogonal to the center direction
+flat out vec3 fUp;
+flat out mat3 fViewToLocal;  // View-space directions to the body's own frame (texture coordinates)
+flat out vec3 fCenterWorld;
+flat out vec3 fObjectColor;
+flat out uint fMaterial;
+flat out uint fShadows;
+flat out vec4 fRingPlane; // Normal of the ring plane, planet radius; 0 without rings
+
+void main()
+{
+    vec3 center = (viewMat * aModelMat[3]).xyz;
+    float radius = length(aModelMat[0].xyz);
+    float distance = length(center);
+    vec3 forward = center / distance;
+    vec3 right = normalize(cross(forward, abs(forward.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0)));
+    vec3 up = cross(right, forward);
+
+    // The silhouette cone cuts the plane through the center in a circle of this radius
+    float halfSize = radius * distance / sqrt(max(distance * distance - radius * radius, 1.0e-4 * distance * distance));
+
+    fOffset = aPos.xy * halfSize;
+    fSphere = vec4(center, radius);
+    fRight = right;
+    fUp = up;
+    fViewToLocal = inverse(mat3(aModelMat)) * transpose(mat3(viewMat));
+    fCenterWorld = aModelMat[3].xyz;
+    fObjectColor = aColor.rgb;
+    fMaterial = aMaterial;
+    fShadows = aShadows;
+    fRingPlane = (aShadows & 0x80000000u) != 0u ? vec4(normalize(mat3(aModelMat) * ringAxis), radius) : vec4(0.0);
+
+    gl_Position = projMat * vec4(center + right * fOffset.x + up * fOffset.y, 1.0);
+}
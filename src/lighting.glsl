@@ -0,0 +1,159 @@
+// Lighting of the bodies (shadeBody), shared by the mesh, impostor and ring fragment shaders:
+// createProgram puts it ahead of them (after the #version line and the defines)
+
+const float PI = 3.14159265;
+
+uniform vec3 lightPos;       // Light position (sun's position)
+uniform sampler1D ringProfile; // Inner edge first: color, and opacity at normal incidence in alpha
+uniform vec2 ringRadii;        // Inner and outer edge of the rings, in radii of the planet
+uniform sampler2D atmosphereTransmittance; // Atmospheric scattering tables (see atmosphereFragmentShader.glsl)
+uniform sampler2D atmosphereIrradiance;
+uniform vec2 atmosphereRadii;  // Ground and top of the atmosphere, in km
+uniform vec3 ambientSH[9];           // Sky irradiance / pi in spherical harmonics (see Environment lighting in main.cpp)
+uniform samplerCube environmentMap; // Sky prefiltered for roughness 0, 0.2, ... 1 along its levels
+uniform bool pointLights;         // Clustered point lights this frame (see Clustered lights in main.cpp)
+uniform samplerBuffer lightData;  // Per light: position and range, then color times intensity
+uniform usamplerBuffer lightClusters; // Per cluster: first | count << 24 into the light indices that follow
+uniform int lightTexel;           // Where this frame's lights and clusters start
+uniform int clusterTexel;
+uniform vec2 clusterTileScale;      // Tiles per pixel
+uniform vec2 clusterDepthScaleBias; // Slice = log(view depth) * x + y
+
+// Spheres (center, radius) of the Sun and of the occluders listed per draw
+layout(std140) uniform Occluders {
+    vec4 sunSphere;
+    vec4 occluders[255];
+};
+
+// Area shared by two disks of radii r1 and r2 whose centers are d apart
+float diskOverlap(float r1, float r2, float d) {
+    if (d >= r1 + r2)
+        return 0.0;
+    float r = min(r1, r2);
+    if (d <= abs(r1 - r2))
+        return PI * r * r;
+    float a1 = r1 * r1 * acos(clamp((d * d + r1 * r1 - r2 * r2) / (2.0 * d * r1), -1.0, 1.0));
+    float a2 = r2 * r2 * acos(clamp((d * d + r2 * r2 - r1 * r1) / (2.0 * d * r2), -1.0, 1.0));
+    float k = (-d + r1 + r2) * (d + r1 - r2) * (d - r1 + r2) * (d + r1 + r2);
+    return a1 + a2 - 0.5 * sqrt(max(k, 0.0));
+}
+
+// Share of the Sun's disk seen from position that the draw's occluders leave
+// visible: the overlap of the angular disks, so the penumbra comes out exactly
+float sunVisibility(vec3 position, uint shadows) {
+    uint count = (shadows >> 24) & 0x3fu;
+    if (count == 0u)
+        return 1.0;
+    uint first = shadows & 0xffffffu;
+    vec3 toSun = sunSphere.xyz - position;
+    float sunDistance = length(toSun);
+    float sunRadius = asin(min(sunSphere.w / sunDistance, 1.0));
+    float visible = 1.0;
+    for (uint i = 0u; i < count && i < 4u; ++i) {
+        vec4 occluder = occluders[first + i];
+        vec3 toOccluder = occluder.xyz - position;
+        float occluderDistance = length(toOccluder);
+        if (occluderDistance <= occluder.w || occluderDistance >= sunDistance)
+            continue;
+        float occluderRadius = asin(occluder.w / occluderDistance);
+        float separation = atan(length(cross(toSun, toOccluder)), dot(toSun, toOccluder));
+        visible *= 1.0 - diskOverlap(sunRadius, occluderRadius, separation) / (PI * sunRadius * sunRadius);
+    }
+    return visible;
+}
+
+// Sunlight let through by the rings of a ringed planet (ring: plane normal and
+// planet radius, w = 0 without rings), from the profile where the ray to the Sun
+// crosses the ring plane
+float ringTransmittance(vec3 position, vec3 center, vec4 ring) {
+    if (ring.w == 0.0)
+        return 1.0;
+    vec3 l = normalize(lightPos - position);
+    float cosine = dot(l, ring.xyz);
+    float t = dot(center - position, ring.xyz) / cosine;
+    if (abs(cosine) < 1.0e-4 || t <= 0.0)
+        return 1.0;
+    float u = (length(position + t * l - center) / ring.w - ringRadii.x) / (ringRadii.y - ringRadii.x);
+    if (u < 0.0 || u > 1.0)
+        return 1.0;
+    float opacity = textureLod(ringProfile, u, 0.0).a;
+    return pow(1.0 - 0.98 * opacity, 1.0 / abs(cosine));
+}
+
+// Irradiance / pi of the sky at normal n: a few multiply-adds over the harmonics
+vec3 ambientIrradiance(vec3 n) {
+    return ambientSH[0] + ambientSH[1] * n.y + ambientSH[2] * n.z + ambientSH[3] * n.x +
+           ambientSH[4] * n.x * n.y + ambientSH[5] * n.y * n.z + ambientSH[6] * (3.0 * n.z * n.z - 1.0) +
+           ambientSH[7] * n.x * n.z + ambientSH[8] * (n.x * n.x - n.y * n.y);
+}
+
+// Sky reflected along r through the Phong lobe of the specular term (exponent 32:
+// roughness (2 / 34)^(1/4), level 2.46), times the lobe's solid angle 2 pi / 33
+vec3 ambientSpecular(vec3 r) {
+    return textureLod(environmentMap, r, 2.46).rgb * (2.0 * PI / 33.0);
+}
+
+const ivec3 kClusters = ivec3(16, 9, 24); // Tiles across, tiles up, depth slices
+
+// Diffuse and specular light of the point lights of this fragment's cluster: an
+// inverse square falloff, smoothly cut off at the range of each light
+vec3 pointLighting(vec3 position, vec3 n, vec3 v, vec3 baseColor, float viewDepth) {
+    if (!pointLights)
+        return vec3(0.0);
+    ivec2 tile = min(ivec2(gl_FragCoord.xy * clusterTileScale), kClusters.xy - 1);
+    int slice = clamp(int(log(viewDepth) * clusterDepthScaleBias.x + clusterDepthScaleBias.y), 0, kClusters.z - 1);
+    uint cluster = texelFetch(lightClusters, clusterTexel + (slice * kClusters.y + tile.y) * kClusters.x + tile.x).r;
+    int first = clusterTexel + int(cluster & 0xffffffu);
+    int count = int(cluster >> 24);
+    vec3 lighting = vec3(0.0);
+    for (int i = 0; i < count; ++i) {
+        int light = lightTexel + 2 * int(texelFetch(lightClusters, first + i).r);
+        vec4 sphere = texelFetch(lightData, light);
+        vec3 toLight = sphere.xyz - position;
+        float d2 = dot(toLight, toLight);
+        float falloff = clamp(1.0 - d2 * d2 / (sphere.w * sphere.w * sphere.w * sphere.w), 0.0, 1.0);
+        if (falloff == 0.0)
+            continue;
+        vec3 l = toLight * inversesqrt(d2);
+        vec3 radiance = texelFetch(lightData, light + 1).rgb * falloff * falloff / max(d2, 1.0e-4 * sphere.w * sphere.w);
+        lighting += radiance * (baseColor * max(dot(n, l), 0.0) + vec3(0.5) * pow(max(dot(reflect(-l, n), v), 0.0), 32));
+    }
+    return lighting;
+}
+
+float unitToTexCoord(float x, float size) { return 0.5 / size + x * (1.0 - 1.0 / size); }
+
+// Light reaching the ground of a body with an atmosphere, where the Sun is muS
+// above the horizon: sunlight through the atmosphere and, from the same tables
+// as atmosphereFragmentShader.glsl, the sky's irradiance
+vec3 groundSunlight(float muS) {
+    float bottom = atmosphereRadii.x, top = atmosphereRadii.y;
+    float H = sqrt(top * top - bottom * bottom);
+    float mu = max(muS, 0.0);
+    float d = -bottom * mu + sqrt(bottom * bottom * (mu * mu - 1.0) + top * top);
+    float xMu = (d - (top - bottom)) / (H - (top - bottom));
+    return textureLod(atmosphereTransmittance, vec2(unitToTexCoord(xMu, 256.0), 0.5 / 64.0), 0.0).rgb;
+}
+vec3 groundSkyIrradiance(float muS) {
+    return textureLod(atmosphereIrradiance, vec2(unitToTexCoord(0.5 * muS + 0.5, 64.0), 0.5 / 16.0), 0.0).rgb;
+}
+
+// Light leaving a lit (not emissive) body towards the viewer (v) at position, of
+// normal n: the sky, the Sun through eclipses, ring shadow and atmosphere, and
+// the point lights. shadows, center and ring come from the draw (see vertexShader.glsl).
+vec3 shadeBody(vec3 position, vec3 n, vec3 v, vec3 baseColor, uint shadows, vec3 center, vec4 ring, float viewDepth) {
+    vec3 l = normalize(lightPos - position); // Light direction from light source to fragment
+    vec3 r = reflect(-l, n);                 // Reflected light direction
+    vec3 ambient = baseColor * ambientIrradiance(n) + vec3(0.5) * ambientSpecular(reflect(-v, n)); // Light of the sky
+    vec3 diffuse = baseColor * vec3(1.0, 1.0, 1.0) * max(dot(n, l), 0.0); // Diffuse light
+    vec3 specular = vec3(0.5, 0.5, 0.5) * pow(max(dot(r, v), 0.0), 32); // Specular light
+    float sunlight = sunVisibility(position, shadows) * ringTransmittance(position, center, ring); // Eclipses
+    vec3 sunColor = vec3(1.0), sky = vec3(0.0);
+    if ((shadows & 0x40000000u) != 0u) {
+        // Through the atmosphere: reddened sunlight, and the blue sky's light
+        sunColor = groundSunlight(dot(n, l));
+        sky = baseColor * groundSkyIrradiance(dot(n, l)) / PI;
+    }
+    vec3 lighting = ambient + sky + sunlight * sunColor * (diffuse + specular); // Combine lighting components
+    return lighting + pointLighting(position, n, v, baseColor, viewDepth); // Lamps around the bodies
+}
@@ -0,0 +1,30 @@
+// One cell of the auto-exposure grid: the log2 luminance of a 4x4 grid of taps
+// over the part of the scene the cell covers.
+#version 330 core
+
+uniform sampler2D sceneTexture; // Offscreen HDR target
+uniform vec2 uvMin;             // Centers of the first and last rendered texels
+uniform vec2 uvMax;
+uniform vec2 cellSize;          // Extent of a cell in the scene, in texture coordinates
+uniform float minLuminance;     // Darker taps are empty sky: left out of the mean
+
+in vec2 fTexCoord; // Cell center
+
+out vec2 result; // x: mean log2 luminance of the lit taps, y: share of lit taps
+
+void main() {
+    float logSum = 0.0;
+    float lit = 0.0;
+    for (int j = 0; j < 4; ++j) {
+        for (int i = 0; i < 4; ++i) {
+            vec2 uv = fTexCoord + (vec2(i, j) - 1.5) * 0.25 * cellSize;
+            vec3 c = texture(sceneTexture, clamp(uv, uvMin, uvMax)).rgb;
+            float luminance = dot(c, vec3(0.2126, 0.7152, 0.0722));
+            if (luminance > minLuminance) {
+                logSum += log2(luminance);
+                lit += 1.0;
+            }
+        }
+    }
+    result = vec2(lit > 0.0 ? logSum / lit : 0.0, lit / 16.0);
+}
@@ -21,7 +21,7 @@ This assignment creates a simple 3D solar system with the Sun, Earth, Moon, and
 - Saturn orbits the Sun and rotates around its own axis.
 - Saturn has rings textured with a provided colormap (rings are not working properly)
 - Textures are applied to Earth, Moon, and Saturn for realism.
-- A skybox provides a background environment.
+- A star catalog, drawn as points down to a magnitude that follows the zoom, provides the sky.
 - The camera can be moved and zoomed to observe the scene from different angles.
 - The simulation can be paused and resumed with the 'F' key.
 
@@ -40,11 +40,37 @@ What is a VAO: Stores the state of VBOs (position, normals, texture coordinates,
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <iterator>
 #include <vector>
 #include <string>
 #include <cmath>
 #include <memory>
 #include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <initializer_list>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ASSET_ARCHIVE_MMAP
+#endif
 
 // Include OpenGL headers
 #include <glad/gl.h>
@@ -61,6 +87,12 @@ What is a VAO: Stores the state of VBOs (position, normals, texture coordinates,
 // Define PI constant
 const float PI = 3.14159265358979323846f;
 
+typedef std::chrono::steady_clock Clock;
+
+inline double elapsedMs(const Clock::time_point &start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
 // Constants for celestial bodies
 const static float kSizeSun = 1.0f;
 
@@ -79,22 +111,118 @@ const static float kRadOrbitSaturn = 25.0f;
 const static float saturnOrbitPeriod = 20.0f;
 const static float saturnRotationPeriod = saturnOrbitPeriod / 3.0f;
 
+// Real radii and orbit radii in thousands of km, for --true-scale
+const static float kTrueSizeSun = 696.0f;
+const static float kTrueSizeEarth = 6.371f;
+const static float kTrueRadOrbitEarth = 149598.0f;
+const static float kTrueSizeMoon = 1.737f;
+const static float kTrueRadOrbitMoon = 384.4f;
+const static float kTrueSizeSaturn = 58.23f;
+const static float kTrueRadOrbitSaturn = 1433530.0f;
+
 // Window parameters
 GLFWwindow *g_window = nullptr;
 
-// GPU programs
-GLuint g_program = 0;         // Main shader program
-GLuint skyboxProgram = 0;     // Skybox shader program
-
-// Matrices for celestial bodies
-glm::mat4 g_sun = glm::scale(glm::mat4(1.0f), glm::vec3(kSizeSun));
-glm::mat4 g_earth = glm::mat4(1.0f);
-glm::mat4 g_moon = glm::mat4(1.0f);
-glm::mat4 g_saturn = glm::mat4(1.0f);
-
 // Sun color
 glm::vec3 sunColor = glm::vec3(1.0f, 1.0f, 0.0f); // Yellowish
 
+// Ring tilt relative to the equator of the planet carrying it
+const static float kRingTiltDegrees = 27.0f;
+// Edges and half thickness of the rings, in radii of the planet carrying them
+const static float kRingInnerRadius = 1.5f * kSizeSaturn;
+const static float kRingOuterRadius = 2.5f * kSizeSaturn;
+const static float kRingHalfThickness = 0.01f;
+
+// Materials a body can be drawn with (textures are resolved in initTextures)
+enum BodyMaterial {
+    MATERIAL_SUN = 0,
+    MATERIAL_EARTH,
+    MATERIAL_MOON,
+    MATERIAL_SATURN,
+    MATERIAL_PLAIN, // Untextured, drawn with Body::color
+    MATERIAL_COUNT
+};
+
+// Slots of the material table (see "Texture arrays and material table")
+const int kMaterialSlots = MATERIAL_COUNT;
+const int kMaxMaterialSlots = 16;         // Size of the Materials block in fragmentShader.glsl
+const GLuint kMaterialBlockBinding = 0;
+const GLuint kShadowBlockBinding = 1; // Occluders block (see Eclipse shadows)
+const GLuint kAtmosphereTextureUnit = 2; // Transmittance, scattering and irradiance tables on units 2-4
+const GLuint kEnvironmentTextureUnit = 5; // Prefiltered sky (see Environment lighting)
+const GLuint kLightTextureUnit = 6; // Point lights and their cluster lists on units 6-7 (see Clustered lights)
+static_assert(kMaterialSlots <= kMaxMaterialSlots, "the Materials uniform block is too small");
+
+enum BodyKind {
+    BODY_STAR,
+    BODY_PLANET,
+    BODY_MOON,
+    BODY_RING_PARTICLE,
+    BODY_ASTEROID
+};
+
+// A celestial body orbiting its parent. Orbit radius and size are expressed in
+// the parent's local frame (its model matrix, scale included), which is how the
+// Moon has always been attached to the Earth.
+struct Body {
+    BodyKind kind;
+    int parent;             // Index in g_bodies of the body orbited, -1 for none
+    float size;
+    float orbitRadius;
+    float orbitPeriod;      // 0 means no orbital motion
+    float orbitPhase;       // Radians
+    float orbitInclination; // Radians, around the X axis
+    float rotationPeriod;   // 0 means no spin
+    BodyMaterial material;
+    glm::vec3 color;
+    bool hasRing;
+    bool hasAtmosphere;     // Drawn with atmospheric scattering (see Atmospheric scattering)
+    int depth;              // Number of ancestors, filled by buildScene
+};
+
+// Parameters of a procedurally generated stress scene
+struct ScenarioConfig {
+    unsigned int seed;
+    int planets;
+    int moonsPerPlanet;
+    int ringParticles;
+    int asteroids;
+    bool trueScale; // Default scene at real sizes and distances (unit: 1000 km)
+    int lights;     // Point lights orbiting the bodies, in any scene (see Clustered lights)
+
+    ScenarioConfig()
+        : seed(42), planets(0), moonsPerPlanet(0), ringParticles(0), asteroids(0), trueScale(false), lights(0) {}
+
+    bool isDefaultScene() const {
+        return planets == 0 && ringParticles == 0 && asteroids == 0;
+    }
+};
+
+// Scene: bodies are stored parents first, so world matrices can be computed in one pass
+std::vector<Body> g_bodies;
+std::vector<glm::mat4> g_bodyWorldMats;
+std::vector<unsigned char> g_bodyVisible;
+int g_maxBodyDepth = 0;
+ScenarioConfig g_scenario;
+
+// A colored point light (a spacecraft's lamp) on a circular orbit around a body,
+// at a distance in radii of that body. Its light falls off with the inverse square
+// of the distance and is cut off at range.
+struct PointLight {
+    int body;               // Index in g_bodies of the body orbited
+    float orbitRadius;      // In radii of the body
+    float orbitPeriod;
+    float orbitPhase;       // Radians
+    float orbitInclination; // Radians, around the X axis
+    glm::vec3 color;        // Times the intensity: irradiance at unit distance
+    float range;            // In radii of the body
+};
+
+const int kMaxPointLights = 65535; // Light indices are 16-bit while the cluster lists are built
+
+std::vector<PointLight> g_lights;
+std::vector<glm::vec4> g_lightSpheres; // Per light, each frame: world position and range
+
 // Camera class with movement and zoom support
 class Camera {
 public:
@@ -122,15 +250,31 @@ public:
     inline void setNear(const float n) { m_near = n; }
     inline float getFar() const { return m_far; }
     inline void setFar(const float n) { m_far = n; }
+    inline void setSpeed(const float s) { m_speed = s; }
     inline void setPosition(const glm::vec3 &p) { m_pos = p; }
     inline glm::vec3 getPosition() { return m_pos; }
 
+    void setOrientation(const float yaw, const float pitch) {
+        m_yaw = yaw;
+        m_pitch = pitch;
+        updateCameraVectors();
+    }
+
     inline glm::mat4 computeViewMatrix() const {
         return glm::lookAt(m_pos, m_pos + m_front, m_up);
     }
 
+    // Reverse-Z with an infinite far plane: clip z is m_near and w the distance,
+    // so depth goes from 1 at the near plane to 0 at infinity, which spreads the
+    // precision of a floating-point depth buffer evenly over distances
     inline glm::mat4 computeProjectionMatrix() const {
-        return glm::perspective(glm::radians(m_fov), m_aspectRatio, m_near, m_far);
+        const float f = 1.0f / std::tan(glm::radians(m_fov) * 0.5f);
+        glm::mat4 projection(0.0f);
+        projection[0][0] = f / m_aspectRatio;
+        projection[1][1] = f;
+        projection[2][3] = -1.0f;
+        projection[3][2] = m_near;
+        return projection;
     }
 
     void processKeyboard(int key, float deltaTime) {
@@ -230,644 +374,5848 @@ private:
 
 Camera g_camera;
 
-// Function to load a texture from file and upload to GPU
-GLuint loadTextureFromFileToGPU(const std::string &filename) {
-    int width, height, numComponents;
-    unsigned char *data = stbi_load(filename.c_str(), &width, &height, &numComponents, 0);
+//------------------------------------------------------------------------------
+// Memory: allocation tracking, frame arena and scratch allocators
+//------------------------------------------------------------------------------
 
-    if (data == nullptr) {
-        std::cerr << "Error: texture " << filename << " not found" << std::endl;
-        return 0;
-    }
+// Every operator new goes through this counter, so a frame's heap allocations
+// are the difference between two reads. Memory from C libraries (GLFW, the
+// driver, stb_image's malloc) is not counted.
+std::atomic<unsigned long long> g_heapAllocations(0);
 
-    std::cout << "Loaded texture " << filename << " with width=" << width
-              << " height=" << height << " numComponents=" << numComponents << std::endl;
+void *operator new(std::size_t size) {
+    g_heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
 
-    GLuint texID;
-    glGenTextures(1, &texID);
-    glBindTexture(GL_TEXTURE_2D, texID);
+void *operator new[](std::size_t size) {
+    return operator new(size);
+}
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    g_heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
 
-    GLenum format = GL_RGB;
-    if (numComponents == 1)
-        format = GL_RED;
-    else if (numComponents == 3)
-        format = GL_RGB;
-    else if (numComponents == 4)
-        format = GL_RGBA;
+void *operator new[](std::size_t size, const std::nothrow_t &tag) noexcept {
+    return operator new(size, tag);
+}
 
-    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+// Kept out of line so GCC does not pair the inlined free() with operator new
+#if defined(__GNUC__)
+#define TRACKING_NOINLINE __attribute__((noinline))
+#else
+#define TRACKING_NOINLINE
+#endif
+
+TRACKING_NOINLINE void operator delete(void *p) noexcept { std::free(p); }
+TRACKING_NOINLINE void operator delete[](void *p) noexcept { std::free(p); }
+TRACKING_NOINLINE void operator delete(void *p, const std::nothrow_t &) noexcept { std::free(p); }
+TRACKING_NOINLINE void operator delete[](void *p, const std::nothrow_t &) noexcept { std::free(p); }
+
+// Bump allocator: allocations are a pointer increment and are all released at
+// once by reset() or by rewinding to a marker. When a frame overflows the block,
+// the extra requests go to the heap and the next reset() grows the block to the
+// high-water mark, so the steady state does not touch the heap.
+class LinearArena {
+public:
+    explicit LinearArena(size_t capacity = 0) : m_capacity(0), m_offset(0), m_highWater(0) {
+        grow(capacity);
+    }
 
-    stbi_image_free(data);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    return texID;
-}
+    void *allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+        const size_t start = (m_offset + alignment - 1) & ~(alignment - 1);
+        if (start + size <= m_capacity) {
+            m_offset = start + size;
+            m_highWater = std::max(m_highWater, m_offset);
+            return m_block.get() + start;
+        }
+        m_highWater = std::max(m_highWater, start + size);
+        m_overflow.push_back(std::unique_ptr<char[]>(new char[size + alignment]));
+        const uintptr_t raw = reinterpret_cast<uintptr_t>(m_overflow.back().get());
+        return reinterpret_cast<void *>((raw + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    }
 
-// Function to load cubemap textures
-GLuint loadCubemap(const std::vector<std::string>& faces) {
-    GLuint textureID;
-    glGenTextures(1, &textureID);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
+    template <typename T>
+    T *allocateArray(size_t count) {
+        return static_cast<T *>(allocate(count * sizeof(T), alignof(T)));
+    }
 
-    int width, height, numComponents;
-    for (GLuint i = 0; i < faces.size(); i++) {
-        unsigned char *data = stbi_load(faces[i].c_str(), &width, &height, &numComponents, 0);
-        if (data) {
-            GLenum format = GL_RGB;
-            if (numComponents == 1)
-                format = GL_RED;
-            else if (numComponents == 3)
-                format = GL_RGB;
-            else if (numComponents == 4)
-                format = GL_RGBA;
-
-            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
-                         0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-            stbi_image_free(data);
-        } else {
-            std::cerr << "Cubemap texture failed to load at path: " << faces[i] << std::endl;
-            stbi_image_free(data);
-            return 0;
+    size_t getMarker() const { return m_offset; }
+    void rewind(size_t marker) { m_offset = marker; }
+
+    void reset() {
+        if (!m_overflow.empty()) {
+            m_overflow.clear();
+            grow(m_highWater * 2);
         }
+        m_offset = 0;
+    }
+
+    size_t getCapacity() const { return m_capacity; }
+    size_t getHighWater() const { return m_highWater; }
+
+private:
+    void grow(size_t capacity) {
+        if (capacity <= m_capacity)
+            return;
+        m_block.reset(new char[capacity]);
+        m_capacity = capacity;
     }
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR); 
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR); 
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); 
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE); 
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE); 
-    return textureID;
+
+    std::unique_ptr<char[]> m_block;
+    size_t m_capacity;
+    size_t m_offset;
+    size_t m_highWater;
+    std::vector<std::unique_ptr<char[]>> m_overflow;
+};
+
+// STL allocator on top of an arena (deallocation is a no-op), for per-frame containers
+template <typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+
+    LinearArena *arena;
+
+    explicit ArenaAllocator(LinearArena &a) : arena(&a) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t n) { return arena->allocateArray<T>(n); }
+    void deallocate(T *, size_t) {}
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.arena == b.arena; }
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.arena != b.arena; }
+
+// Data that lives for the current frame only (main thread), reset at the start of each frame
+LinearArena g_frameArena(1 << 20);
+
+// Per-thread scratch memory for transient data inside a function or a job.
+// ScratchScope gives back everything allocated during its lifetime.
+LinearArena &scratchArena() {
+    static thread_local LinearArena arena(256 << 10);
+    return arena;
 }
 
-class Mesh {
+class ScratchScope {
 public:
-    void init() {
-        glGenVertexArrays(1, &m_vao);
-        glBindVertexArray(m_vao);
+    ScratchScope() : m_arena(scratchArena()), m_marker(m_arena.getMarker()) {}
+    ~ScratchScope() {
+        m_arena.rewind(m_marker);
+        if (m_marker == 0)
+            m_arena.reset(); // Outermost scope: fold any overflow into the block
+    }
+    LinearArena &arena() { return m_arena; }
 
-        glGenBuffers(1, &m_posVbo);
-        glBindBuffer(GL_ARRAY_BUFFER, m_posVbo);
-        glBufferData(GL_ARRAY_BUFFER, m_vertexPositions.size() * sizeof(float), m_vertexPositions.data(), GL_STATIC_DRAW);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
-        glEnableVertexAttribArray(0);
+private:
+    LinearArena &m_arena;
+    size_t m_marker;
+};
 
-        if (!m_vertexNormals.empty()) {
-            glGenBuffers(1, &m_normalVbo);
-            glBindBuffer(GL_ARRAY_BUFFER, m_normalVbo);
-            glBufferData(GL_ARRAY_BUFFER, m_vertexNormals.size() * sizeof(float), m_vertexNormals.data(), GL_STATIC_DRAW);
-            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
-            glEnableVertexAttribArray(1);
-        }
+//------------------------------------------------------------------------------
+// Job system
+//------------------------------------------------------------------------------
 
-        if (!m_vertexTexCoords.empty()) {
-            glGenBuffers(1, &m_texCoordVbo);
-            glBindBuffer(GL_ARRAY_BUFFER, m_texCoordVbo);
-            glBufferData(GL_ARRAY_BUFFER, m_vertexTexCoords.size() * sizeof(float), m_vertexTexCoords.data(), GL_STATIC_DRAW);
-            glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
-            glEnableVertexAttribArray(2);
-        }
+// Work-stealing job system. Each worker owns a deque: it pushes and pops jobs at
+// the back (LIFO, cache-warm), idle workers steal from the front of the others'.
+// A job is finished once it and all the children created under it have run, so
+// waiting on a parent waits for the whole tree. The thread calling start() is
+// worker 0 and helps with the work while it waits.
+class JobSystem {
+public:
+    struct Job;
+    typedef void (*JobFunction)(Job &job);
+
+    struct Job {
+        JobFunction function;
+        const void *data;
+        size_t begin;
+        size_t end;
+        Job *parent;
+        std::atomic<int> unfinished; // This job plus its unfinished children
+    };
 
-        if (!m_triangleIndices.empty()) {
-            glGenBuffers(1, &m_ibo);
-            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo);
-            glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_triangleIndices.size() * sizeof(unsigned int), m_triangleIndices.data(), GL_STATIC_DRAW);
-        }
+    // Utilization of one worker since the last call to collectStats()
+    struct WorkerStats {
+        double busyMs;
+        unsigned int jobs;
+        unsigned int steals;
+    };
 
-        glBindVertexArray(0);
+    JobSystem() : m_workerCount(0), m_nextDetachedJob(0), m_running(false), m_sleepingWorkers(0) {
+        for (size_t i = 0; i < kMaxDetachedJobs; ++i)
+            m_detachedJobs[i].unfinished = 0;
     }
 
-    void render() {
-        glBindVertexArray(m_vao);
-        if (!m_triangleIndices.empty()) {
-            glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(m_triangleIndices.size()), GL_UNSIGNED_INT, 0);
-        } else {
-            glDrawArrays(GL_TRIANGLES, 0, static_cast<GLsizei>(m_vertexPositions.size() / 3));
-        }
-        glBindVertexArray(0);
+    void start(int workerThreads = -1) {
+        if (workerThreads < 0)
+            workerThreads = std::max(static_cast<int>(std::thread::hardware_concurrency()) - 1, 0);
+        m_workerCount = workerThreads + 1;
+        m_workers.reset(new Worker[m_workerCount]);
+        m_stats.resize(m_workerCount);
+        m_running = true;
+        t_workerIndex = 0;
+        for (int i = 1; i < m_workerCount; ++i)
+            m_threads.push_back(std::thread(&JobSystem::workerLoop, this, i));
     }
 
-    // Generate a sphere mesh with updated math to match user's code
-    static std::shared_ptr<Mesh> genSphere(const size_t resolution=16){
-        auto mesh = std::make_shared<Mesh>();
-        for (size_t lat = 0; lat <= resolution; ++lat) {
-            float phi = lat * PI / resolution;
-            for (size_t lon = 0; lon <= resolution; ++lon) {
-                float theta = lon * 2.0f * PI / resolution;
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(m_wakeMutex);
+            m_running = false;
+        }
+        m_wakeCondition.notify_all();
+        for (size_t i = 0; i < m_threads.size(); ++i)
+            m_threads[i].join();
+        m_threads.clear();
+    }
 
-                // Updated math: x = sin(phi) * sin(theta), z = sin(phi) * cos(theta)
-                float x = sin(phi) * sin(theta);
-                float y = cos(phi);
-                float z = sin(phi) * cos(theta);
+    int getWorkerCount() const { return m_workerCount; }
+
+    // Index of the calling worker (0 for the thread that called start(), -1 for a foreign thread)
+    static int currentWorkerIndex() { return t_workerIndex; }
+
+    // Jobs come from a per-worker ring that is recycled, so a job must be waited
+    // on within kMaxJobsPerWorker creations on the same thread; reusing one still
+    // in flight aborts
+    Job *createJob(JobFunction function, const void *data, Job *parent = nullptr, size_t begin = 0, size_t end = 0) {
+        Worker &worker = m_workers[callingWorkerIndex()];
+        Job *job = &worker.jobPool[worker.nextJob++ % kMaxJobsPerWorker];
+        if (job->unfinished.load() != 0)
+            fail("more than kMaxJobsPerWorker jobs in flight on one worker");
+        job->function = function;
+        job->data = data;
+        job->begin = begin;
+        job->end = end;
+        job->parent = parent;
+        job->unfinished = 1;
+        if (parent)
+            ++parent->unfinished;
+        return job;
+    }
 
-                mesh->m_vertexPositions.push_back(x);
-                mesh->m_vertexPositions.push_back(y);
-                mesh->m_vertexPositions.push_back(z);
+    // Job that is polled with isDone() rather than waited on, so it may stay in
+    // flight across frames, started with runDetached(). Detached jobs come from
+    // their own ring of kMaxDetachedJobs and are only created from worker 0.
+    Job *createDetachedJob(JobFunction function, const void *data) {
+        Job *job = &m_detachedJobs[m_nextDetachedJob++ % kMaxDetachedJobs];
+        if (job->unfinished.load() != 0)
+            fail("more than kMaxDetachedJobs detached jobs in flight");
+        job->function = function;
+        job->data = data;
+        job->begin = job->end = 0;
+        job->parent = nullptr;
+        job->unfinished = 1;
+        return job;
+    }
 
-                mesh->m_vertexNormals.push_back(x);
-                mesh->m_vertexNormals.push_back(y);
-                mesh->m_vertexNormals.push_back(z);
+    bool isDone(const Job *job) const { return job->unfinished.load() == 0; }
 
-                float u = static_cast<float>(lon) / resolution;
-                float v = static_cast<float>(lat) / resolution;
+    // Queue a job on the calling worker
+    void run(Job *job) {
+        m_workers[callingWorkerIndex()].queue.push(job);
+        wakeWorker();
+    }
 
-                mesh->m_vertexTexCoords.push_back(u);
-                mesh->m_vertexTexCoords.push_back(v);
+    // Queue a detached job for the worker threads only: worker 0 is the main
+    // thread, which would otherwise pick it up while waiting on a frame's jobs
+    // and stall that frame. Without worker threads it runs right away.
+    void runDetached(Job *job) {
+        if (m_workerCount == 1) {
+            job->function(*job);
+            finish(job);
+            return;
+        }
+        m_detachedQueue.push(job);
+        wakeWorker();
+    }
 
-                if (lat < resolution && lon < resolution) {
-                    size_t idx = lat * (resolution + 1) + lon;
-                    mesh->m_triangleIndices.push_back(static_cast<unsigned int>(idx));
-                    mesh->m_triangleIndices.push_back(static_cast<unsigned int>(idx + resolution + 1));
-                    mesh->m_triangleIndices.push_back(static_cast<unsigned int>(idx + resolution + 2));
+    // Run one queued job on the calling worker; false if there was none
+    bool runPendingJob() { return executeNext(callingWorkerIndex()); }
 
-                    mesh->m_triangleIndices.push_back(static_cast<unsigned int>(idx));
-                    mesh->m_triangleIndices.push_back(static_cast<unsigned int>(idx + resolution + 2));
-                    mesh->m_triangleIndices.push_back(static_cast<unsigned int>(idx + 1));
-                }
-            }
+    // Run other jobs until the given one (and its children) completed
+    void wait(const Job *job) {
+        const int index = callingWorkerIndex();
+        while (job->unfinished.load() > 0) {
+            if (!executeNext(index))
+                std::this_thread::yield();
         }
-        return mesh;
     }
 
-    // Generate a cube mesh for skybox
-    static std::shared_ptr<Mesh> genCube() {
-        auto mesh = std::make_shared<Mesh>();
-        float vertices[] = {
-            // positions          
-            -1.0f,  1.0f, -1.0f,  
-            -1.0f, -1.0f, -1.0f,  
-             1.0f, -1.0f, -1.0f,  
-             1.0f, -1.0f, -1.0f,  
-             1.0f,  1.0f, -1.0f,  
-            -1.0f,  1.0f, -1.0f,  
-
-            -1.0f, -1.0f,  1.0f,  
-            -1.0f, -1.0f, -1.0f,  
-            -1.0f,  1.0f, -1.0f,  
-            -1.0f,  1.0f, -1.0f,  
-            -1.0f,  1.0f,  1.0f,  
-            -1.0f, -1.0f,  1.0f,  
-
-             1.0f, -1.0f, -1.0f,  
-             1.0f, -1.0f,  1.0f,  
-             1.0f,  1.0f,  1.0f,  
-             1.0f,  1.0f,  1.0f,  
-             1.0f,  1.0f, -1.0f,  
-             1.0f, -1.0f, -1.0f,  
-
-            -1.0f, -1.0f,  1.0f,  
-            -1.0f,  1.0f,  1.0f,  
-             1.0f,  1.0f,  1.0f,  
-             1.0f,  1.0f,  1.0f,  
-             1.0f, -1.0f,  1.0f,  
-            -1.0f, -1.0f,  1.0f,  
-
-            -1.0f,  1.0f, -1.0f,  
-             1.0f,  1.0f, -1.0f,  
-             1.0f,  1.0f,  1.0f,  
-             1.0f,  1.0f,  1.0f,  
-            -1.0f,  1.0f,  1.0f,  
-            -1.0f,  1.0f, -1.0f,  
-
-            -1.0f, -1.0f, -1.0f,  
-            -1.0f, -1.0f,  1.0f,  
-             1.0f, -1.0f, -1.0f,  
-             1.0f, -1.0f, -1.0f,  
-            -1.0f, -1.0f,  1.0f,  
-             1.0f, -1.0f,  1.0f   
-        };
-        mesh->m_vertexPositions.assign(vertices, vertices + sizeof(vertices) / sizeof(float));
-        return mesh;
+    // Call f(begin, end) over [first, last) split in chunks. Ranges are halved
+    // recursively down to a grain of at least minChunk; a job stops splitting
+    // when its own queue still holds work nobody stole (lazy binary splitting).
+    template <typename F>
+    void parallelFor(size_t first, size_t last, size_t minChunk, const F &f) {
+        if (first >= last)
+            return;
+        ParallelForData<F> data;
+        data.function = &f;
+        data.system = this;
+        data.grain = std::max<size_t>(std::max<size_t>(minChunk, 1), (last - first) / (8 * m_workerCount));
+        Job *root = createJob(&parallelForJob<F>, &data, nullptr, first, last);
+        run(root);
+        wait(root);
     }
 
-    // Generate a ring mesh (annulus) with given inner and outer radii and resolution
-    static std::shared_ptr<Mesh> genRing(float innerRadius, float outerRadius, size_t resolution = 64) {
-        auto mesh = std::make_shared<Mesh>();
-        for (size_t i = 0; i <= resolution; ++i) {
-            float theta = i * 2.0f * PI / resolution;
-            float cosTheta = cos(theta);
-            float sinTheta = sin(theta);
-
-            // Outer vertex
-            float x_outer = outerRadius * cosTheta;
-            float z_outer = outerRadius * sinTheta;
-            mesh->m_vertexPositions.push_back(x_outer);
-            mesh->m_vertexPositions.push_back(0.0f); // Flat ring in XZ plane
-            mesh->m_vertexPositions.push_back(z_outer);
-
-            // Inner vertex
-            float x_inner = innerRadius * cosTheta;
-            float z_inner = innerRadius * sinTheta;
-            mesh->m_vertexPositions.push_back(x_inner);
-            mesh->m_vertexPositions.push_back(0.0f);
-            mesh->m_vertexPositions.push_back(z_inner);
-
-            // Normals (pointing up)
-            mesh->m_vertexNormals.push_back(0.0f);
-            mesh->m_vertexNormals.push_back(1.0f);
-            mesh->m_vertexNormals.push_back(0.0f);
-
-            mesh->m_vertexNormals.push_back(0.0f);
-            mesh->m_vertexNormals.push_back(1.0f);
-            mesh->m_vertexNormals.push_back(0.0f);
-
-            // Texture coordinates
-            float u = static_cast<float>(i) / resolution;
-            mesh->m_vertexTexCoords.push_back(u);
-            mesh->m_vertexTexCoords.push_back(0.0f); // Outer edge
-            mesh->m_vertexTexCoords.push_back(u);
-            mesh->m_vertexTexCoords.push_back(1.0f); // Inner edge
-        }
-
-        // Generate triangle strip indices
-        for (size_t i = 0; i < resolution; ++i) {
-            mesh->m_triangleIndices.push_back(static_cast<unsigned int>(2 * i));
-            mesh->m_triangleIndices.push_back(static_cast<unsigned int>(2 * i + 1));
-            mesh->m_triangleIndices.push_back(static_cast<unsigned int>(2 * (i + 1)));
-
-            mesh->m_triangleIndices.push_back(static_cast<unsigned int>(2 * (i + 1)));
-            mesh->m_triangleIndices.push_back(static_cast<unsigned int>(2 * i + 1));
-            mesh->m_triangleIndices.push_back(static_cast<unsigned int>(2 * (i + 1) + 1));
+    // Per-worker counters since the previous call
+    const std::vector<WorkerStats> &collectStats() {
+        for (int i = 0; i < m_workerCount; ++i) {
+            m_stats[i].busyMs = m_workers[i].busyNs.exchange(0) * 1e-6;
+            m_stats[i].jobs = m_workers[i].jobs.exchange(0);
+            m_stats[i].steals = m_workers[i].steals.exchange(0);
         }
-
-        return mesh;
+        return m_stats;
     }
 
-    // Generate a ring mesh with multiple layers (optional)
-    // You can extend this method to support multiple ring layers if desired
+private:
+    static const size_t kMaxJobsPerWorker = 4096;
+    static const size_t kMaxDetachedJobs = 64;
 
-    GLuint getVao() const { return m_vao; }
+    // Misuse of the system, which would otherwise corrupt jobs silently
+    static void fail(const char *what) {
+        std::cerr << "ERROR: job system: " << what << std::endl;
+        std::abort();
+    }
 
-private:
-    std::vector<float> m_vertexPositions;
-    std::vector<float> m_vertexNormals;
-    std::vector<unsigned int> m_triangleIndices;
-    std::vector<float> m_vertexTexCoords;
-    GLuint m_texCoordVbo = 0;
-    GLuint m_vao = 0;
-    GLuint m_posVbo = 0;
-    GLuint m_normalVbo = 0;
-    GLuint m_ibo = 0;
-};
+    // Workers are the thread that called start() and the system's own threads;
+    // any other thread would share worker 0's queue and job pool unlocked
+    static int callingWorkerIndex() {
+        if (t_workerIndex < 0)
+            fail("called from a thread that is not one of its workers");
+        return t_workerIndex;
+    }
 
-// Declare the sphere, skybox, and ring meshes
-std::shared_ptr<Mesh> g_sphereMesh = std::make_shared<Mesh>();
-std::shared_ptr<Mesh> skyboxMesh = std::make_shared<Mesh>();
-std::shared_ptr<Mesh> g_ringMesh = nullptr; // Added for Saturn's rings
+    // Bounded deque guarded by a mutex; the owner uses the back, thieves the front
+    struct JobQueue {
+        std::mutex mutex;
+        Job *jobs[kMaxJobsPerWorker];
+        size_t front;
+        size_t back;
 
-// Skybox variables
-GLuint cubemapTexture;
+        JobQueue() : front(0), back(0) {}
 
-// Ring texture
-GLuint ringTexture = 0;
+        void push(Job *job) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (back - front == kMaxJobsPerWorker)
+                fail("more than kMaxJobsPerWorker jobs queued on one worker");
+            jobs[back++ % kMaxJobsPerWorker] = job;
+        }
+        Job *pop() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return back > front ? jobs[--back % kMaxJobsPerWorker] : nullptr;
+        }
+        Job *steal() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return back > front ? jobs[front++ % kMaxJobsPerWorker] : nullptr;
+        }
+        size_t size() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return back - front;
+        }
+    };
 
-// Time management
-float deltaTime = 0.0f;	
-float lastFrame = 0.0f;
+    struct Worker {
+        JobQueue queue;
+        Job jobPool[kMaxJobsPerWorker];
+        size_t nextJob;
+        std::atomic<unsigned long long> busyNs;
+        std::atomic<unsigned int> jobs;
+        std::atomic<unsigned int> steals;
+
+        Worker() : nextJob(0), busyNs(0), jobs(0), steals(0) {
+            for (size_t i = 0; i < kMaxJobsPerWorker; ++i)
+                jobPool[i].unfinished = 0;
+        }
+    };
 
-// Simulation time and state
-float simulationTime = 0.0f; // Custom simulation time
-bool isSimulationFrozen = false; // Simulation frozen state
+    template <typename F>
+    struct ParallelForData {
+        const F *function;
+        JobSystem *system;
+        size_t grain;
+    };
 
-// Input handling
-bool keys[1024] = { false };
+    template <typename F>
+    static void parallelForJob(Job &job) {
+        const ParallelForData<F> &data = *static_cast<const ParallelForData<F> *>(job.data);
+        size_t begin = job.begin, end = job.end;
+        while (end - begin > data.grain && data.system->localQueueSize() < 2) {
+            const size_t middle = begin + (end - begin) / 2;
+            data.system->run(data.system->createJob(&parallelForJob<F>, job.data, &job, middle, end));
+            end = middle;
+        }
+        (*data.function)(begin, end);
+    }
 
-// GLFW callbacks
-void windowSizeCallback(GLFWwindow *window, int width, int height) {
-    g_camera.setAspectRatio(static_cast<float>(width) / static_cast<float>(height));
-    glViewport(0, 0, (GLint)width, (GLint)height);
-}
+    size_t localQueueSize() { return m_workers[callingWorkerIndex()].queue.size(); }
 
-void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods) {
-    if (key >= 0 && key < 1024) {
-        if (action == GLFW_PRESS)
-            keys[key] = true;
-        else if (action == GLFW_RELEASE)
-            keys[key] = false;
+    void finish(Job *job) {
+        while (job && --job->unfinished == 0)
+            job = job->parent;
     }
 
-    if (action == GLFW_PRESS && key == GLFW_KEY_ESCAPE)
-        glfwSetWindowShouldClose(window, true);
+    void wakeWorker() {
+        // Pairs with the sleeping worker's fence: either it sees the job, or we see it asleep
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_sleepingWorkers.load() > 0) {
+            { std::lock_guard<std::mutex> lock(m_wakeMutex); }
+            m_wakeCondition.notify_one();
+        }
+    }
 
-    if (action == GLFW_PRESS && key == GLFW_KEY_F) {
-        isSimulationFrozen = !isSimulationFrozen;
+    bool executeNext(int index) {
+        Worker &worker = m_workers[index];
+        Job *job = worker.queue.pop();
+        for (int i = 1; !job && i < m_workerCount; ++i) {
+            job = m_workers[(index + i) % m_workerCount].queue.steal();
+            if (job)
+                ++worker.steals;
+        }
+        if (!job && index != 0)
+            job = m_detachedQueue.steal(); // Oldest first
+        if (!job)
+            return false;
+
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        job->function(*job);
+        finish(job);
+        worker.busyNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        ++worker.jobs;
+        return true;
     }
-}
 
-void mouseCallback(GLFWwindow* window, double xpos, double ypos) {
-    g_camera.processMouseMovement(static_cast<float>(xpos), static_cast<float>(ypos));
-}
+    bool hasQueuedJobs() {
+        for (int i = 0; i < m_workerCount; ++i)
+            if (m_workers[i].queue.size() > 0)
+                return true;
+        return m_detachedQueue.size() > 0;
+    }
 
-void scrollCallback(GLFWwindow* window, double xoffset, double yoffset) {
-    g_camera.processMouseScroll(static_cast<float>(yoffset));
-}
+    // Idle workers sleep until run() queues a job, so an idle program uses no CPU
+    void workerLoop(int index) {
+        t_workerIndex = index;
+        while (m_running) {
+            if (executeNext(index))
+                continue;
+            std::unique_lock<std::mutex> lock(m_wakeMutex);
+            ++m_sleepingWorkers;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while (m_running && !hasQueuedJobs())
+                m_wakeCondition.wait(lock);
+            --m_sleepingWorkers;
+        }
+    }
 
-void doMovement() {
-    if (keys[GLFW_KEY_W])
-        g_camera.processKeyboard(GLFW_KEY_W, deltaTime);
-    if (keys[GLFW_KEY_S])
-        g_camera.processKeyboard(GLFW_KEY_S, deltaTime);
-    if (keys[GLFW_KEY_A])
-        g_camera.processKeyboard(GLFW_KEY_A, deltaTime);
-    if (keys[GLFW_KEY_D])
-        g_camera.processKeyboard(GLFW_KEY_D, deltaTime);
-    if (keys[GLFW_KEY_SPACE])
-        g_camera.processKeyboard(GLFW_KEY_SPACE, deltaTime);
-    if (keys[GLFW_KEY_LEFT_SHIFT])
-        g_camera.processKeyboard(GLFW_KEY_LEFT_SHIFT, deltaTime);
+    static thread_local int t_workerIndex;
+
+    int m_workerCount;
+    std::unique_ptr<Worker[]> m_workers;
+    Job m_detachedJobs[kMaxDetachedJobs];
+    size_t m_nextDetachedJob;
+    JobQueue m_detachedQueue; // Taken by the worker threads only
+    std::vector<WorkerStats> m_stats;
+    std::vector<std::thread> m_threads;
+    std::atomic<bool> m_running;
+    std::atomic<int> m_sleepingWorkers;
+    std::mutex m_wakeMutex;
+    std::condition_variable m_wakeCondition;
+};
 
-    // Zoom key handling
-    if (keys[GLFW_KEY_Q])
-        g_camera.processKeyboardZoom(true, deltaTime); // Zoom in
-    if (keys[GLFW_KEY_E])
-        g_camera.processKeyboardZoom(false, deltaTime); // Zoom out
-}
+thread_local int JobSystem::t_workerIndex = -1;
 
-void errorCallback(int error, const char *desc) {
-    std::cout << "Error " << error << ": " << desc << std::endl;
-}
+JobSystem g_jobs;
 
-void initGLFW() {
-    glfwSetErrorCallback(errorCallback);
+//------------------------------------------------------------------------------
+// Asset archive
+//------------------------------------------------------------------------------
 
-    if (!glfwInit()) {
-        std::cerr << "ERROR: Failed to init GLFW" << std::endl;
-        std::exit(EXIT_FAILURE);
-    }
+// LZ4 block format: sequences of [token][literal length+][literals][offset:2][match length+]
+// where the token holds 4 bits of literal length and 4 bits of match length - 4,
+// 15 meaning "continued in the following bytes". Matches reach at most 64 KB back.
+const size_t kLZ4MinMatch = 4;
+const size_t kLZ4HashBits = 16;
 
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); 
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE); 
-    glfwWindowHint(GLFW_RESIZABLE, GL_TRUE);
+inline size_t lz4CompressBound(size_t size) { return size + size / 255 + 16; }
 
-    g_window = glfwCreateWindow(1024, 1024, "Simple Solar System with Saturn's Rings", nullptr, nullptr);
-    if (!g_window) {
-        std::cerr << "ERROR: Failed to open window" << std::endl;
-        glfwTerminate();
-        std::exit(EXIT_FAILURE);
-    }
+inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
 
-    glfwMakeContextCurrent(g_window);
-    glfwSetWindowSizeCallback(g_window, windowSizeCallback);
-    glfwSetKeyCallback(g_window, keyCallback);
-    glfwSetCursorPosCallback(g_window, mouseCallback);
-    glfwSetScrollCallback(g_window, scrollCallback);
-    glfwSetInputMode(g_window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+inline unsigned char *writeLZ4Length(unsigned char *out, size_t length) {
+    for (; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = static_cast<unsigned char>(length);
+    return out;
 }
 
-void initOpenGL() {
-    if (!gladLoadGL(glfwGetProcAddress)) {
-        std::cerr << "ERROR: Failed to initialize OpenGL context" << std::endl;
-        glfwTerminate();
-        std::exit(EXIT_FAILURE);
+// Greedy compressor with a single-entry hash table; dst holds lz4CompressBound(size)
+// bytes. Returns the compressed size.
+size_t lz4Compress(const unsigned char *src, size_t size, unsigned char *dst) {
+    std::vector<uint32_t> table(static_cast<size_t>(1) << kLZ4HashBits, 0); // Position + 1, 0 is empty
+    unsigned char *out = dst;
+    size_t anchor = 0;
+    // The format keeps the last 5 bytes literal and starts no match in the last 12
+    const size_t matchStartLimit = size > 12 ? size - 12 : 0;
+    const size_t matchEndLimit = size > 5 ? size - 5 : 0;
+
+    for (size_t i = 0; i < matchStartLimit;) {
+        const uint32_t sequence = read32(src + i);
+        const uint32_t hash = (sequence * 2654435761u) >> (32 - kLZ4HashBits);
+        const size_t candidate = table[hash];
+        table[hash] = static_cast<uint32_t>(i + 1);
+        if (candidate == 0 || i - (candidate - 1) > 65535 || read32(src + candidate - 1) != sequence) {
+            ++i;
+            continue;
+        }
+
+        const size_t match = candidate - 1;
+        size_t length = kLZ4MinMatch;
+        while (i + length < matchEndLimit && src[match + length] == src[i + length])
+            ++length;
+
+        const size_t literals = i - anchor;
+        unsigned char *token = out++;
+        *token = static_cast<unsigned char>(std::min<size_t>(literals, 15) << 4);
+        if (literals >= 15)
+            out = writeLZ4Length(out, literals - 15);
+        std::memcpy(out, src + anchor, literals);
+        out += literals;
+        const size_t offset = i - match;
+        *out++ = static_cast<unsigned char>(offset & 0xFF);
+        *out++ = static_cast<unsigned char>(offset >> 8);
+        *token |= static_cast<unsigned char>(std::min<size_t>(length - kLZ4MinMatch, 15));
+        if (length - kLZ4MinMatch >= 15)
+            out = writeLZ4Length(out, length - kLZ4MinMatch - 15);
+
+        i += length;
+        anchor = i;
     }
 
-    glCullFace(GL_BACK);                  
-    glEnable(GL_CULL_FACE);               
-    glDepthFunc(GL_LESS);                 
-    glEnable(GL_DEPTH_TEST);              
-    glClearColor(0.7f, 0.7f, 0.7f, 1.0f); 
+    // Last literals
+    const size_t literals = size - anchor;
+    *out++ = static_cast<unsigned char>(std::min<size_t>(literals, 15) << 4);
+    if (literals >= 15)
+        out = writeLZ4Length(out, literals - 15);
+    std::memcpy(out, src + anchor, literals);
+    out += literals;
+    return static_cast<size_t>(out - dst);
 }
 
-// Load shader from file
-std::string file2String(const std::string &filename) {
-    std::ifstream t(filename.c_str());
-    if (!t.is_open()) {
-        std::cerr << "ERROR: Could not open shader file " << filename << std::endl;
-        std::exit(EXIT_FAILURE);
+// Decompress a block into exactly dstSize bytes; false on malformed input
+bool lz4Decompress(const unsigned char *src, size_t srcSize, unsigned char *dst, size_t dstSize) {
+    const unsigned char *in = src, *inEnd = src + srcSize;
+    unsigned char *out = dst, *outEnd = dst + dstSize;
+    while (in < inEnd) {
+        const unsigned char token = *in++;
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            unsigned char b;
+            do {
+                if (in >= inEnd)
+                    return false;
+                b = *in++;
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > static_cast<size_t>(inEnd - in) || literals > static_cast<size_t>(outEnd - out))
+            return false;
+        std::memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+        if (in == inEnd)
+            break; // The last sequence has no match
+
+        if (inEnd - in < 2)
+            return false;
+        const size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t length = token & 15;
+        if (length == 15) {
+            unsigned char b;
+            do {
+                if (in >= inEnd)
+                    return false;
+                b = *in++;
+                length += b;
+            } while (b == 255);
+        }
+        length += kLZ4MinMatch;
+        if (offset == 0 || offset > static_cast<size_t>(out - dst) || length > static_cast<size_t>(outEnd - out))
+            return false;
+        // Byte by byte: the match may overlap the bytes it produces
+        const unsigned char *match = out - offset;
+        for (size_t i = 0; i < length; ++i)
+            out[i] = match[i];
+        out += length;
     }
-    std::stringstream buffer;
-    buffer << t.rdbuf();
-    return buffer.str();
+    return out == outEnd;
 }
 
-// Load and compile shader
-void loadShader(GLuint program, GLenum type, const std::string &shaderFilename) {
-    GLuint shader = glCreateShader(type);                                    
-    std::string shaderSourceString = file2String(shaderFilename);            
-    const GLchar *shaderSource = (const GLchar *)shaderSourceString.c_str(); 
-    glShaderSource(shader, 1, &shaderSource, NULL);                          
-    glCompileShader(shader);
-    GLint success;
-    GLchar infoLog[512];
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        glGetShaderInfoLog(shader, 512, NULL, infoLog);
-        std::cout << "ERROR in compiling " << shaderFilename << "\n\t" << infoLog << std::endl;
-    }
-    glAttachShader(program, shader); 
-    glDeleteShader(shader);
+// FNV-1a, never 0 (0 marks an empty table slot)
+uint64_t hashAssetPath(const std::string &path) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < path.size(); ++i)
+        hash = (hash ^ static_cast<unsigned char>(path[i])) * 1099511628211ull;
+    return hash != 0 ? hash : 1;
 }
 
-void initGPUprogram() {
-    g_program = glCreateProgram();
-    loadShader(g_program, GL_VERTEX_SHADER, "vertexShader.glsl");
-    loadShader(g_program, GL_FRAGMENT_SHADER, "fragmentShader.glsl");
-    glLinkProgram(g_program);
+// A piece of a file written by writeFileAtomically
+struct FileChunk {
+    const void *data;
+    size_t size;
+};
 
-    // Check for linking errors
-    GLint success;
-    GLchar infoLog[512];
-    glGetProgramiv(g_program, GL_LINK_STATUS, &success);
-    if (!success) {
-        glGetProgramInfoLog(g_program, 512, NULL, infoLog);
-        std::cout << "ERROR: Shader program linking failed:\n" << infoLog << std::endl;
+// Write chunks one after the other under a temporary name unique to the writer,
+// then rename: readers (possibly other processes building the same cache) never
+// see half a file. False, with the temporary removed, if anything failed.
+bool writeFileAtomically(const std::string &filename, const std::vector<FileChunk> &chunks) {
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), ".%llx.tmp",
+                  static_cast<unsigned long long>(std::chrono::steady_clock::now().time_since_epoch().count()));
+    const std::string temporary = filename + suffix;
+    {
+        std::ofstream file(temporary.c_str(), std::ios::binary);
+        for (size_t c = 0; c < chunks.size(); ++c)
+            file.write(static_cast<const char *>(chunks[c].data), chunks[c].size);
+        if (!file) {
+            file.close();
+            std::remove(temporary.c_str());
+            return false;
+        }
     }
+    return std::rename(temporary.c_str(), filename.c_str()) == 0;
+}
 
-    skyboxProgram = glCreateProgram();
-    loadShader(skyboxProgram, GL_VERTEX_SHADER, "skyboxVertexShader.glsl");
-    loadShader(skyboxProgram, GL_FRAGMENT_SHADER, "skyboxFragmentShader.glsl");
-    glLinkProgram(skyboxProgram);
+// Archive paths are relative to src/, without a leading "./"
+std::string normalizeAssetPath(const std::string &path) {
+    return path.compare(0, 2, "./") == 0 ? path.substr(2) : path;
+}
 
-    // Check for linking errors
-    glGetProgramiv(skyboxProgram, GL_LINK_STATUS, &success);
-    if (!success) {
-        glGetProgramInfoLog(skyboxProgram, 512, NULL, infoLog);
-        std::cout << "ERROR: Skybox shader program linking failed:\n" << infoLog << std::endl;
-    }
+// Archive layout: header, open-addressing table of slotCount entries (a power
+// of two, linear probing on the path hash), path strings, then the entry data.
+// Entries whose LZ4 form would not be smaller are stored as is (storedSize == size).
+struct AssetArchiveHeader {
+    char magic[4]; // "SSPK"
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t entryCount;
+};
 
-    // Set texture samplers
-    glUseProgram(skyboxProgram);
-    glUniform1i(glGetUniformLocation(skyboxProgram, "skybox"), 0);
+struct AssetArchiveEntry {
+    uint64_t hash; // 0: empty slot
+    uint64_t offset;
+    uint32_t storedSize;
+    uint32_t size;
+    uint32_t pathOffset;
+    uint32_t pathLength;
+};
 
-    glUseProgram(g_program);
-    glUniform1i(glGetUniformLocation(g_program, "texture1"), 0);
-}
+const uint32_t kAssetArchiveVersion = 1;
 
-void initCPUgeometry() {
-    g_sphereMesh = Mesh::genSphere(16);
-    skyboxMesh = Mesh::genCube();
+// Bytes of an asset: points into the mapped archive for stored entries, into
+// `buffer` for decompressed ones
+struct AssetData {
+    const unsigned char *data;
+    size_t size;
+    std::vector<unsigned char> buffer;
 
-    // Generate the ring mesh
-    float innerRadius = kSizeSaturn * 1.5f;
-    float outerRadius = kSizeSaturn * 2.5f;
-    g_ringMesh = Mesh::genRing(innerRadius, outerRadius, 128);
-}
+    AssetData() : data(nullptr), size(0) {}
+};
 
-void initGPUgeometry() {
-    g_sphereMesh->init();
-    skyboxMesh->init();
+// Read-only archive mapped in memory for the lifetime of the program. Lookups
+// and reads only touch the mapping, so any thread may call them.
+class AssetArchive {
+public:
+    AssetArchive() : m_base(nullptr), m_size(0), m_header(nullptr), m_table(nullptr) {}
+    ~AssetArchive() { close(); }
+
+    bool open(const std::string &filename) {
+        close();
+#ifdef ASSET_ARCHIVE_MMAP
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(sizeof(AssetArchiveHeader))) {
+            ::close(fd);
+            return false;
+        }
+        void *base = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd); // The mapping keeps the file alive
+        if (base == MAP_FAILED)
+            return false;
+        m_base = static_cast<const unsigned char *>(base);
+        m_size = static_cast<size_t>(info.st_size);
+#else
+        std::ifstream file(filename.c_str(), std::ios::binary);
+        if (!file.is_open())
+            return false;
+        m_contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        m_base = reinterpret_cast<const unsigned char *>(m_contents.data());
+        m_size = m_contents.size();
+#endif
+        m_header = reinterpret_cast<const AssetArchiveHeader *>(m_base);
+        m_table = reinterpret_cast<const AssetArchiveEntry *>(m_base + sizeof(AssetArchiveHeader));
+        if (m_size < sizeof(AssetArchiveHeader) || std::memcmp(m_header->magic, "SSPK", 4) != 0 ||
+            m_header->version != kAssetArchiveVersion || (m_header->slotCount & (m_header->slotCount - 1)) != 0 ||
+            sizeof(AssetArchiveHeader) + static_cast<size_t>(m_header->slotCount) * sizeof(AssetArchiveEntry) > m_size ||
+            !entriesValid()) {
+            std::cerr << "ERROR: " << filename << " is not a valid asset archive" << std::endl;
+            close();
+            return false;
+        }
+        return true;
+    }
 
-    // Initialize the ring mesh
-    if (g_ringMesh) {
-        g_ringMesh->init();
+    void close() {
+#ifdef ASSET_ARCHIVE_MMAP
+        if (m_base)
+            munmap(const_cast<unsigned char *>(m_base), m_size);
+#else
+        m_contents.clear();
+#endif
+        m_base = nullptr;
+        m_header = nullptr;
+        m_table = nullptr;
+        m_size = 0;
     }
+
+    bool isOpen() const { return m_base != nullptr; }
+
+    const AssetArchiveEntry *find(const std::string &path) const {
+        if (!m_header || m_header->slotCount == 0)
+            return nullptr;
+        const uint64_t hash = hashAssetPath(path);
+        const uint32_t mask = m_header->slotCount - 1;
+        for (uint32_t i = static_cast<uint32_t>(hash) & mask;; i = (i + 1) & mask) {
+            const AssetArchiveEntry &entry = m_table[i];
+            if (entry.hash == 0)
+                return nullptr;
+            if (entry.hash == hash && entry.pathLength == path.size() &&
+                std::memcmp(m_base + entry.pathOffset, path.data(), path.size()) == 0)
+                return &entry;
+        }
+    }
+
+    // Entries are checked by open(): within the archive
+    bool read(const AssetArchiveEntry &entry, AssetData &asset) const {
+        const unsigned char *stored = m_base + entry.offset;
+        if (entry.storedSize == entry.size) {
+            asset.data = stored;
+            asset.size = entry.size;
+            return true;
+        }
+        asset.buffer.resize(entry.size);
+        if (!lz4Decompress(stored, entry.storedSize, asset.buffer.data(), entry.size))
+            return false;
+        asset.data = asset.buffer.data();
+        asset.size = entry.size;
+        return true;
+    }
+
+private:
+    // Whether the table leaves an empty slot, which ends every probe sequence of
+    // find(), and whether each entry's path and data lie within the archive
+    bool entriesValid() const {
+        if (m_header->entryCount >= m_header->slotCount)
+            return false;
+        uint32_t entries = 0;
+        for (uint32_t i = 0; i < m_header->slotCount; ++i) {
+            const AssetArchiveEntry &entry = m_table[i];
+            if (entry.hash == 0)
+                continue;
+            ++entries;
+            if (entry.pathOffset > m_size || entry.pathLength > m_size - entry.pathOffset ||
+                entry.offset > m_size || entry.storedSize > m_size - entry.offset)
+                return false;
+        }
+        return entries == m_header->entryCount;
+    }
+
+    const unsigned char *m_base;
+    size_t m_size;
+    const AssetArchiveHeader *m_header;
+    const AssetArchiveEntry *m_table;
+#ifndef ASSET_ARCHIVE_MMAP
+    std::vector<char> m_contents;
+#endif
+};
+
+AssetArchive g_assets;
+
+// Contents of an asset: from the archive when it is open (src/assets.pak),
+// otherwise from the loose file, for trees where the pack step did not run
+bool readAsset(const std::string &filename, AssetData &asset) {
+    const std::string path = normalizeAssetPath(filename);
+    if (g_assets.isOpen()) {
+        const AssetArchiveEntry *entry = g_assets.find(path);
+        if (entry)
+            return g_assets.read(*entry, asset);
+    }
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file.is_open())
+        return false;
+    asset.buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    asset.data = asset.buffer.data();
+    asset.size = asset.buffer.size();
+    return true;
+}
+
+// Entries stored as is so that they can be used in place from the mapping
+// (binary data files such as the star catalog)
+bool isStoredAsset(const std::string &path) {
+    return path.size() > 4 && path.compare(path.size() - 4, 4, ".bin") == 0;
+}
+
+// Pack the given files (paths relative to src/) into an archive, compressing
+// them in parallel; the build runs this with src/media and the GLSL sources
+bool writeAssetArchive(const std::string &archiveFilename, const std::vector<std::string> &filenames) {
+    struct PackedFile {
+        std::string path;
+        std::vector<unsigned char> stored;
+        uint32_t size;
+        bool ok;
+    };
+    std::vector<PackedFile> files(filenames.size());
+    g_jobs.parallelFor(0, filenames.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            PackedFile &file = files[i];
+            file.path = normalizeAssetPath(filenames[i]);
+            std::ifstream in(file.path.c_str(), std::ios::binary);
+            std::vector<unsigned char> contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            file.ok = in.is_open();
+            file.size = static_cast<uint32_t>(contents.size());
+            if (isStoredAsset(file.path)) {
+                file.stored.swap(contents);
+                continue;
+            }
+            file.stored.resize(lz4CompressBound(contents.size()));
+            file.stored.resize(lz4Compress(contents.data(), contents.size(), file.stored.data()));
+            if (file.stored.size() >= contents.size())
+                file.stored.swap(contents); // Not worth decompressing (JPEG, PNG, ...)
+        }
+    });
+
+    uint32_t slotCount = 1;
+    while (slotCount < 2 * files.size())
+        slotCount *= 2;
+    std::vector<AssetArchiveEntry> table(slotCount);
+    std::memset(table.data(), 0, table.size() * sizeof(AssetArchiveEntry));
+    std::string paths;
+    for (size_t i = 0; i < files.size(); ++i)
+        paths += files[i].path;
+
+    // Entry data starts after the table and the paths, 16-byte aligned
+    uint64_t offset = sizeof(AssetArchiveHeader) + slotCount * sizeof(AssetArchiveEntry) + paths.size();
+    uint32_t pathOffset = static_cast<uint32_t>(sizeof(AssetArchiveHeader) + slotCount * sizeof(AssetArchiveEntry));
+    std::vector<uint64_t> offsets(files.size());
+    size_t totalSize = 0, totalStored = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!files[i].ok) {
+            std::cerr << "ERROR: could not read " << files[i].path << std::endl;
+            return false;
+        }
+        offset = (offset + 15) & ~static_cast<uint64_t>(15);
+        offsets[i] = offset;
+        AssetArchiveEntry entry;
+        entry.hash = hashAssetPath(files[i].path);
+        entry.offset = offset;
+        entry.storedSize = static_cast<uint32_t>(files[i].stored.size());
+        entry.size = files[i].size;
+        entry.pathOffset = pathOffset;
+        entry.pathLength = static_cast<uint32_t>(files[i].path.size());
+        uint32_t slot = static_cast<uint32_t>(entry.hash) & (slotCount - 1);
+        while (table[slot].hash != 0)
+            slot = (slot + 1) & (slotCount - 1);
+        table[slot] = entry;
+        offset += entry.storedSize;
+        pathOffset += entry.pathLength;
+        totalSize += entry.size;
+        totalStored += entry.storedSize;
+    }
+
+    std::ofstream out(archiveFilename.c_str(), std::ios::binary);
+    AssetArchiveHeader header;
+    std::memcpy(header.magic, "SSPK", 4);
+    header.version = kAssetArchiveVersion;
+    header.slotCount = slotCount;
+    header.entryCount = static_cast<uint32_t>(files.size());
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(table.data()), table.size() * sizeof(AssetArchiveEntry));
+    out.write(paths.data(), paths.size());
+    for (size_t i = 0; i < files.size(); ++i) {
+        static const char padding[16] = {};
+        out.write(padding, static_cast<std::streamsize>(offsets[i] - static_cast<uint64_t>(out.tellp())));
+        out.write(reinterpret_cast<const char *>(files[i].stored.data()), files[i].stored.size());
+    }
+    if (!out.good()) {
+        std::cerr << "ERROR: could not write " << archiveFilename << std::endl;
+        return false;
+    }
+    std::cout << "Packed " << files.size() << " files (" << totalSize / 1024 << " KB, " << totalStored / 1024
+              << " KB stored) into " << archiveFilename << std::endl;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// GL state cache
+//------------------------------------------------------------------------------
+
+// Thin layer over the GL binding and fixed-function state: a call that would set
+// what is already set is filtered out. Everything on the GL thread goes through it
+// (g_gl), so the cache stays in sync; deleted objects must be forgotten since GL
+// unbinds them. Also counts per frame the calls issued and filtered, the draw
+// calls and the bytes uploaded (buffers, textures, uniforms).
+class GLStateCache {
+public:
+    struct Stats {
+        unsigned int issued;
+        unsigned int filtered;
+        unsigned int drawCalls;
+        size_t uploadedBytes;
+
+        Stats() : issued(0), filtered(0), drawCalls(0), uploadedBytes(0) {}
+    };
+
+    GLStateCache() { reset(); }
+
+    // Forget everything, e.g. for a new context; the next call of each kind is issued
+    void reset() {
+        m_program = m_vertexArray = m_framebuffer = kUnknown;
+        m_activeUnit = kUnknown;
+        for (int unit = 0; unit < kTextureUnits; ++unit)
+            for (int target = 0; target < kTextureTargets; ++target)
+                m_textures[unit][target] = kUnknown;
+        m_cullFace = m_depthTest = m_blend = m_depthMask = -1;
+        m_cullMode = m_depthFunc = m_blendSrc = m_blendDst = 0;
+        m_viewport[0] = m_viewport[1] = m_viewport[2] = m_viewport[3] = -1;
+    }
+
+    void useProgram(GLuint program) {
+        if (filter(m_program, program))
+            glUseProgram(program);
+    }
+    void bindVertexArray(GLuint vertexArray) {
+        if (filter(m_vertexArray, vertexArray))
+            glBindVertexArray(vertexArray);
+    }
+    void bindFramebuffer(GLuint framebuffer) {
+        if (filter(m_framebuffer, framebuffer))
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    }
+
+    // Bind a 2D, 2D array, 1D, 3D, cube map or buffer texture to a unit, switching the active unit only if needed
+    void bindTexture(GLuint unit, GLenum target, GLuint texture) {
+        GLuint &bound = m_textures[unit][target == GL_TEXTURE_2D ? 0 : target == GL_TEXTURE_2D_ARRAY ? 1
+                                         : target == GL_TEXTURE_1D ? 2 : target == GL_TEXTURE_3D ? 3
+                                         : target == GL_TEXTURE_CUBE_MAP ? 4 : 5];
+        if (bound == texture) {
+            ++m_current.filtered;
+            return;
+        }
+        if (filter(m_activeUnit, unit))
+            glActiveTexture(GL_TEXTURE0 + unit);
+        bound = texture;
+        ++m_current.issued;
+        glBindTexture(target, texture);
+    }
+
+    // Select the unit that unit-less calls on a bound texture (glTexBuffer, glTexParameter) act on
+    void activeTexture(GLuint unit) {
+        if (filter(m_activeUnit, unit))
+            glActiveTexture(GL_TEXTURE0 + unit);
+    }
+
+    // glEnable / glDisable; capabilities other than these three are not cached
+    void setEnabled(GLenum capability, bool enabled) {
+        int *cached = capability == GL_CULL_FACE ? &m_cullFace : capability == GL_DEPTH_TEST ? &m_depthTest
+                    : capability == GL_BLEND ? &m_blend : nullptr;
+        if (cached == nullptr || filter(*cached, enabled ? 1 : 0)) {
+            if (cached == nullptr)
+                ++m_current.issued;
+            enabled ? glEnable(capability) : glDisable(capability);
+        }
+    }
+    void cullFace(GLenum face) {
+        if (filter(m_cullMode, face))
+            glCullFace(face);
+    }
+    void depthFunc(GLenum func) {
+        if (filter(m_depthFunc, func))
+            glDepthFunc(func);
+    }
+    void depthMask(bool write) {
+        if (filter(m_depthMask, write ? 1 : 0))
+            glDepthMask(write ? GL_TRUE : GL_FALSE);
+    }
+    void blendFunc(GLenum src, GLenum dst) {
+        if (m_blendSrc == src && m_blendDst == dst) {
+            ++m_current.filtered;
+            return;
+        }
+        m_blendSrc = src;
+        m_blendDst = dst;
+        ++m_current.issued;
+        glBlendFunc(src, dst);
+    }
+    void viewport(GLint x, GLint y, GLsizei width, GLsizei height) {
+        if (m_viewport[0] == x && m_viewport[1] == y && m_viewport[2] == width && m_viewport[3] == height) {
+            ++m_current.filtered;
+            return;
+        }
+        m_viewport[0] = x;
+        m_viewport[1] = y;
+        m_viewport[2] = width;
+        m_viewport[3] = height;
+        ++m_current.issued;
+        glViewport(x, y, width, height);
+    }
+
+    // GL unbinds deleted objects, which may then get their name reused
+    void forgetTexture(GLuint texture) {
+        for (int unit = 0; unit < kTextureUnits; ++unit) {
+            for (int target = 0; target < kTextureTargets; ++target) {
+                if (m_textures[unit][target] == texture)
+                    m_textures[unit][target] = 0;
+            }
+        }
+    }
+    void forgetProgram(GLuint program) { forget(m_program, program); }
+    void forgetVertexArray(GLuint vertexArray) { forget(m_vertexArray, vertexArray); }
+    void forgetFramebuffer(GLuint framebuffer) { forget(m_framebuffer, framebuffer); }
+
+    // Draw calls and uploads are always issued, only counted
+    void drawArrays(GLenum mode, GLint first, GLsizei count) {
+        ++m_current.drawCalls;
+        glDrawArrays(mode, first, count);
+    }
+    void drawElements(GLenum mode, GLsizei count, GLenum type, const void *indices) {
+        ++m_current.drawCalls;
+        glDrawElements(mode, count, type, indices);
+    }
+    void drawElementsBaseVertex(GLenum mode, GLsizei count, GLenum type, const void *indices, GLint baseVertex) {
+        ++m_current.drawCalls;
+        glDrawElementsBaseVertex(mode, count, type, indices, baseVertex);
+    }
+    void multiDrawArrays(GLenum mode, const GLint *firsts, const GLsizei *counts, GLsizei drawCount) {
+        if (drawCount == 0)
+            return;
+        ++m_current.drawCalls;
+        glMultiDrawArrays(mode, firsts, counts, drawCount);
+    }
+    void countDrawCall() { ++m_current.drawCalls; } // For entry points loaded by hand
+    void countUpload(size_t bytes) { m_current.uploadedBytes += bytes; }
+
+    void uniform1i(GLint location, GLint value) {
+        m_current.uploadedBytes += sizeof(value);
+        glUniform1i(location, value);
+    }
+    void uniform1f(GLint location, GLfloat value) {
+        m_current.uploadedBytes += sizeof(value);
+        glUniform1f(location, value);
+    }
+    void uniform2f(GLint location, GLfloat x, GLfloat y) {
+        m_current.uploadedBytes += 2 * sizeof(GLfloat);
+        glUniform2f(location, x, y);
+    }
+    void uniform3fv(GLint location, const glm::vec3 &value) {
+        m_current.uploadedBytes += sizeof(value);
+        glUniform3fv(location, 1, glm::value_ptr(value));
+    }
+    void uniform3fv(GLint location, const glm::vec3 *values, GLsizei count) {
+        m_current.uploadedBytes += count * sizeof(glm::vec3);
+        glUniform3fv(location, count, glm::value_ptr(values[0]));
+    }
+    void uniformMatrix4fv(GLint location, const glm::mat4 &value) {
+        m_current.uploadedBytes += sizeof(value);
+        glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(value));
+    }
+
+    // Close the frame: its counters become frameStats() and the next frame starts at 0
+    void endFrame() {
+        m_frame = m_current;
+        m_current = Stats();
+    }
+    const Stats &frameStats() const { return m_frame; }
+
+private:
+    static const GLuint kUnknown = ~0u;
+    static const int kTextureUnits = 8;
+    static const int kTextureTargets = 6;
+
+    // Update a cached value; true if the call has to be issued
+    template <typename T, typename U>
+    bool filter(T &cached, U value) {
+        if (cached == static_cast<T>(value)) {
+            ++m_current.filtered;
+            return false;
+        }
+        cached = static_cast<T>(value);
+        ++m_current.issued;
+        return true;
+    }
+    static void forget(GLuint &cached, GLuint name) {
+        if (cached == name)
+            cached = 0;
+    }
+
+    GLuint m_program, m_vertexArray, m_framebuffer;
+    GLuint m_activeUnit;
+    GLuint m_textures[kTextureUnits][kTextureTargets]; // 2D, 2D array, 1D, 3D, cube map and buffer bindings of each unit
+    int m_cullFace, m_depthTest, m_blend, m_depthMask; // -1 unknown, else 0 / 1
+    GLenum m_cullMode, m_depthFunc, m_blendSrc, m_blendDst; // 0 unknown
+    GLint m_viewport[4];
+    Stats m_current;
+    Stats m_frame;
+};
+
+GLStateCache g_gl;
+
+// --gl-fallback: ignore the optional GL 4.x features (persistent mapping, multi-draw
+// indirect, clip control) and take the GL 3.3 paths whatever the context offers
+bool g_glFallback = false;
+
+//------------------------------------------------------------------------------
+// Streaming ring buffer
+//------------------------------------------------------------------------------
+
+// One buffer split in kStreamRegions regions, one per frame in flight, for data
+// written by the CPU every frame. A region is fenced after the frame that used
+// it and only rewritten once that fence has signaled, so writes never touch data
+// the GPU may still read and never wait on the driver's own synchronization.
+// With glBufferStorage (GL 4.4 or ARB_buffer_storage) the buffer stays mapped
+// (persistent, coherent); otherwise each frame maps its range unsynchronized.
+// Regions grow on the first allocation of a frame that does not fit; a later one
+// that does not fit fails for this frame and the regions grow at its end.
+
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+typedef void (GLAD_API_PTR *BufferStorageFunction)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+
+const int kStreamRegions = 3;
+const size_t kStreamRegionBytes = 1 << 20;
+
+class StreamRing {
+public:
+    struct Stats {
+        size_t bytes;       // Bytes written
+        double fenceWaitMs; // Time spent waiting for a region to be released by the GPU
+
+        Stats() : bytes(0), fenceWaitMs(0.0) {}
+    };
+
+    StreamRing()
+        : m_buffer(0), m_generation(0), m_regionBytes(0), m_region(0), m_used(0), m_requiredBytes(0), m_regionReady(false),
+          m_base(nullptr), m_mapOffset(0), m_uniformAlignment(256), m_bufferStorage(nullptr) {
+        for (int r = 0; r < kStreamRegions; ++r)
+            m_fences[r] = nullptr;
+    }
+
+    void init(size_t regionBytes) {
+        GLint major = 0, minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        if (!g_glFallback && (major > 4 || (major == 4 && minor >= 4) || glfwExtensionSupported("GL_ARB_buffer_storage")))
+            m_bufferStorage = reinterpret_cast<BufferStorageFunction>(glfwGetProcAddress("glBufferStorage"));
+        std::cout << "Streaming: " << (m_bufferStorage ? "persistent mapping" : "unsynchronized mapping") << std::endl;
+        GLint uniformAlignment = 0;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlignment);
+        m_uniformAlignment = uniformAlignment > 0 ? static_cast<size_t>(uniformAlignment) : 256;
+        create(regionBytes);
+    }
+
+    void destroy() {
+        waitAll();
+        if (m_buffer) {
+            glBindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+            if (m_base)
+                glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            glDeleteBuffers(1, &m_buffer);
+        }
+        m_buffer = 0;
+        m_base = nullptr;
+    }
+
+    // Reserve size bytes of this frame's region. Returns where to write them (until
+    // flush()) and their offset in getBuffer(); null if they cannot fit this frame.
+    void *allocate(size_t size, size_t alignment, GLintptr &offset) {
+        if (!m_regionReady) {
+            waitRegion(m_region);
+            m_regionReady = true;
+        }
+        size_t start = (m_used + alignment - 1) & ~(alignment - 1);
+        if (start + size > m_regionBytes) {
+            if (m_used > 0) {
+                // Earlier allocations of this frame live in the buffer: grow once the frame is over
+                if (m_requiredBytes <= m_regionBytes)
+                    std::cerr << "Warning: stream ring region full (" << m_regionBytes << " bytes), growing" << std::endl;
+                m_requiredBytes = std::max(m_requiredBytes, start + size);
+                return nullptr;
+            }
+            destroy();
+            create(grownRegionBytes(size));
+            start = 0;
+        }
+        const size_t regionStart = m_region * m_regionBytes;
+        if (!m_bufferStorage && !m_base) {
+            // Map the rest of the region; the fence already guarantees the GPU is done with it
+            glBindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+            m_mapOffset = start;
+            m_base = static_cast<char *>(glMapBufferRange(GL_COPY_WRITE_BUFFER, regionStart + start, m_regionBytes - start,
+                                                          GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT |
+                                                          GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_FLUSH_EXPLICIT_BIT));
+            if (!m_base)
+                return nullptr;
+        }
+        m_used = start + size;
+        m_current.bytes += size;
+        g_gl.countUpload(size);
+        offset = static_cast<GLintptr>(regionStart + start);
+        return m_bufferStorage ? m_base + regionStart + start : m_base + (start - m_mapOffset);
+    }
+
+    // Make the writes so far visible to GL; call before drawing from them
+    void flush() {
+        if (m_bufferStorage || !m_base)
+            return; // Coherent persistent mapping: nothing to do
+        glBindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+        glFlushMappedBufferRange(GL_COPY_WRITE_BUFFER, 0, m_used - m_mapOffset);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        m_base = nullptr;
+    }
+
+    // After the frame's draws: fence the region it used and move to the next one
+    void endFrame() {
+        if (m_regionReady) {
+            flush();
+            m_fences[m_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            m_region = (m_region + 1) % kStreamRegions;
+            m_used = 0;
+            m_regionReady = false;
+        }
+        if (m_requiredBytes > m_regionBytes) {
+            destroy();
+            create(grownRegionBytes(m_requiredBytes));
+        }
+        m_requiredBytes = 0;
+        m_frame = m_current;
+        m_current = Stats();
+    }
+
+    GLuint getBuffer() const { return m_buffer; }
+    // Changes whenever the buffer is replaced, which may keep the same name: what
+    // captured its storage (buffer textures) must be attached again
+    unsigned int getGeneration() const { return m_generation; }
+    size_t getUniformAlignment() const { return m_uniformAlignment; } // Of allocations bound as uniform blocks
+    size_t getGpuBytes() const { return m_regionBytes * kStreamRegions; }
+    const Stats &frameStats() const { return m_frame; }
+
+private:
+    size_t grownRegionBytes(size_t size) const {
+        size_t regionBytes = m_regionBytes;
+        while (regionBytes < size)
+            regionBytes *= 2;
+        return regionBytes;
+    }
+
+    void create(size_t regionBytes) {
+        ++m_generation;
+        m_regionBytes = regionBytes;
+        m_region = 0;
+        m_used = 0;
+        const GLsizeiptr size = static_cast<GLsizeiptr>(regionBytes * kStreamRegions);
+        glGenBuffers(1, &m_buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+        if (m_bufferStorage) {
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            m_bufferStorage(GL_COPY_WRITE_BUFFER, size, nullptr, flags);
+            m_base = static_cast<char *>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags));
+        } else {
+            glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STREAM_DRAW);
+        }
+    }
+
+    void waitRegion(int region) {
+        GLsync &fence = m_fences[region];
+        if (!fence)
+            return;
+        const Clock::time_point start = Clock::now();
+        GLenum status = glClientWaitSync(fence, 0, 0);
+        while (status == GL_TIMEOUT_EXPIRED)
+            status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+        m_current.fenceWaitMs += elapsedMs(start);
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+
+    void waitAll() {
+        for (int r = 0; r < kStreamRegions; ++r)
+            waitRegion(r);
+    }
+
+    GLuint m_buffer;
+    unsigned int m_generation;
+    size_t m_regionBytes;
+    int m_region;        // Region of the current frame
+    size_t m_used;       // Bytes allocated in it
+    size_t m_requiredBytes; // Largest region this frame asked for, to grow to at its end
+    bool m_regionReady;  // Its fence has been waited for
+    char *m_base;        // Persistent: the whole buffer; else: the mapped part of the region, null when unmapped
+    size_t m_mapOffset;  // Offset in the region of the unsynchronized mapping
+    size_t m_uniformAlignment;
+    GLsync m_fences[kStreamRegions];
+    Stats m_current;
+    Stats m_frame;
+    BufferStorageFunction m_bufferStorage;
+};
+
+StreamRing g_stream;
+
+//------------------------------------------------------------------------------
+// Resource pools
+//------------------------------------------------------------------------------
+
+// 32-bit handle to a pooled resource: 20 bits of slot index and 12 bits of
+// generation. A slot's generation changes when its resource is released, so a
+// stale handle never resolves to the resource that reused the slot. 0 is never
+// handed out and stands for "no resource".
+template <typename T>
+struct ResourceHandle {
+    uint32_t value;
+
+    ResourceHandle() : value(0) {}
+    explicit ResourceHandle(uint32_t v) : value(v) {}
+
+    bool isValid() const { return value != 0; }
+    bool operator==(const ResourceHandle &other) const { return value == other.value; }
+    bool operator!=(const ResourceHandle &other) const { return value != other.value; }
+};
+
+// Pool of GPU resources of one type. Live resources are stored densely (swap-
+// remove on release) so that iterating over them walks contiguous memory; the
+// slots indirection keeps handles stable. Released resources are destroyed
+// later, once a fence inserted at release time shows the GPU is done with them.
+// Pointers returned by get() are only valid until the next create() or release().
+template <typename T>
+class ResourcePool {
+public:
+    typedef ResourceHandle<T> Handle;
+    typedef void (*DestroyFunction)(T &resource);
+
+    ResourcePool(const char *typeName, DestroyFunction destroy) : m_typeName(typeName), m_destroy(destroy) {}
+
+    Handle create(const T &resource, const std::string &name) {
+        uint32_t slot;
+        if (!m_freeSlots.empty()) {
+            slot = m_freeSlots.back();
+            m_freeSlots.pop_back();
+        } else {
+            slot = static_cast<uint32_t>(m_slots.size());
+            if (slot > kIndexMask) {
+                std::cerr << "ERROR: " << m_typeName << " pool is full" << std::endl;
+                return Handle();
+            }
+            m_slots.push_back(Slot());
+        }
+        m_slots[slot].dense = static_cast<uint32_t>(m_items.size());
+        m_items.push_back(resource);
+        m_itemSlots.push_back(slot);
+        m_names.push_back(name);
+        return Handle(m_slots[slot].generation << kIndexBits | slot);
+    }
+
+    T *get(Handle handle) {
+        const uint32_t slot = handle.value & kIndexMask;
+        if (!handle.isValid() || slot >= m_slots.size())
+            return nullptr;
+        const Slot &s = m_slots[slot];
+        if (s.dense == kFreeSlot || s.generation != handle.value >> kIndexBits)
+            return nullptr;
+        return &m_items[s.dense];
+    }
+
+    // Remove the resource from the pool; it is destroyed by collectGarbage()
+    // once the GPU commands issued so far have completed
+    void release(Handle handle) {
+        if (!get(handle))
+            return;
+        const uint32_t slot = handle.value & kIndexMask;
+        const uint32_t dense = m_slots[slot].dense;
+
+        PendingDestruction pending;
+        pending.resource = m_items[dense];
+        pending.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        m_pending.push_back(pending);
+
+        const uint32_t last = static_cast<uint32_t>(m_items.size() - 1);
+        if (dense != last) {
+            m_items[dense] = m_items[last];
+            m_itemSlots[dense] = m_itemSlots[last];
+            m_names[dense].swap(m_names[last]);
+            m_slots[m_itemSlots[dense]].dense = dense;
+        }
+        m_items.pop_back();
+        m_itemSlots.pop_back();
+        m_names.pop_back();
+
+        m_slots[slot].dense = kFreeSlot;
+        m_slots[slot].generation = m_slots[slot].generation == kMaxGeneration ? 1 : m_slots[slot].generation + 1;
+        m_freeSlots.push_back(slot);
+    }
+
+    // Destroy the released resources the GPU no longer uses (all of them if waitForGpu)
+    void collectGarbage(bool waitForGpu = false) {
+        for (size_t i = 0; i < m_pending.size();) {
+            const GLenum status = waitForGpu ? glClientWaitSync(m_pending[i].fence, GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(-1))
+                                             : glClientWaitSync(m_pending[i].fence, 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+                ++i;
+                continue;
+            }
+            glDeleteSync(m_pending[i].fence);
+            m_destroy(m_pending[i].resource);
+            m_pending[i] = m_pending.back();
+            m_pending.pop_back();
+        }
+    }
+
+    // Dense iteration over the live resources
+    size_t size() const { return m_items.size(); }
+    T &at(size_t i) { return m_items[i]; }
+    const std::string &nameAt(size_t i) const { return m_names[i]; }
+
+    // Print the resources still alive (meant to be called once everything was released)
+    size_t reportLeaks() const {
+        for (size_t i = 0; i < m_items.size(); ++i)
+            std::cerr << "Leak: " << m_typeName << " '" << m_names[i] << "' was never released" << std::endl;
+        return m_items.size();
+    }
+
+private:
+    static const uint32_t kIndexBits = 20;
+    static const uint32_t kIndexMask = (1u << kIndexBits) - 1;
+    static const uint32_t kMaxGeneration = (1u << (32 - kIndexBits)) - 1;
+    static const uint32_t kFreeSlot = 0xFFFFFFFFu;
+
+    struct Slot {
+        uint32_t dense;      // Index in m_items, kFreeSlot when unused
+        uint32_t generation; // Never 0, so that no handle is 0
+
+        Slot() : dense(kFreeSlot), generation(1) {}
+    };
+
+    struct PendingDestruction {
+        T resource;
+        GLsync fence;
+    };
+
+    const char *m_typeName;
+    DestroyFunction m_destroy;
+    std::vector<T> m_items;
+    std::vector<uint32_t> m_itemSlots;
+    std::vector<std::string> m_names;
+    std::vector<Slot> m_slots;
+    std::vector<uint32_t> m_freeSlots;
+    std::vector<PendingDestruction> m_pending;
+};
+
+struct Texture {
+    GLuint id;
+    GLenum target;
+    int width;       // Of the resident base level
+    int height;
+    size_t gpuBytes; // Estimated video memory, mip chain included
+};
+
+struct Program {
+    GLuint id;
+};
+
+typedef ResourceHandle<Texture> TextureHandle;
+typedef ResourceHandle<Program> ProgramHandle;
+
+void destroyTexture(Texture &texture) {
+    g_gl.forgetTexture(texture.id);
+    glDeleteTextures(1, &texture.id);
+}
+void destroyProgram(Program &program) {
+    g_gl.forgetProgram(program.id);
+    glDeleteProgram(program.id);
+}
+
+ResourcePool<Texture> g_textures("texture", destroyTexture);
+ResourcePool<Program> g_programs("program", destroyProgram);
+
+// GPU programs
+ProgramHandle g_program;       // Main shader program
+ProgramHandle upscaleProgram;  // Dynamic resolution upscale + sharpening, bloom and tone mapping
+ProgramHandle g_bloomDownProgram; // Bloom pyramid steps (see HDR and bloom)
+ProgramHandle g_bloomUpProgram;
+ProgramHandle g_luminanceProgram; // Auto-exposure grid
+ProgramHandle g_impostorProgram; // Ray-cast spheres for small bodies (see Render queue)
+ProgramHandle g_ringProgram;     // Ray-marched rings (see Render queue)
+ProgramHandle g_atmosphereProgram; // Scattering over bodies with an atmosphere (see Atmospheric scattering)
+ProgramHandle g_pointProgram;    // Points for sub-pixel bodies
+ProgramHandle g_starProgram;     // Star catalog points (see Star catalog)
+
+// GL name behind a handle, 0 for an invalid or stale handle
+inline GLuint textureId(TextureHandle handle) {
+    const Texture *texture = g_textures.get(handle);
+    return texture ? texture->id : 0;
+}
+
+inline GLuint programId(ProgramHandle handle) {
+    const Program *program = g_programs.get(handle);
+    return program ? program->id : 0;
+}
+
+// Image decoded on the CPU, waiting to be uploaded to the GPU
+struct DecodedImage {
+    std::string filename;
+    unsigned char *data;
+    int width, height, numComponents;
+};
+
+// Read (and decompress) an image asset, then decode it; null if either fails
+void decodeImage(const std::string &filename, DecodedImage &image) {
+    AssetData asset;
+    image.filename = filename;
+    image.data = nullptr;
+    if (readAsset(filename, asset))
+        image.data = stbi_load_from_memory(asset.data, static_cast<int>(asset.size), &image.width, &image.height,
+                                           &image.numComponents, 0);
+}
+
+// Decompress and decode image assets in parallel on the job system
+std::vector<DecodedImage> decodeImages(const std::vector<std::string> &filenames) {
+    std::vector<DecodedImage> images(filenames.size());
+    g_jobs.parallelFor(0, filenames.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            decodeImage(filenames[i], images[i]);
+    });
+    return images;
+}
+
+GLenum formatFromComponents(int numComponents) {
+    GLenum format = GL_RGB;
+    if (numComponents == 1)
+        format = GL_RED;
+    else if (numComponents == 3)
+        format = GL_RGB;
+    else if (numComponents == 4)
+        format = GL_RGBA;
+    return format;
+}
+
+// Video memory taken by a width x height image and, optionally, its mip chain.
+// Drivers pad 1- and 3-channel texels to 4 bytes, so count 4 for all of them.
+size_t textureBytes(int width, int height, bool mipmapped) {
+    size_t bytes = static_cast<size_t>(width) * height * 4;
+    while (mipmapped && (width > 1 || height > 1)) {
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+        bytes += static_cast<size_t>(width) * height * 4;
+    }
+    return bytes;
+}
+
+// (Re)specify the layers (same size and format) of a mipmapped 2D array texture, which stays bound
+void specifyTextureArray(Texture &texture, const DecodedImage *const *layers, size_t layerCount) {
+    const DecodedImage &first = *layers[0];
+    const GLenum format = formatFromComponents(first.numComponents);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, format, first.width, first.height, static_cast<GLsizei>(layerCount), 0, format,
+                 GL_UNSIGNED_BYTE, nullptr);
+    for (size_t l = 0; l < layerCount; ++l)
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, static_cast<GLint>(l), first.width, first.height, 1, format,
+                        GL_UNSIGNED_BYTE, layers[l]->data);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    g_gl.countUpload(layerCount * first.width * first.height * first.numComponents);
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+    texture.width = first.width;
+    texture.height = first.height;
+    texture.gpuBytes = layerCount * textureBytes(first.width, first.height, true);
+}
+
+// Upload decoded images of the same size and format as the layers of a mipmapped
+// 2D array texture; the images are left to the caller
+TextureHandle uploadTextureArray(const std::vector<const DecodedImage *> &layers, const std::string &name) {
+    for (size_t l = 0; l < layers.size(); ++l)
+        std::cout << "Loaded texture " << layers[l]->filename << " with width=" << layers[l]->width
+                  << " height=" << layers[l]->height << " numComponents=" << layers[l]->numComponents
+                  << " as layer " << l << " of " << name << std::endl;
+
+    Texture texture = { 0, GL_TEXTURE_2D_ARRAY, 0, 0, 0 };
+    glGenTextures(1, &texture.id);
+    g_gl.bindTexture(0, GL_TEXTURE_2D_ARRAY, texture.id);
+
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+    specifyTextureArray(texture, layers.data(), layers.size());
+    g_gl.bindTexture(0, GL_TEXTURE_2D_ARRAY, 0);
+
+    return g_textures.create(texture, name);
+}
+
+//------------------------------------------------------------------------------
+// Geometry arena
+//------------------------------------------------------------------------------
+
+// All static meshes live in one interleaved vertex buffer and one index buffer,
+// suballocated linearly, behind a single VAO; a mesh is a range drawn with a base
+// vertex. Per-draw data (model matrix, color) are vertex attributes 3-7: with
+// glMultiDrawElementsIndirect (GL 4.3 or ARB_multi_draw_indirect + ARB_base_instance)
+// they and the commands are streamed through g_stream, the attributes indexed by
+// each command's baseInstance, so a run of draws sharing state is one call. The GL 3.3 fallback sets them as constant
+// attributes before each glDrawElementsBaseVertex.
+
+struct ArenaVertex {
+    float position[3];
+    float normal[3];
+    float texCoord[2];
+};
+
+struct GeometryRange {
+    GLuint firstIndex;
+    GLuint indexCount;
+    GLint baseVertex;
+};
+
+struct DrawInstance {
+    glm::mat4 model;
+    glm::vec4 color;
+    GLuint material; // Slot in the material table
+    GLuint shadows;  // Occluder list: first | count << 24 (see Eclipse shadows)
+    GLuint padding[2];
+};
+
+// Layout fixed by glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+#ifndef GL_DRAW_INDIRECT_BUFFER
+#define GL_DRAW_INDIRECT_BUFFER 0x8F3F
+#endif
+typedef void (GLAD_API_PTR *MultiDrawElementsIndirectFunction)(GLenum mode, GLenum type, const void *indirect,
+                                                                GLsizei drawCount, GLsizei stride);
+
+const size_t kArenaVertexCapacity = 1 << 18;
+const size_t kArenaIndexCapacity = 1 << 20;
+const GLuint kInstanceAttribute = 3; // Model matrix at 3-6, color at 7, material at 8, shadows at 9
+
+class GeometryArena {
+public:
+    GeometryArena()
+        : m_vao(0), m_vertexBuffer(0), m_indexBuffer(0), m_vertexCapacity(0), m_indexCapacity(0), m_vertexCount(0),
+          m_indexCount(0), m_drawOffset(0), m_commandOffset(0), m_multiDrawIndirect(nullptr) {}
+
+    void init(size_t vertexCapacity, size_t indexCapacity) {
+        GLint major = 0, minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        if (!g_glFallback && (major > 4 || (major == 4 && minor >= 3) ||
+                              (glfwExtensionSupported("GL_ARB_multi_draw_indirect") &&
+                               glfwExtensionSupported("GL_ARB_base_instance"))))
+            m_multiDrawIndirect = reinterpret_cast<MultiDrawElementsIndirectFunction>(
+                glfwGetProcAddress("glMultiDrawElementsIndirect"));
+        std::cout << "Geometry submission: "
+                  << (m_multiDrawIndirect ? "glMultiDrawElementsIndirect" : "glDrawElementsBaseVertex") << std::endl;
+
+        m_vertexCapacity = vertexCapacity;
+        m_indexCapacity = indexCapacity;
+        glGenVertexArrays(1, &m_vao);
+        g_gl.bindVertexArray(m_vao);
+
+        glGenBuffers(1, &m_vertexBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, vertexCapacity * sizeof(ArenaVertex), nullptr, GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(ArenaVertex), (void *)offsetof(ArenaVertex, position));
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(ArenaVertex), (void *)offsetof(ArenaVertex, normal));
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(ArenaVertex), (void *)offsetof(ArenaVertex, texCoord));
+        for (GLuint a = 0; a < 3; ++a)
+            glEnableVertexAttribArray(a);
+
+        glGenBuffers(1, &m_indexBuffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCapacity * sizeof(GLuint), nullptr, GL_STATIC_DRAW);
+
+        if (m_multiDrawIndirect) {
+            // Pointers into the stream ring are set every frame by endDraws()
+            for (GLuint a = kInstanceAttribute; a < kInstanceAttribute + 7; ++a) {
+                glEnableVertexAttribArray(a);
+                glVertexAttribDivisor(a, 1);
+            }
+        }
+        g_gl.bindVertexArray(0);
+    }
+
+    void destroy() {
+        g_gl.forgetVertexArray(m_vao);
+        glDeleteVertexArrays(1, &m_vao);
+        glDeleteBuffers(1, &m_vertexBuffer);
+        glDeleteBuffers(1, &m_indexBuffer);
+        m_vao = m_vertexBuffer = m_indexBuffer = 0;
+        m_vertexCount = m_indexCount = 0;
+    }
+
+    // Copy a mesh at the end of the buffers; false if the arena is full. Space is
+    // not reclaimed: the geometry is static and lives as long as the program.
+    bool allocate(const std::vector<ArenaVertex> &vertices, const std::vector<GLuint> &indices, GeometryRange &range) {
+        if (m_vertexCount + vertices.size() > m_vertexCapacity || m_indexCount + indices.size() > m_indexCapacity) {
+            std::cerr << "ERROR: geometry arena full (" << m_vertexCount << " vertices, " << m_indexCount
+                      << " indices)" << std::endl;
+            return false;
+        }
+        g_gl.bindVertexArray(0); // Keep the arena VAO's element buffer binding untouched
+        glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+        glBufferSubData(GL_ARRAY_BUFFER, m_vertexCount * sizeof(ArenaVertex), vertices.size() * sizeof(ArenaVertex),
+                        vertices.data());
+        glBindBuffer(GL_COPY_WRITE_BUFFER, m_indexBuffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, m_indexCount * sizeof(GLuint), indices.size() * sizeof(GLuint),
+                        indices.data());
+        g_gl.countUpload(vertices.size() * sizeof(ArenaVertex) + indices.size() * sizeof(GLuint));
+
+        range.firstIndex = static_cast<GLuint>(m_indexCount);
+        range.indexCount = static_cast<GLuint>(indices.size());
+        range.baseVertex = static_cast<GLint>(m_vertexCount);
+        m_vertexCount += vertices.size();
+        m_indexCount += indices.size();
+        return true;
+    }
+
+    // Space for this frame's per-draw data and commands: in the stream ring with
+    // multi-draw indirect, in the frame arena otherwise. False if it is not available.
+    bool beginDraws(size_t count, DrawInstance *&instances, DrawElementsIndirectCommand *&commands) {
+        if (!m_multiDrawIndirect) {
+            instances = g_frameArena.allocateArray<DrawInstance>(count);
+            commands = g_frameArena.allocateArray<DrawElementsIndirectCommand>(count);
+            return true;
+        }
+        const size_t bytes = count * (sizeof(DrawInstance) + sizeof(DrawElementsIndirectCommand));
+        char *data = static_cast<char *>(g_stream.allocate(bytes, 16, m_drawOffset));
+        if (!data)
+            return false;
+        instances = reinterpret_cast<DrawInstance *>(data);
+        commands = reinterpret_cast<DrawElementsIndirectCommand *>(data + count * sizeof(DrawInstance));
+        m_commandOffset = m_drawOffset + count * sizeof(DrawInstance);
+        return true;
+    }
+
+    // Hand the written draws over to GL and bind the arena VAO
+    void endDraws() {
+        g_gl.bindVertexArray(m_vao);
+        if (!m_multiDrawIndirect)
+            return;
+        g_stream.flush();
+        glBindBuffer(GL_ARRAY_BUFFER, g_stream.getBuffer());
+        for (GLuint column = 0; column < 4; ++column) {
+            glVertexAttribPointer(kInstanceAttribute + column, 4, GL_FLOAT, GL_FALSE, sizeof(DrawInstance),
+                                  (void *)(m_drawOffset + offsetof(DrawInstance, model) + column * sizeof(glm::vec4)));
+        }
+        glVertexAttribPointer(kInstanceAttribute + 4, 4, GL_FLOAT, GL_FALSE, sizeof(DrawInstance),
+                              (void *)(m_drawOffset + offsetof(DrawInstance, color)));
+        glVertexAttribIPointer(kInstanceAttribute + 5, 1, GL_UNSIGNED_INT, sizeof(DrawInstance),
+                               (void *)(m_drawOffset + offsetof(DrawInstance, material)));
+        glVertexAttribIPointer(kInstanceAttribute + 6, 1, GL_UNSIGNED_INT, sizeof(DrawInstance),
+                               (void *)(m_drawOffset + offsetof(DrawInstance, shadows)));
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, g_stream.getBuffer());
+    }
+
+    // Draw commands [first, first + count) of the frame, after endDraws(), as
+    // triangles or points
+    void draw(GLenum mode, const DrawInstance *instances, const DrawElementsIndirectCommand *commands, size_t first,
+              size_t count) {
+        if (count == 0)
+            return;
+        if (m_multiDrawIndirect) {
+            g_gl.countDrawCall();
+            m_multiDrawIndirect(mode, GL_UNSIGNED_INT,
+                                (void *)(m_commandOffset + first * sizeof(DrawElementsIndirectCommand)),
+                                static_cast<GLsizei>(count), 0);
+            return;
+        }
+        for (size_t i = first; i < first + count; ++i) {
+            const DrawInstance &instance = instances[i];
+            for (GLuint column = 0; column < 4; ++column)
+                glVertexAttrib4fv(kInstanceAttribute + column, glm::value_ptr(instance.model[column]));
+            glVertexAttrib4fv(kInstanceAttribute + 4, glm::value_ptr(instance.color));
+            glVertexAttribI4ui(kInstanceAttribute + 5, instance.material, 0, 0, 0);
+            glVertexAttribI4ui(kInstanceAttribute + 6, instance.shadows, 0, 0, 0);
+            g_gl.drawElementsBaseVertex(mode, static_cast<GLsizei>(commands[i].count), GL_UNSIGNED_INT,
+                                        (void *)(commands[i].firstIndex * sizeof(GLuint)), commands[i].baseVertex);
+        }
+    }
+
+    GLuint getVao() const { return m_vao; }
+    size_t getGpuBytes() const { return m_vertexCapacity * sizeof(ArenaVertex) + m_indexCapacity * sizeof(GLuint); }
+
+private:
+    GLuint m_vao;
+    GLuint m_vertexBuffer, m_indexBuffer;
+    size_t m_vertexCapacity, m_indexCapacity;
+    size_t m_vertexCount, m_indexCount;
+    GLintptr m_drawOffset, m_commandOffset; // This frame's draws in the stream ring
+    MultiDrawElementsIndirectFunction m_multiDrawIndirect;
+};
+
+GeometryArena g_geometry;
+
+class Mesh {
+public:
+    // Copy the mesh into the geometry arena (interleaved; unindexed meshes get
+    // trivial indices) and free the CPU vectors
+    void init() {
+        const size_t vertexCount = m_vertexPositions.size() / 3;
+        std::vector<ArenaVertex> vertices(vertexCount);
+        for (size_t v = 0; v < vertexCount; ++v) {
+            ArenaVertex &vertex = vertices[v];
+            std::memcpy(vertex.position, &m_vertexPositions[3 * v], sizeof(vertex.position));
+            if (!m_vertexNormals.empty())
+                std::memcpy(vertex.normal, &m_vertexNormals[3 * v], sizeof(vertex.normal));
+            else
+                vertex.normal[0] = vertex.normal[1] = vertex.normal[2] = 0.0f;
+            if (!m_vertexTexCoords.empty())
+                std::memcpy(vertex.texCoord, &m_vertexTexCoords[2 * v], sizeof(vertex.texCoord));
+            else
+                vertex.texCoord[0] = vertex.texCoord[1] = 0.0f;
+        }
+        if (m_triangleIndices.empty()) {
+            m_triangleIndices.resize(vertexCount);
+            for (size_t i = 0; i < vertexCount; ++i)
+                m_triangleIndices[i] = static_cast<unsigned int>(i);
+        }
+
+        if (g_geometry.allocate(vertices, m_triangleIndices, m_range))
+            m_gpuBytes = vertices.size() * sizeof(ArenaVertex) + m_triangleIndices.size() * sizeof(unsigned int);
+        std::vector<float>().swap(m_vertexPositions);
+        std::vector<float>().swap(m_vertexNormals);
+        std::vector<float>().swap(m_vertexTexCoords);
+        std::vector<unsigned int>().swap(m_triangleIndices);
+    }
+
+    // The arena space is not reclaimed (called by the mesh pool once the GPU is done with it)
+    void destroy() {
+        m_range = GeometryRange();
+        m_gpuBytes = 0;
+    }
+
+    // Range of the mesh in the geometry arena (empty if it did not fit)
+    const GeometryRange &getRange() const { return m_range; }
+
+    // Generate a sphere mesh with updated math to match user's code
+    static Mesh genSphere(const size_t resolution=16){
+        Mesh mesh;
+        const size_t vertexCount = (resolution + 1) * (resolution + 1);
+        mesh.m_vertexPositions.reserve(3 * vertexCount);
+        mesh.m_vertexNormals.reserve(3 * vertexCount);
+        mesh.m_vertexTexCoords.reserve(2 * vertexCount);
+        mesh.m_triangleIndices.reserve(6 * resolution * resolution);
+        for (size_t lat = 0; lat <= resolution; ++lat) {
+            float phi = lat * PI / resolution;
+            for (size_t lon = 0; lon <= resolution; ++lon) {
+                float theta = lon * 2.0f * PI / resolution;
+
+                // Updated math: x = sin(phi) * sin(theta), z = sin(phi) * cos(theta)
+                float x = sin(phi) * sin(theta);
+                float y = cos(phi);
+                float z = sin(phi) * cos(theta);
+
+                mesh.m_vertexPositions.push_back(x);
+                mesh.m_vertexPositions.push_back(y);
+                mesh.m_vertexPositions.push_back(z);
+
+                mesh.m_vertexNormals.push_back(x);
+                mesh.m_vertexNormals.push_back(y);
+                mesh.m_vertexNormals.push_back(z);
+
+                float u = static_cast<float>(lon) / resolution;
+                float v = static_cast<float>(lat) / resolution;
+
+                mesh.m_vertexTexCoords.push_back(u);
+                mesh.m_vertexTexCoords.push_back(v);
+
+                if (lat < resolution && lon < resolution) {
+                    size_t idx = lat * (resolution + 1) + lon;
+                    mesh.m_triangleIndices.push_back(static_cast<unsigned int>(idx));
+                    mesh.m_triangleIndices.push_back(static_cast<unsigned int>(idx + resolution + 1));
+                    mesh.m_triangleIndices.push_back(static_cast<unsigned int>(idx + resolution + 2));
+
+                    mesh.m_triangleIndices.push_back(static_cast<unsigned int>(idx));
+                    mesh.m_triangleIndices.push_back(static_cast<unsigned int>(idx + resolution + 2));
+                    mesh.m_triangleIndices.push_back(static_cast<unsigned int>(idx + 1));
+                }
+            }
+        }
+        return mesh;
+    }
+
+    // Generate the [-1, 1] square that impostors expand into camera-facing quads
+    static Mesh genQuad() {
+        Mesh mesh;
+        const float corners[] = { -1.0f, -1.0f, 0.0f, 1.0f, -1.0f, 0.0f, 1.0f, 1.0f, 0.0f, -1.0f, 1.0f, 0.0f };
+        const unsigned int indices[] = { 0, 1, 2, 0, 2, 3 };
+        mesh.m_vertexPositions.assign(corners, corners + 12);
+        mesh.m_triangleIndices.assign(indices, indices + 6);
+        return mesh;
+    }
+
+    // Generate a single vertex, drawn as a point (its position comes from the model matrix)
+    static Mesh genPoint() {
+        Mesh mesh;
+        mesh.m_vertexPositions.assign(3, 0.0f);
+        return mesh;
+    }
+
+    // Generate the box around a ring of the given outer radius and half thickness
+    // (y is the ring's axis), faces wound outwards; the ring program ray-marches
+    // the ring inside it
+    static Mesh genRingProxy(float outerRadius, float halfThickness) {
+        Mesh mesh;
+        for (int corner = 0; corner < 8; ++corner) {
+            mesh.m_vertexPositions.push_back(corner & 1 ? outerRadius : -outerRadius);
+            mesh.m_vertexPositions.push_back(corner & 2 ? halfThickness : -halfThickness);
+            mesh.m_vertexPositions.push_back(corner & 4 ? outerRadius : -outerRadius);
+        }
+        const unsigned int indices[] = { 1, 3, 7, 1, 7, 5,   // +x
+                                         0, 4, 6, 0, 6, 2,   // -x
+                                         2, 6, 7, 2, 7, 3,   // +y
+                                         0, 1, 5, 0, 5, 4,   // -y
+                                         4, 5, 7, 4, 7, 6,   // +z
+                                         0, 2, 3, 0, 3, 1 }; // -z
+        mesh.m_triangleIndices.assign(indices, indices + 36);
+        return mesh;
+    }
+
+    // Share of the geometry arena and memory held by the CPU vectors (empty once init() ran)
+    size_t getGpuBytes() const { return m_gpuBytes; }
+    size_t getCpuBytes() const {
+        return (m_vertexPositions.capacity() + m_vertexNormals.capacity() + m_vertexTexCoords.capacity()) * sizeof(float) +
+               m_triangleIndices.capacity() * sizeof(unsigned int);
+    }
+
+private:
+    std::vector<float> m_vertexPositions;
+    std::vector<float> m_vertexNormals;
+    std::vector<unsigned int> m_triangleIndices;
+    std::vector<float> m_vertexTexCoords;
+    GeometryRange m_range = GeometryRange();
+    size_t m_gpuBytes = 0;
+};
+
+typedef ResourceHandle<Mesh> MeshHandle;
+
+void destroyMesh(Mesh &mesh) { mesh.destroy(); }
+
+ResourcePool<Mesh> g_meshes("mesh", destroyMesh);
+
+// Declare the sphere and ring meshes
+MeshHandle g_sphereMesh;
+MeshHandle g_ringMesh; // Box the rings are ray-marched in
+MeshHandle g_impostorMesh;
+MeshHandle g_pointMesh;
+
+// Time management
+float deltaTime = 0.0f;	
+float lastFrame = 0.0f;
+
+// Simulation time and state
+float simulationTime = 0.0f; // Custom simulation time
+bool isSimulationFrozen = false; // Simulation frozen state
+
+// Input handling
+bool keys[1024] = { false };
+
+// Why the next frame has to be drawn. When no flag is set the main loop skips
+// render() and sleeps in glfwWaitEventsTimeout until an event arrives.
+enum DirtyFlag {
+    DIRTY_CAMERA = 1 << 0,     // Mouse look, zoom, movement keys
+    DIRTY_SIMULATION = 1 << 1, // Simulation time advancing or toggled
+    DIRTY_WINDOW = 1 << 2,     // Resize, expose, first frame
+    DIRTY_RESOURCES = 1 << 3,  // Texture residency converging
+    DIRTY_EXPOSURE = 1 << 4    // Auto exposure adapting
+};
+unsigned int g_dirty = DIRTY_WINDOW;
+
+// Longest idle sleep, so that deferred GPU garbage still gets collected
+const double kIdleWaitSeconds = 0.5;
+
+// Window size at creation, and whether to render without a visible window
+int g_windowWidth = 1024;
+int g_windowHeight = 1024;
+bool g_headless = false;
+
+// Fraction of the window size the scene is rendered at (see Dynamic resolution)
+float g_resolutionScale = 1.0f;
+float g_targetFrameMs = 16.7f; // GPU time target of the dynamic resolution, 0 keeps the full resolution
+
+void printMemoryReport(); // Texture residency section
+
+// GLFW callbacks
+void windowSizeCallback(GLFWwindow *window, int width, int height) {
+    g_windowWidth = width;
+    g_windowHeight = height;
+    g_dirty |= DIRTY_WINDOW;
+    g_camera.setAspectRatio(static_cast<float>(width) / static_cast<float>(height));
+    g_gl.viewport(0, 0, (GLint)width, (GLint)height);
+}
+
+void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods) {
+    if (key >= 0 && key < 1024) {
+        if (action == GLFW_PRESS)
+            keys[key] = true;
+        else if (action == GLFW_RELEASE)
+            keys[key] = false;
+    }
+
+    if (action == GLFW_PRESS && key == GLFW_KEY_ESCAPE)
+        glfwSetWindowShouldClose(window, true);
+
+    if (action == GLFW_PRESS && key == GLFW_KEY_F) {
+        isSimulationFrozen = !isSimulationFrozen;
+        g_dirty |= DIRTY_SIMULATION;
+    }
+
+    if (action == GLFW_PRESS && key == GLFW_KEY_M)
+        printMemoryReport();
+}
+
+void mouseCallback(GLFWwindow* window, double xpos, double ypos) {
+    g_camera.processMouseMovement(static_cast<float>(xpos), static_cast<float>(ypos));
+    g_dirty |= DIRTY_CAMERA;
+}
+
+void scrollCallback(GLFWwindow* window, double xoffset, double yoffset) {
+    g_camera.processMouseScroll(static_cast<float>(yoffset));
+    g_dirty |= DIRTY_CAMERA;
+}
+
+void windowRefreshCallback(GLFWwindow *) {
+    g_dirty |= DIRTY_WINDOW;
+}
+
+// Keys that move or zoom the camera every frame while held (see doMovement)
+bool isCameraMoving() {
+    const int movementKeys[] = { GLFW_KEY_W, GLFW_KEY_S, GLFW_KEY_A, GLFW_KEY_D, GLFW_KEY_SPACE,
+                                 GLFW_KEY_LEFT_SHIFT, GLFW_KEY_Q, GLFW_KEY_E };
+    for (size_t i = 0; i < sizeof(movementKeys) / sizeof(movementKeys[0]); ++i)
+        if (keys[movementKeys[i]])
+            return true;
+    return false;
+}
+
+void doMovement() {
+    if (keys[GLFW_KEY_W])
+        g_camera.processKeyboard(GLFW_KEY_W, deltaTime);
+    if (keys[GLFW_KEY_S])
+        g_camera.processKeyboard(GLFW_KEY_S, deltaTime);
+    if (keys[GLFW_KEY_A])
+        g_camera.processKeyboard(GLFW_KEY_A, deltaTime);
+    if (keys[GLFW_KEY_D])
+        g_camera.processKeyboard(GLFW_KEY_D, deltaTime);
+    if (keys[GLFW_KEY_SPACE])
+        g_camera.processKeyboard(GLFW_KEY_SPACE, deltaTime);
+    if (keys[GLFW_KEY_LEFT_SHIFT])
+        g_camera.processKeyboard(GLFW_KEY_LEFT_SHIFT, deltaTime);
+
+    // Zoom key handling
+    if (keys[GLFW_KEY_Q])
+        g_camera.processKeyboardZoom(true, deltaTime); // Zoom in
+    if (keys[GLFW_KEY_E])
+        g_camera.processKeyboardZoom(false, deltaTime); // Zoom out
+}
+
+void errorCallback(int error, const char *desc) {
+    std::cout << "Error " << error << ": " << desc << std::endl;
+}
+
+void initGLFW() {
+    glfwSetErrorCallback(errorCallback);
+
+    // Headless runs need neither a display nor a GPU: null platform + OSMesa software context
+    if (g_headless)
+        glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+
+    if (!glfwInit()) {
+        std::cerr << "ERROR: Failed to init GLFW" << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, g_headless ? GL_FALSE : GL_TRUE); // OSMesa has no forward-compatible contexts
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE); 
+    glfwWindowHint(GLFW_RESIZABLE, GL_TRUE);
+    if (g_headless) {
+        glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+    }
+
+    g_window = glfwCreateWindow(g_windowWidth, g_windowHeight, "Simple Solar System with Saturn's Rings", nullptr, nullptr);
+    if (!g_window) {
+        std::cerr << "ERROR: Failed to open window" << std::endl;
+        glfwTerminate();
+        std::exit(EXIT_FAILURE);
+    }
+
+    glfwMakeContextCurrent(g_window);
+    glfwSetWindowSizeCallback(g_window, windowSizeCallback);
+    glfwSetKeyCallback(g_window, keyCallback);
+    glfwSetCursorPosCallback(g_window, mouseCallback);
+    glfwSetScrollCallback(g_window, scrollCallback);
+    glfwSetWindowRefreshCallback(g_window, windowRefreshCallback);
+    glfwSetInputMode(g_window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+}
+
+// Depth is reversed (1 near, 0 far) in both modes, so the test is always GL_GREATER.
+// DEPTH_REVERSE_Z: glClipControl maps clip z to [0, 1] and the scene goes to the
+// float depth buffer of the offscreen target. DEPTH_LOGARITHMIC (GL 3.3 fallback,
+// or fixed-point depth): shaders write 1 - log2(1 + w) / log2(1 + far) themselves.
+enum DepthMode { DEPTH_REVERSE_Z, DEPTH_LOGARITHMIC };
+DepthMode g_depthMode = DEPTH_LOGARITHMIC;
+
+#ifndef GL_ZERO_TO_ONE
+#define GL_ZERO_TO_ONE 0x935F
+#endif
+typedef void (GLAD_API_PTR *ClipControlFunction)(GLenum origin, GLenum depth);
+
+void initOpenGL() {
+    if (!gladLoadGL(glfwGetProcAddress)) {
+        std::cerr << "ERROR: Failed to initialize OpenGL context" << std::endl;
+        glfwTerminate();
+        std::exit(EXIT_FAILURE);
+    }
+
+    g_gl.reset();
+    g_gl.cullFace(GL_BACK);
+    g_gl.setEnabled(GL_CULL_FACE, true);               
+    g_gl.depthFunc(GL_GREATER);
+    glClearDepth(0.0);
+    g_gl.setEnabled(GL_DEPTH_TEST, true);              
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f); // Space; the stars add up over it
+    glEnable(GL_PROGRAM_POINT_SIZE);      // Point sizes come from the point shader
+
+    // glClipControl is GL 4.5 / ARB_clip_control, beyond what glad was generated for
+    GLint major = 0, minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    ClipControlFunction clipControl = nullptr;
+    if (!g_glFallback && (major > 4 || (major == 4 && minor >= 5) || glfwExtensionSupported("GL_ARB_clip_control")))
+        clipControl = reinterpret_cast<ClipControlFunction>(glfwGetProcAddress("glClipControl"));
+    if (clipControl) {
+        clipControl(GL_LOWER_LEFT, GL_ZERO_TO_ONE);
+        g_depthMode = DEPTH_REVERSE_Z;
+    } else {
+        g_depthMode = DEPTH_LOGARITHMIC;
+    }
+    std::cout << "Depth: " << (g_depthMode == DEPTH_REVERSE_Z ? "reverse-Z, float buffer" : "logarithmic") << std::endl;
+}
+
+// Load shader source from the asset archive (or file)
+std::string file2String(const std::string &filename) {
+    AssetData asset;
+    if (!readAsset(filename, asset)) {
+        std::cerr << "ERROR: Could not open shader file " << filename << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    return std::string(reinterpret_cast<const char *>(asset.data), asset.size);
+}
+
+// Load and compile shader; prelude (defines) goes right after the #version line
+void loadShader(GLuint program, GLenum type, const std::string &shaderFilename, const std::string &prelude) {
+    GLuint shader = glCreateShader(type);                                    
+    std::string shaderSourceString = file2String(shaderFilename);            
+    const size_t versionEnd = shaderSourceString.find('\n', shaderSourceString.find("#version"));
+    shaderSourceString.insert(versionEnd == std::string::npos ? shaderSourceString.size() : versionEnd + 1, prelude);
+    const GLchar *shaderSource = (const GLchar *)shaderSourceString.c_str(); 
+    glShaderSource(shader, 1, &shaderSource, NULL);                          
+    glCompileShader(shader);
+    GLint success;
+    GLchar infoLog[512];
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    if (!success) {
+        glGetShaderInfoLog(shader, 512, NULL, infoLog);
+        std::cout << "ERROR in compiling " << shaderFilename << "\n\t" << infoLog << std::endl;
+    }
+    glAttachShader(program, shader); 
+    glDeleteShader(shader);
+}
+
+// Eclipses, ring shadows, sky and point lights of the lit body shaders
+const char *const kLightingShader = "lighting.glsl";
+
+// Compile and link a vertex + fragment shader pair into a pooled program. Shaders
+// are compiled for the depth mode: LOG_DEPTH is defined where they must write a
+// logarithmic depth, and otherwise those that can leave gl_FragDepth alone keep
+// early depth testing. A fragment library (lighting.glsl) goes ahead of the
+// fragment shader as source string 1, so errors keep the lines of each file.
+ProgramHandle createProgram(const std::string &vertexShaderFilename, const std::string &fragmentShaderFilename,
+                            const std::string &name, const char *fragmentLibrary = nullptr) {
+    const std::string prelude = g_depthMode == DEPTH_LOGARITHMIC ? "#define LOG_DEPTH\n" : "";
+    std::string fragmentPrelude = prelude;
+    if (fragmentLibrary)
+        fragmentPrelude += "#line 1 1\n" + file2String(fragmentLibrary) + "\n#line 2 0\n";
+    GLuint program = glCreateProgram();
+    loadShader(program, GL_VERTEX_SHADER, vertexShaderFilename, prelude);
+    loadShader(program, GL_FRAGMENT_SHADER, fragmentShaderFilename, fragmentPrelude);
+    glLinkProgram(program);
+
+    // Check for linking errors
+    GLint success;
+    GLchar infoLog[512];
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        glGetProgramInfoLog(program, 512, NULL, infoLog);
+        std::cout << "ERROR: " << name << " shader program linking failed:\n" << infoLog << std::endl;
+    }
+
+    Program resource = { program };
+    return g_programs.create(resource, name);
+}
+
+void initGPUprogram() {
+    g_program = createProgram("vertexShader.glsl", "fragmentShader.glsl", "main", kLightingShader);
+    // Body programs: texture array on unit 0, material table at its binding point
+    g_impostorProgram =
+        createProgram("impostorVertexShader.glsl", "impostorFragmentShader.glsl", "impostor", kLightingShader);
+    g_pointProgram = createProgram("pointVertexShader.glsl", "pointFragmentShader.glsl", "point");
+    // Rings: their profile on unit 1, which the mesh and impostor programs read for the rings' shadow
+    g_ringProgram = createProgram("ringVertexShader.glsl", "ringFragmentShader.glsl", "ring", kLightingShader);
+    // Atmospheres: their tables from kAtmosphereTextureUnit on, which the mesh and
+    // impostor programs read for the light reaching the ground
+    g_atmosphereProgram = createProgram("atmosphereVertexShader.glsl", "atmosphereFragmentShader.glsl", "atmosphere");
+    const ProgramHandle bodyPrograms[] = { g_program, g_impostorProgram, g_pointProgram, g_ringProgram,
+                                           g_atmosphereProgram };
+    for (size_t i = 0; i < sizeof(bodyPrograms) / sizeof(bodyPrograms[0]); ++i) {
+        const GLuint program = programId(bodyPrograms[i]);
+        g_gl.useProgram(program);
+        g_gl.uniform1i(glGetUniformLocation(program, "bodyTextures"), 0);
+        g_gl.uniform1i(glGetUniformLocation(program, "ringProfile"), 1);
+        g_gl.uniform1i(glGetUniformLocation(program, "atmosphereTransmittance"), kAtmosphereTextureUnit);
+        g_gl.uniform1i(glGetUniformLocation(program, "atmosphereScattering"), kAtmosphereTextureUnit + 1);
+        g_gl.uniform1i(glGetUniformLocation(program, "atmosphereIrradiance"), kAtmosphereTextureUnit + 2);
+        g_gl.uniform1i(glGetUniformLocation(program, "environmentMap"), kEnvironmentTextureUnit);
+        g_gl.uniform1i(glGetUniformLocation(program, "lightData"), kLightTextureUnit);
+        g_gl.uniform1i(glGetUniformLocation(program, "lightClusters"), kLightTextureUnit + 1);
+        const GLuint materials = glGetUniformBlockIndex(program, "Materials"); // Not in the ring program
+        if (materials != GL_INVALID_INDEX)
+            glUniformBlockBinding(program, materials, kMaterialBlockBinding);
+        const GLuint occluders = glGetUniformBlockIndex(program, "Occluders"); // Not in the point program
+        if (occluders != GL_INVALID_INDEX)
+            glUniformBlockBinding(program, occluders, kShadowBlockBinding);
+    }
+
+    g_starProgram = createProgram("starVertexShader.glsl", "starFragmentShader.glsl", "stars");
+
+    upscaleProgram = createProgram("upscaleVertexShader.glsl", "upscaleFragmentShader.glsl", "upscale");
+    g_gl.useProgram(programId(upscaleProgram));
+    g_gl.uniform1i(glGetUniformLocation(programId(upscaleProgram), "sceneTexture"), 0);
+    g_gl.uniform1i(glGetUniformLocation(programId(upscaleProgram), "bloomTexture"), 1);
+    g_bloomDownProgram = createProgram("upscaleVertexShader.glsl", "bloomDownFragmentShader.glsl", "bloom down");
+    g_bloomUpProgram = createProgram("upscaleVertexShader.glsl", "bloomUpFragmentShader.glsl", "bloom up");
+    g_gl.useProgram(programId(g_bloomDownProgram));
+    g_gl.uniform1i(glGetUniformLocation(programId(g_bloomDownProgram), "sourceTexture"), 0);
+    g_gl.useProgram(programId(g_bloomUpProgram));
+    g_gl.uniform1i(glGetUniformLocation(programId(g_bloomUpProgram), "sourceTexture"), 0);
+    g_luminanceProgram = createProgram("upscaleVertexShader.glsl", "luminanceFragmentShader.glsl", "luminance");
+    g_gl.useProgram(programId(g_luminanceProgram));
+    g_gl.uniform1i(glGetUniformLocation(programId(g_luminanceProgram), "sceneTexture"), 0);
+}
+
+//------------------------------------------------------------------------------
+// Scene generation
+//------------------------------------------------------------------------------
+
+Body makeBody(BodyKind kind, int parent, float size, float orbitRadius, float orbitPeriod,
+              float rotationPeriod, BodyMaterial material, const glm::vec3 &color) {
+    Body body;
+    body.kind = kind;
+    body.parent = parent;
+    body.size = size;
+    body.orbitRadius = orbitRadius;
+    body.orbitPeriod = orbitPeriod;
+    body.orbitPhase = 0.0f;
+    body.orbitInclination = 0.0f;
+    body.rotationPeriod = rotationPeriod;
+    body.material = material;
+    body.color = color;
+    body.hasRing = false;
+    body.hasAtmosphere = (material == MATERIAL_EARTH);
+    body.depth = 0;
+    return body;
+}
+
+// The hand-made scene: Sun, Earth, Moon and Saturn with its rings
+void buildDefaultScene() {
+    g_bodies.clear();
+    if (g_scenario.trueScale) {
+        // Same bodies at real radii and distances. Sizes and orbits are in the
+        // parent's scaled frame, hence the Moon's in Earth radii.
+        g_bodies.push_back(makeBody(BODY_STAR, -1, kTrueSizeSun, 0.0f, 0.0f, 0.0f, MATERIAL_SUN, sunColor));
+        g_bodies.push_back(makeBody(BODY_PLANET, -1, kTrueSizeEarth, kTrueRadOrbitEarth, earthOrbitPeriod,
+                                    earthRotationPeriod, MATERIAL_EARTH, glm::vec3(1.0f)));
+        g_bodies.push_back(makeBody(BODY_MOON, 1, kTrueSizeMoon / kTrueSizeEarth, kTrueRadOrbitMoon / kTrueSizeEarth,
+                                    moonOrbitPeriod, moonRotationPeriod, MATERIAL_MOON, glm::vec3(1.0f)));
+        g_bodies.push_back(makeBody(BODY_PLANET, -1, kTrueSizeSaturn, kTrueRadOrbitSaturn, saturnOrbitPeriod,
+                                    saturnRotationPeriod, MATERIAL_SATURN, glm::vec3(1.0f)));
+        g_bodies.back().hasRing = true;
+        return;
+    }
+    g_bodies.push_back(makeBody(BODY_STAR, -1, kSizeSun, 0.0f, 0.0f, 0.0f, MATERIAL_SUN, sunColor));
+    g_bodies.push_back(makeBody(BODY_PLANET, -1, kSizeEarth, kRadOrbitEarth, earthOrbitPeriod,
+                                earthRotationPeriod, MATERIAL_EARTH, glm::vec3(1.0f)));
+    g_bodies.push_back(makeBody(BODY_MOON, 1, kSizeMoon, kRadOrbitMoon, moonOrbitPeriod,
+                                moonRotationPeriod, MATERIAL_MOON, glm::vec3(1.0f)));
+    g_bodies.push_back(makeBody(BODY_PLANET, -1, kSizeSaturn, kRadOrbitSaturn, saturnOrbitPeriod,
+                                saturnRotationPeriod, MATERIAL_SATURN, glm::vec3(1.0f)));
+    g_bodies.back().hasRing = true;
+}
+
+// Orbital period following Kepler's third law, anchored on the Earth's orbit
+float keplerPeriod(float orbitRadius) {
+    return earthOrbitPeriod * std::pow(orbitRadius / kRadOrbitEarth, 1.5f);
+}
+
+// Procedural stress scene. The same config (seed included) always yields the same scene.
+void buildStressScene(const ScenarioConfig &config) {
+    std::mt19937 rng(config.seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    auto range = [&](float lo, float hi) { return lo + (hi - lo) * unit(rng); };
+
+    const BodyMaterial planetMaterials[] = { MATERIAL_EARTH, MATERIAL_MOON, MATERIAL_SATURN };
+    const int planets = std::max(config.planets, config.ringParticles > 0 ? 1 : 0);
+    const int moons = planets * config.moonsPerPlanet;
+
+    g_bodies.clear();
+    g_bodies.reserve(1 + planets + moons + config.ringParticles + config.asteroids);
+    g_bodies.push_back(makeBody(BODY_STAR, -1, kSizeSun, 0.0f, 0.0f, 0.0f, MATERIAL_SUN, sunColor));
+
+    // Planets on roughly evenly spaced orbits, leaving a gap for the asteroid belt
+    const float kFirstOrbit = 4.0f;
+    const float kOrbitSpacing = 3.5f;
+    const int beltSlot = planets / 2;
+    std::vector<int> planetIndices;
+    for (int i = 0; i < planets; ++i) {
+        const float slot = static_cast<float>(i + (i >= beltSlot ? 1 : 0));
+        const float radius = kFirstOrbit + kOrbitSpacing * (slot + range(-0.2f, 0.2f));
+        Body planet = makeBody(BODY_PLANET, -1, range(0.25f, 0.8f), radius, keplerPeriod(radius),
+                               range(1.0f, 6.0f), planetMaterials[i % 3], glm::vec3(1.0f));
+        planet.orbitPhase = range(0.0f, 2.0f * PI);
+        planet.hasRing = (planet.material == MATERIAL_SATURN);
+        planetIndices.push_back(static_cast<int>(g_bodies.size()));
+        g_bodies.push_back(planet);
+    }
+    // Ring particles need a ringed planet to orbit
+    if (config.ringParticles > 0 && !g_bodies[planetIndices[0]].hasRing) {
+        g_bodies[planetIndices[0]].material = MATERIAL_SATURN;
+        g_bodies[planetIndices[0]].hasRing = true;
+    }
+
+    for (size_t p = 0; p < planetIndices.size(); ++p) {
+        for (int m = 0; m < config.moonsPerPlanet; ++m) {
+            const float radius = range(1.6f, 4.0f);
+            Body moon = makeBody(BODY_MOON, planetIndices[p], range(0.08f, 0.3f), radius,
+                                 range(1.0f, 4.0f), range(1.0f, 4.0f), MATERIAL_MOON, glm::vec3(1.0f));
+            moon.orbitPhase = range(0.0f, 2.0f * PI);
+            moon.orbitInclination = glm::radians(range(-10.0f, 10.0f));
+            g_bodies.push_back(moon);
+        }
+    }
+
+    std::vector<int> ringedPlanets;
+    for (size_t p = 0; p < planetIndices.size(); ++p)
+        if (g_bodies[planetIndices[p]].hasRing)
+            ringedPlanets.push_back(planetIndices[p]);
+    for (int i = 0; i < config.ringParticles; ++i) {
+        // Same radial extent as the rings, in the planet's frame
+        const float radius = range(kRingInnerRadius, kRingOuterRadius);
+        const float shade = range(0.6f, 0.9f);
+        Body particle = makeBody(BODY_RING_PARTICLE, ringedPlanets[i % ringedPlanets.size()],
+                                 range(0.005f, 0.02f), radius, 0.5f * std::pow(radius, 1.5f), 0.0f,
+                                 MATERIAL_PLAIN, glm::vec3(shade, shade * 0.95f, shade * 0.8f));
+        particle.orbitPhase = range(0.0f, 2.0f * PI);
+        particle.orbitInclination = glm::radians(kRingTiltDegrees);
+        g_bodies.push_back(particle);
+    }
+
+    const float beltInner = kFirstOrbit + kOrbitSpacing * (beltSlot - 0.3f);
+    const float beltOuter = kFirstOrbit + kOrbitSpacing * (beltSlot + 0.3f);
+    for (int i = 0; i < config.asteroids; ++i) {
+        const float radius = range(beltInner, beltOuter);
+        const float shade = range(0.35f, 0.6f);
+        Body asteroid = makeBody(BODY_ASTEROID, -1, range(0.02f, 0.07f), radius, keplerPeriod(radius),
+                                 range(0.5f, 3.0f), MATERIAL_PLAIN, glm::vec3(shade));
+        asteroid.orbitPhase = range(0.0f, 2.0f * PI);
+        asteroid.orbitInclination = glm::radians(range(-3.0f, 3.0f));
+        g_bodies.push_back(asteroid);
+    }
+}
+
+// Spread config.lights point lights over the planets, moons and asteroids, from
+// their own random stream so that adding lights leaves the bodies unchanged. A
+// light orbits just above its body and reaches a few radii: many lights do not
+// pile up on the same fragments unless there are many more lights than bodies.
+void buildLights(const ScenarioConfig &config) {
+    g_lights.clear();
+    std::vector<int> hosts;
+    for (size_t i = 0; i < g_bodies.size(); ++i)
+        if (g_bodies[i].kind == BODY_PLANET || g_bodies[i].kind == BODY_MOON || g_bodies[i].kind == BODY_ASTEROID)
+            hosts.push_back(static_cast<int>(i));
+    if (hosts.empty() || config.lights <= 0)
+        return;
+
+    std::mt19937 rng(config.seed ^ 0x9e3779b9u);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    auto range = [&](float lo, float hi) { return lo + (hi - lo) * unit(rng); };
+    const glm::vec3 palette[] = { glm::vec3(1.0f, 0.55f, 0.25f), glm::vec3(0.35f, 0.75f, 1.0f),
+                                  glm::vec3(0.45f, 1.0f, 0.5f), glm::vec3(1.0f, 0.4f, 0.8f), glm::vec3(1.0f) };
+    const int lights = std::min(config.lights, kMaxPointLights);
+    g_lights.reserve(lights);
+    for (int i = 0; i < lights; ++i) {
+        PointLight light;
+        light.body = hosts[i % hosts.size()];
+        light.orbitRadius = range(1.3f, 2.0f);
+        light.orbitPeriod = range(2.0f, 6.0f);
+        light.orbitPhase = range(0.0f, 2.0f * PI);
+        light.orbitInclination = glm::radians(range(-60.0f, 60.0f));
+        // As bright as the Sun on the ground right below
+        const float height = light.orbitRadius - 1.0f;
+        light.color = palette[i % 5] * (height * height);
+        light.range = 3.0f;
+        g_lights.push_back(light);
+    }
+    g_lightSpheres.assign(g_lights.size(), glm::vec4(0.0f));
+}
+
+void buildScene(const ScenarioConfig &config) {
+    if (config.isDefaultScene())
+        buildDefaultScene();
+    else
+        buildStressScene(config);
+    g_bodyWorldMats.assign(g_bodies.size(), glm::mat4(1.0f));
+    g_bodyVisible.assign(g_bodies.size(), 1);
+
+    g_maxBodyDepth = 0;
+    for (size_t i = 0; i < g_bodies.size(); ++i) {
+        Body &body = g_bodies[i];
+        body.depth = body.parent >= 0 ? g_bodies[body.parent].depth + 1 : 0;
+        g_maxBodyDepth = std::max(g_maxBodyDepth, body.depth);
+    }
+    buildLights(config);
+}
+
+// Generate the box the rings are drawn in
+Mesh genRingMesh() {
+    return Mesh::genRingProxy(kRingOuterRadius, kRingHalfThickness);
+}
+
+// Pool the meshes generated on the CPU and copy them into the geometry arena
+void initGPUgeometry(const Mesh &sphere, const Mesh &ring) {
+    g_geometry.init(kArenaVertexCapacity, kArenaIndexCapacity);
+    g_sphereMesh = g_meshes.create(sphere, "sphere");
+    g_ringMesh = g_meshes.create(ring, "ring");
+    g_impostorMesh = g_meshes.create(Mesh::genQuad(), "impostor quad");
+    g_pointMesh = g_meshes.create(Mesh::genPoint(), "point");
+
+    g_meshes.get(g_sphereMesh)->init();
+    g_meshes.get(g_impostorMesh)->init();
+    g_meshes.get(g_pointMesh)->init();
+
+    // Initialize the ring mesh
+    if (Mesh *ringMesh = g_meshes.get(g_ringMesh)) {
+        ringMesh->init();
+    }
+}
+
+void initCamera() {
+    int width, height;
+    glfwGetWindowSize(g_window, &width, &height);
+    g_camera.setAspectRatio(static_cast<float>(width) / static_cast<float>(height));
+
+    g_camera.setPosition(glm::vec3(0.0f, 0.0f, 30.0f));
+
+    // The far plane is at infinity; far only bounds the logarithmic depth range
+    g_camera.setNear(0.1f);
+    g_camera.setFar(1.0e4f);
+
+    if (g_scenario.trueScale) {
+        // Start next to the Earth, 1 km near plane, travel at 100 000 km/s
+        g_camera.setPosition(glm::vec3(kTrueRadOrbitEarth, 10.0f, 60.0f));
+        g_camera.setNear(0.001f);
+        g_camera.setFar(1.0e7f);
+        g_camera.setSpeed(100.0f);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Texture arrays and material table
+//------------------------------------------------------------------------------
+
+// Body textures of the same size and format are the layers of one 2D array
+// texture. The material table says, per material, which array and layer to use;
+// the shaders read it from a uniform buffer (one std140 ivec4 per material:
+// layer, textured, emissive) indexed by a per-draw attribute, so bodies sharing
+// an array are drawn without any texture change between them.
+struct MaterialEntry {
+    int array; // Index in g_textureArrays, -1 if untextured
+    int layer;
+};
+
+std::vector<TextureHandle> g_textureArrays;
+MaterialEntry g_materialTable[kMaterialSlots];
+GLuint g_materialBuffer = 0;
+
+// Upload the material table to its uniform buffer, bound once and for all
+void uploadMaterialTable() {
+    GLint entries[kMaxMaterialSlots][4] = {};
+    for (int m = 0; m < kMaterialSlots; ++m) {
+        entries[m][0] = g_materialTable[m].layer;
+        entries[m][1] = g_materialTable[m].array >= 0 ? 1 : 0;
+        entries[m][2] = m == MATERIAL_SUN ? 1 : 0;
+    }
+    if (g_materialBuffer == 0)
+        glGenBuffers(1, &g_materialBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, g_materialBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(entries), entries, GL_STATIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, kMaterialBlockBinding, g_materialBuffer);
+    g_gl.countUpload(sizeof(entries));
+}
+
+void shutdownMaterials() {
+    for (size_t a = 0; a < g_textureArrays.size(); ++a)
+        g_textures.release(g_textureArrays[a]);
+    g_textureArrays.clear();
+    glDeleteBuffers(1, &g_materialBuffer);
+    g_materialBuffer = 0;
+}
+
+//------------------------------------------------------------------------------
+// Star catalog
+//------------------------------------------------------------------------------
+
+// The sky is a star catalog (src/stars.bin) drawn as points sized and weighted by
+// magnitude, which stay crisp at any field of view. The sphere is split into
+// buckets along the cells of a cube map; the stars of a bucket are contiguous and
+// sorted brightest first, and each bucket counts its stars brighter than every
+// magnitude step, so a bucket in view draws one prefix of its range. Layout:
+// header, kStarBucketCount buckets, stars. The archive stores the catalog
+// uncompressed, so it is used in place from the mapping.
+
+struct StarCatalogHeader {
+    char magic[4]; // "STAR"
+    uint32_t version;
+    uint32_t starCount;
+    uint32_t bucketCount;
+    float faintestMagnitude;
+};
+
+const uint32_t kStarCatalogVersion = 1;
+const int kStarBucketResolution = 8; // Cells per cube face edge
+const int kStarBucketCount = 6 * kStarBucketResolution * kStarBucketResolution;
+const int kStarMagnitudeSteps = 40;
+const float kStarMinMagnitude = -2.0f;
+const float kStarMagnitudeStep = 0.5f;
+const float kStarMaxMagnitude = kStarMinMagnitude + kStarMagnitudeSteps * kStarMagnitudeStep;
+const float kMinColorIndex = -0.4f;
+const float kMaxColorIndex = 2.0f;
+
+struct StarBucket {
+    float axis[3];   // Direction of the cell center
+    float sinRadius; // Sine of the angle from the axis to the farthest corner
+    uint32_t first;  // First star of the bucket
+    uint32_t brighterThan[kStarMagnitudeSteps]; // Stars below kStarMinMagnitude + (i + 1) * kStarMagnitudeStep
+};
+
+// 8 bytes: octahedral direction (snorm16), magnitude in hundredths, B-V index
+// mapped from [kMinColorIndex, kMaxColorIndex] to [0, 255]
+struct CatalogStar {
+    int16_t direction[2];
+    int16_t magnitude;
+    uint8_t colorIndex;
+    uint8_t padding;
+};
+static_assert(sizeof(CatalogStar) == 8, "catalog stars are vertices, keep them packed");
+
+// A star before encoding
+struct StarRecord {
+    glm::vec3 direction;
+    float magnitude;
+    float colorIndex; // B-V
+};
+
+// Bucket of a unit direction: the cube map cell it falls in
+int starBucketOf(const glm::vec3 &d) {
+    const glm::vec3 a = glm::abs(d);
+    int face;
+    float u, v;
+    if (a.x >= a.y && a.x >= a.z) {
+        face = d.x > 0.0f ? 0 : 1;
+        u = d.y / a.x;
+        v = d.z / a.x;
+    } else if (a.y >= a.z) {
+        face = d.y > 0.0f ? 2 : 3;
+        u = d.x / a.y;
+        v = d.z / a.y;
+    } else {
+        face = d.z > 0.0f ? 4 : 5;
+        u = d.x / a.z;
+        v = d.y / a.z;
+    }
+    const int r = kStarBucketResolution;
+    const int i = std::min(static_cast<int>((u + 1.0f) * 0.5f * r), r - 1);
+    const int j = std::min(static_cast<int>((v + 1.0f) * 0.5f * r), r - 1);
+    return (face * r + j) * r + i;
+}
+
+// Direction of the point (u, v) of a cube face, in starBucketOf's convention
+glm::vec3 cubeFaceDirection(int face, float u, float v) {
+    const float sign = (face & 1) ? -1.0f : 1.0f;
+    switch (face >> 1) {
+    case 0:
+        return glm::normalize(glm::vec3(sign, u, v));
+    case 1:
+        return glm::normalize(glm::vec3(u, sign, v));
+    default:
+        return glm::normalize(glm::vec3(u, v, sign));
+    }
+}
+
+inline int16_t toSnorm16(float x) {
+    return static_cast<int16_t>(std::floor(glm::clamp(x, -1.0f, 1.0f) * 32767.0f + 0.5f));
+}
+
+// Octahedral encoding: the L1-normalized direction, lower hemisphere folded over
+void encodeOctahedral(const glm::vec3 &d, int16_t out[2]) {
+    const float l1 = std::abs(d.x) + std::abs(d.y) + std::abs(d.z);
+    float x = d.x / l1, y = d.y / l1;
+    if (d.z < 0.0f) {
+        const float folded = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        y = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = folded;
+    }
+    out[0] = toSnorm16(x);
+    out[1] = toSnorm16(y);
+}
+
+// Inverse of encodeOctahedral, as in starVertexShader.glsl
+glm::vec3 decodeOctahedral(const int16_t in[2]) {
+    const float x = std::max(in[0] / 32767.0f, -1.0f), y = std::max(in[1] / 32767.0f, -1.0f);
+    glm::vec3 d(x, y, 1.0f - std::abs(x) - std::abs(y));
+    if (d.z < 0.0f) {
+        d.x = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        d.y = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+    }
+    return glm::normalize(d);
+}
+
+// Rough color of a star from its B-V index, as in starVertexShader.glsl
+glm::vec3 starColor(float bv) {
+    glm::vec3 color = glm::mix(glm::vec3(0.64f, 0.74f, 1.0f), glm::vec3(1.0f), glm::smoothstep(-0.3f, 0.3f, bv));
+    color = glm::mix(color, glm::vec3(1.0f, 0.92f, 0.74f), glm::smoothstep(0.3f, 0.9f, bv));
+    return glm::mix(color, glm::vec3(1.0f, 0.72f, 0.46f), glm::smoothstep(0.9f, 1.7f, bv));
+}
+
+// Bucket, sort and encode the stars, then write the catalog
+bool writeStarCatalog(const std::string &filename, std::vector<StarRecord> &stars) {
+    std::vector<std::pair<uint64_t, uint32_t> > order(stars.size()); // (bucket, magnitude) key, star
+    for (size_t s = 0; s < stars.size(); ++s) {
+        StarRecord &star = stars[s];
+        star.direction = glm::normalize(star.direction);
+        star.magnitude = glm::clamp(star.magnitude, kStarMinMagnitude, kStarMaxMagnitude - 0.01f);
+        const uint32_t magnitude = static_cast<uint32_t>((star.magnitude - kStarMinMagnitude) * 100.0f);
+        order[s] = std::make_pair((uint64_t(starBucketOf(star.direction)) << 32) | magnitude, static_cast<uint32_t>(s));
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<StarBucket> buckets(kStarBucketCount);
+    std::vector<CatalogStar> encoded(stars.size());
+    float faintest = kStarMinMagnitude;
+    size_t next = 0;
+    for (int b = 0; b < kStarBucketCount; ++b) {
+        StarBucket &bucket = buckets[b];
+        const int r = kStarBucketResolution;
+        const int face = b / (r * r), j = (b / r) % r, i = b % r;
+        const float u0 = 2.0f * i / r - 1.0f, v0 = 2.0f * j / r - 1.0f, u1 = u0 + 2.0f / r, v1 = v0 + 2.0f / r;
+        const glm::vec3 axis = cubeFaceDirection(face, 0.5f * (u0 + u1), 0.5f * (v0 + v1));
+        const glm::vec3 corners[] = { cubeFaceDirection(face, u0, v0), cubeFaceDirection(face, u1, v0),
+                                      cubeFaceDirection(face, u0, v1), cubeFaceDirection(face, u1, v1) };
+        float minCos = 1.0f;
+        for (int c = 0; c < 4; ++c)
+            minCos = std::min(minCos, glm::dot(axis, corners[c]));
+        std::memcpy(bucket.axis, glm::value_ptr(axis), sizeof(bucket.axis));
+        bucket.sinRadius = std::sqrt(std::max(0.0f, 1.0f - minCos * minCos));
+        bucket.first = static_cast<uint32_t>(next);
+
+        int step = 0;
+        for (; next < order.size() && (order[next].first >> 32) == static_cast<uint64_t>(b); ++next) {
+            const StarRecord &star = stars[order[next].second];
+            while (star.magnitude >= kStarMinMagnitude + (step + 1) * kStarMagnitudeStep)
+                bucket.brighterThan[step++] = static_cast<uint32_t>(next - bucket.first);
+            CatalogStar &out = encoded[next];
+            encodeOctahedral(star.direction, out.direction);
+            out.magnitude = static_cast<int16_t>(std::floor(star.magnitude * 100.0f + 0.5f));
+            const float color = (star.colorIndex - kMinColorIndex) / (kMaxColorIndex - kMinColorIndex);
+            out.colorIndex = static_cast<uint8_t>(glm::clamp(color, 0.0f, 1.0f) * 255.0f + 0.5f);
+            out.padding = 0;
+            faintest = std::max(faintest, star.magnitude);
+        }
+        for (; step < kStarMagnitudeSteps; ++step)
+            bucket.brighterThan[step] = static_cast<uint32_t>(next - bucket.first);
+    }
+
+    StarCatalogHeader header;
+    std::memcpy(header.magic, "STAR", 4);
+    header.version = kStarCatalogVersion;
+    header.starCount = static_cast<uint32_t>(stars.size());
+    header.bucketCount = kStarBucketCount;
+    header.faintestMagnitude = faintest;
+    std::ofstream out(filename.c_str(), std::ios::binary);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(buckets.data()), buckets.size() * sizeof(StarBucket));
+    out.write(reinterpret_cast<const char *>(encoded.data()), encoded.size() * sizeof(CatalogStar));
+    if (!out.good()) {
+        std::cerr << "ERROR: could not write " << filename << std::endl;
+        return false;
+    }
+    std::cout << "Wrote " << stars.size() << " stars down to magnitude " << faintest << " into " << filename
+              << std::endl;
+    return true;
+}
+
+// Synthetic sky with the counts of the real one: about 9000 stars brighter than
+// magnitude 6.5 and 10^0.45 times more per magnitude, the fainter ones crowding
+// a galactic plane tilted by 60 degrees to the ecliptic (the XZ plane)
+void generateStarCatalog(size_t count, unsigned int seed, std::vector<StarRecord> &stars) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::normal_distribution<float> colorIndex(0.65f, 0.35f);
+    const float faintest = 6.5f + std::log10(count / 9000.0f) / 0.45f;
+    const glm::mat3 galactic(glm::rotate(glm::mat4(1.0f), glm::radians(60.0f), glm::vec3(1.0f, 0.0f, 0.0f)));
+
+    stars.resize(count);
+    for (size_t s = 0; s < count; ++s) {
+        StarRecord &star = stars[s];
+        star.magnitude = std::max(faintest + std::log10(std::max(unit(rng), 1.0e-9f)) / 0.45f, -1.5f);
+        // Galactic latitude: uniform over the sphere, or squeezed into the disk
+        float z = 2.0f * unit(rng) - 1.0f;
+        const float diskShare = glm::clamp((star.magnitude - 2.0f) / 10.0f, 0.1f, 0.7f);
+        if (unit(rng) < diskShare)
+            z *= 0.12f;
+        const float phi = 2.0f * PI * unit(rng);
+        const float r = std::sqrt(1.0f - z * z);
+        star.direction = galactic * glm::vec3(r * std::cos(phi), z, r * std::sin(phi));
+        star.colorIndex = glm::clamp(colorIndex(rng), -0.3f, 1.9f);
+    }
+}
+
+// Read a real catalog from a CSV file with a header naming at least the columns
+// ra (hours), dec (degrees), mag and ci (B-V), such as the HYG database
+bool importStarCatalog(const std::string &csvFilename, std::vector<StarRecord> &stars) {
+    std::ifstream in(csvFilename.c_str());
+    std::string line;
+    if (!in.is_open() || !std::getline(in, line)) {
+        std::cerr << "ERROR: could not read " << csvFilename << std::endl;
+        return false;
+    }
+    auto split = [](const std::string &text, std::vector<std::string> &fields) {
+        fields.clear();
+        std::stringstream stream(text);
+        std::string field;
+        while (std::getline(stream, field, ','))
+            fields.push_back(field.size() >= 2 && field[0] == '"' ? field.substr(1, field.size() - 2) : field);
+    };
+    std::vector<std::string> fields;
+    split(line, fields);
+    int ra = -1, dec = -1, mag = -1, ci = -1;
+    for (size_t f = 0; f < fields.size(); ++f) {
+        const int column = static_cast<int>(f);
+        ra = fields[f] == "ra" ? column : ra;
+        dec = fields[f] == "dec" ? column : dec;
+        mag = fields[f] == "mag" ? column : mag;
+        ci = fields[f] == "ci" ? column : ci;
+    }
+    if (ra < 0 || dec < 0 || mag < 0) {
+        std::cerr << "ERROR: " << csvFilename << " lacks one of the columns ra, dec, mag" << std::endl;
+        return false;
+    }
+
+    // Equatorial to ecliptic coordinates, then ecliptic north to the scene's +Y
+    const float obliquity = glm::radians(23.44f);
+    const int lastColumn = std::max(std::max(ra, dec), std::max(mag, ci));
+    stars.clear();
+    while (std::getline(in, line)) {
+        split(line, fields);
+        if (static_cast<int>(fields.size()) <= lastColumn)
+            continue;
+        StarRecord star;
+        star.magnitude = static_cast<float>(std::atof(fields[mag].c_str()));
+        if (star.magnitude < kStarMinMagnitude)
+            continue; // The Sun
+        const float alpha = glm::radians(15.0f * static_cast<float>(std::atof(fields[ra].c_str())));
+        const float delta = glm::radians(static_cast<float>(std::atof(fields[dec].c_str())));
+        const glm::vec3 equatorial(std::cos(delta) * std::cos(alpha), std::cos(delta) * std::sin(alpha), std::sin(delta));
+        const glm::vec3 ecliptic(equatorial.x, equatorial.y * std::cos(obliquity) + equatorial.z * std::sin(obliquity),
+                                 -equatorial.y * std::sin(obliquity) + equatorial.z * std::cos(obliquity));
+        star.direction = glm::vec3(ecliptic.x, ecliptic.z, -ecliptic.y);
+        star.colorIndex = ci >= 0 && !fields[ci].empty() ? static_cast<float>(std::atof(fields[ci].c_str())) : 0.65f;
+        stars.push_back(star);
+    }
+    return true;
+}
+
+// Faintest magnitude drawn at a 45 degree field of view (--star-magnitude)
+float g_starMagnitudeLimit = 6.5f;
+const float kMaxStarPointSize = 6.0f; // Pixels across of the brightest stars
+
+class StarField {
+public:
+    StarField() : m_vao(0), m_buffer(0), m_header(nullptr), m_buckets(nullptr), m_drawnStars(0) {}
+
+    // Read and check the catalog; runs on a worker. False if there is none.
+    bool load(const std::string &filename) {
+        if (!readAsset(filename, m_asset)) {
+            std::cerr << "Warning: no star catalog (" << filename << "), the sky stays black" << std::endl;
+            return false;
+        }
+        const StarCatalogHeader *header = reinterpret_cast<const StarCatalogHeader *>(m_asset.data);
+        const size_t starsOffset = sizeof(StarCatalogHeader) + kStarBucketCount * sizeof(StarBucket);
+        if (m_asset.size < starsOffset || std::memcmp(header->magic, "STAR", 4) != 0 ||
+            header->version != kStarCatalogVersion || header->bucketCount != kStarBucketCount ||
+            m_asset.size < starsOffset + header->starCount * sizeof(CatalogStar) ||
+            !bucketsValid(reinterpret_cast<const StarBucket *>(m_asset.data + sizeof(StarCatalogHeader)),
+                          header->starCount)) {
+            std::cerr << "ERROR: " << filename << " is not a valid star catalog" << std::endl;
+            m_asset = AssetData();
+            return false;
+        }
+        m_header = header;
+        m_buckets = reinterpret_cast<const StarBucket *>(m_asset.data + sizeof(StarCatalogHeader));
+        return true;
+    }
+
+    // Upload the stars as one vertex buffer; runs on the GL thread
+    void init() {
+        if (!m_header)
+            return;
+        const size_t bytes = m_header->starCount * sizeof(CatalogStar);
+        glGenVertexArrays(1, &m_vao);
+        g_gl.bindVertexArray(m_vao);
+        glGenBuffers(1, &m_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+        glBufferData(GL_ARRAY_BUFFER, bytes, m_buckets + kStarBucketCount, GL_STATIC_DRAW);
+        g_gl.countUpload(bytes);
+        glVertexAttribPointer(0, 2, GL_SHORT, GL_TRUE, sizeof(CatalogStar), (void *)offsetof(CatalogStar, direction));
+        glVertexAttribPointer(1, 1, GL_SHORT, GL_FALSE, sizeof(CatalogStar), (void *)offsetof(CatalogStar, magnitude));
+        glVertexAttribPointer(2, 1, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(CatalogStar),
+                              (void *)offsetof(CatalogStar, colorIndex));
+        for (GLuint a = 0; a < 3; ++a)
+            glEnableVertexAttribArray(a);
+        g_gl.bindVertexArray(0);
+        std::cout << "Star catalog: " << m_header->starCount << " stars down to magnitude "
+                  << m_header->faintestMagnitude << std::endl;
+    }
+
+    void destroy() {
+        g_gl.forgetVertexArray(m_vao);
+        glDeleteVertexArrays(1, &m_vao);
+        glDeleteBuffers(1, &m_buffer);
+        m_vao = m_buffer = 0;
+        m_header = nullptr;
+        m_buckets = nullptr;
+        m_asset = AssetData();
+    }
+
+    // Faintest magnitude drawn at a field of view: zooming in by a factor z spreads
+    // the stars over z^2 times the pixels, which reveals 5 log10(z) magnitudes more
+    float limitingMagnitude(float fovDegrees) const {
+        const float zoom = std::tan(glm::radians(22.5f)) / std::tan(glm::radians(fovDegrees) * 0.5f);
+        const float limit = g_starMagnitudeLimit + 5.0f * std::log10(zoom);
+        return m_header ? std::min(limit, m_header->faintestMagnitude) : limit;
+    }
+
+    // Draw, in one call, the stars of the buckets in view down to the limiting
+    // magnitude. viewProjection has no translation: the stars are at infinity.
+    void draw(const glm::mat4 &viewProjection, float limit) {
+        m_drawnStars = 0;
+        if (!m_header)
+            return;
+        // Side planes of the frustum, through the eye
+        const glm::mat4 m = glm::transpose(viewProjection);
+        glm::vec3 planes[4] = { glm::vec3(m[3] + m[0]), glm::vec3(m[3] - m[0]), glm::vec3(m[3] + m[1]),
+                                glm::vec3(m[3] - m[1]) };
+        for (int p = 0; p < 4; ++p)
+            planes[p] = glm::normalize(planes[p]);
+
+        const int step = glm::clamp(static_cast<int>(std::ceil((limit - kStarMinMagnitude) / kStarMagnitudeStep)) - 1,
+                                    0, kStarMagnitudeSteps - 1);
+        GLint *firsts = g_frameArena.allocateArray<GLint>(kStarBucketCount);
+        GLsizei *counts = g_frameArena.allocateArray<GLsizei>(kStarBucketCount);
+        GLsizei drawCount = 0;
+        for (int b = 0; b < kStarBucketCount; ++b) {
+            const StarBucket &bucket = m_buckets[b];
+            const glm::vec3 axis(bucket.axis[0], bucket.axis[1], bucket.axis[2]);
+            bool visible = bucket.brighterThan[step] > 0;
+            for (int p = 0; p < 4 && visible; ++p)
+                visible = glm::dot(planes[p], axis) > -bucket.sinRadius;
+            if (!visible)
+                continue;
+            firsts[drawCount] = static_cast<GLint>(bucket.first);
+            counts[drawCount++] = static_cast<GLsizei>(bucket.brighterThan[step]);
+            m_drawnStars += bucket.brighterThan[step];
+        }
+        g_gl.bindVertexArray(m_vao);
+        g_gl.multiDrawArrays(GL_POINTS, firsts, counts, drawCount);
+    }
+
+    size_t getGpuBytes() const { return m_header ? m_header->starCount * sizeof(CatalogStar) : 0; }
+    size_t getCpuBytes() const { return m_asset.buffer.size(); } // 0 when mapped from the archive
+    uint32_t getStarCount() const { return m_header ? m_header->starCount : 0; }
+    const CatalogStar *getStars() const {
+        return m_header ? reinterpret_cast<const CatalogStar *>(m_buckets + kStarBucketCount) : nullptr;
+    }
+
+    // FNV-1a over the whole catalog: header, bucket table and star records, so that
+    // any edit to the stars (a position, a color) gives another hash
+    uint64_t contentHash() const {
+        uint64_t hash = 14695981039346656037ull;
+        if (!m_header)
+            return hash;
+        const size_t bytes = sizeof(StarCatalogHeader) + kStarBucketCount * sizeof(StarBucket) +
+                             m_header->starCount * sizeof(CatalogStar);
+        for (size_t i = 0; i < bytes; ++i)
+            hash = (hash ^ m_asset.data[i]) * 1099511628211ull;
+        return hash;
+    }
+    unsigned int getDrawnStars() const { return m_drawnStars; }
+
+private:
+    // Whether every bucket's ranges stay within the starCount stars: the draw
+    // hands them to the GPU as is
+    static bool bucketsValid(const StarBucket *buckets, uint32_t starCount) {
+        for (int b = 0; b < kStarBucketCount; ++b) {
+            const StarBucket &bucket = buckets[b];
+            if (bucket.first > starCount)
+                return false;
+            for (int i = 0; i < kStarMagnitudeSteps; ++i)
+                if (bucket.brighterThan[i] > starCount - bucket.first ||
+                    (i > 0 && bucket.brighterThan[i] < bucket.brighterThan[i - 1]))
+                    return false;
+        }
+        return true;
+    }
+
+    GLuint m_vao, m_buffer;
+    AssetData m_asset; // Keeps the catalog alive: the archive mapping, or the loose file read
+    const StarCatalogHeader *m_header;
+    const StarBucket *m_buckets;
+    unsigned int m_drawnStars;
+};
+
+StarField g_stars;
+
+//------------------------------------------------------------------------------
+// Environment lighting
+//------------------------------------------------------------------------------
+
+// Image-based ambient light from the sky, which is the star catalog. It is
+// reduced once to
+//   nine spherical-harmonic coefficients of its radiance, which the body shaders
+//   turn into irradiance at their normal with a few multiply-adds;
+//   a small cube map prefiltered for increasing roughness (32 texels across down
+//   to 1, Phong lobes of exponent 2 / roughness^4 - 2), for the specular part.
+// The stars' flux follows their magnitude and color. The result is scaled so that
+// the sky's mean radiance is kEnvironmentAmbient, the constant ambient term the
+// body shaders had, which keeps the scene's exposure and gives that term the
+// direction and tint of the sky (the galactic band). Without a catalog the sky is
+// uniform at that radiance, as before. Results are cached per catalog on disk.
+
+const int kEnvironmentSize = 32;   // Texels across a face of the sharpest level
+const int kEnvironmentLevels = 6;  // 32 down to 1
+const float kEnvironmentAmbient = 0.5f;
+const size_t kEnvironmentStarBlock = 65536; // Stars per block of the parallel reduction
+const int kEnvironmentBatch = 16;           // Stars decoded together, so that the basis loops vectorize
+const uint32_t kEnvironmentCacheVersion = 1;
+
+// Direction through (u, v) in [-1, 1] of a cube map face, in GL's face order and orientation
+glm::vec3 glCubeMapDirection(int face, float u, float v) {
+    switch (face) {
+    case 0: return glm::normalize(glm::vec3(1.0f, -v, -u));
+    case 1: return glm::normalize(glm::vec3(-1.0f, -v, u));
+    case 2: return glm::normalize(glm::vec3(u, 1.0f, v));
+    case 3: return glm::normalize(glm::vec3(u, -1.0f, -v));
+    case 4: return glm::normalize(glm::vec3(u, -v, 1.0f));
+    default: return glm::normalize(glm::vec3(-u, -v, -1.0f));
+    }
+}
+
+// Texel of a direction in a GL cube map of size texels across: (face * size + row) * size + column
+int glCubeMapTexel(const glm::vec3 &d, int size) {
+    const glm::vec3 a = glm::abs(d);
+    int face;
+    float major, sc, tc;
+    if (a.x >= a.y && a.x >= a.z) {
+        face = d.x > 0.0f ? 0 : 1;
+        major = a.x;
+        sc = d.x > 0.0f ? -d.z : d.z;
+        tc = -d.y;
+    } else if (a.y >= a.z) {
+        face = d.y > 0.0f ? 2 : 3;
+        major = a.y;
+        sc = d.x;
+        tc = d.y > 0.0f ? d.z : -d.z;
+    } else {
+        face = d.z > 0.0f ? 4 : 5;
+        major = a.z;
+        sc = d.z > 0.0f ? d.x : -d.x;
+        tc = -d.y;
+    }
+    const int i = std::min(static_cast<int>((sc / major + 1.0f) * 0.5f * size), size - 1);
+    const int j = std::min(static_cast<int>((tc / major + 1.0f) * 0.5f * size), size - 1);
+    return (face * size + j) * size + i;
+}
+
+// Solid angle of texel (i, j) of a cube map face size texels across
+float cubeMapTexelSolidAngle(int i, int j, int size) {
+    auto area = [](float x, float y) { return std::atan2(x * y, std::sqrt(x * x + y * y + 1.0f)); };
+    const float u0 = 2.0f * i / size - 1.0f, u1 = 2.0f * (i + 1) / size - 1.0f;
+    const float v0 = 2.0f * j / size - 1.0f, v1 = 2.0f * (j + 1) / size - 1.0f;
+    return area(u0, v0) - area(u0, v1) - area(u1, v0) + area(u1, v1);
+}
+
+// Constants of the real spherical harmonics up to band 2, in the order of the
+// shaders' polynomials 1, y, z, x, xy, yz, 3z^2 - 1, xz, x^2 - y^2
+const float kShConstants[9] = { 0.282095f, 0.488603f, 0.488603f, 0.488603f, 1.092548f,
+                                1.092548f, 0.315392f, 1.092548f, 0.546274f };
+// Cosine convolution over pi per band (Ramamoorthi and Hanrahan): radiance to irradiance / pi
+const float kShIrradianceBands[9] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+
+class EnvironmentLighting {
+public:
+    EnvironmentLighting() : m_buildMs(0.0), m_cached(false) {
+        for (int k = 0; k < 9; ++k)
+            m_sh[k] = glm::vec3(k == 0 ? kEnvironmentAmbient : 0.0f);
+    }
+
+    // Reduce the catalog, or read the result cached for it; CPU only
+    void build(const StarField &stars) {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        const uint64_t key = cacheKey(stars);
+        char filename[64];
+        std::snprintf(filename, sizeof(filename), "environment-%016llx.env", static_cast<unsigned long long>(key));
+        m_cached = readCache(filename, key);
+        if (!m_cached) {
+            compute(stars);
+            writeCache(filename, key);
+        }
+        m_buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (m_cached)
+            std::printf("Environment lighting read from %s in %.1f ms (warm start)\n", filename, m_buildMs);
+        else
+            std::printf("Environment lighting reduced from %u stars in %.1f ms on %d threads (cold start), cached in %s\n",
+                        stars.getStarCount(), m_buildMs, g_jobs.getWorkerCount(), filename);
+    }
+
+    // Upload the prefiltered cube map; GL thread
+    void init() {
+        if (m_levels.empty())
+            return;
+        Texture texture = { 0, GL_TEXTURE_CUBE_MAP, kEnvironmentSize, kEnvironmentSize, 0 };
+        glGenTextures(1, &texture.id);
+        g_gl.bindTexture(0, GL_TEXTURE_CUBE_MAP, texture.id);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, kEnvironmentLevels - 1);
+        const uint16_t *texels = m_levels.data();
+        for (int level = 0; level < kEnvironmentLevels; ++level) {
+            const int size = kEnvironmentSize >> level;
+            for (int face = 0; face < 6; ++face) {
+                glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_RGBA16F, size, size, 0, GL_RGBA,
+                             GL_HALF_FLOAT, texels);
+                texels += 4 * size * size;
+            }
+        }
+        texture.gpuBytes = m_levels.size() * sizeof(uint16_t);
+        g_gl.countUpload(texture.gpuBytes);
+        g_gl.bindTexture(0, GL_TEXTURE_CUBE_MAP, 0);
+        g_gl.setEnabled(GL_TEXTURE_CUBE_MAP_SEAMLESS, true); // Filter across faces at the coarse levels
+        m_texture = g_textures.create(texture, "environment");
+        std::vector<uint16_t>().swap(m_levels);
+    }
+
+    void destroy() { g_textures.release(m_texture); }
+
+    void bind() const { g_gl.bindTexture(kEnvironmentTextureUnit, GL_TEXTURE_CUBE_MAP, textureId(m_texture)); }
+
+    // Coefficients of irradiance / pi for the shaders' polynomials (see kShConstants)
+    const glm::vec3 *getIrradianceSH() const { return m_sh; }
+    double getBuildMs() const { return m_buildMs; }
+
+private:
+    struct CacheHeader {
+        char magic[4]; // "ENVL"
+        uint32_t version;
+        uint64_t key;
+    };
+
+    static size_t levelTexels() {
+        size_t texels = 0;
+        for (int level = 0; level < kEnvironmentLevels; ++level)
+            texels += 6 * static_cast<size_t>(kEnvironmentSize >> level) * (kEnvironmentSize >> level);
+        return texels;
+    }
+
+    static uint64_t cacheKey(const StarField &stars) {
+        const uint64_t values[] = { stars.contentHash(), static_cast<uint64_t>(kEnvironmentSize),
+                                    static_cast<uint64_t>(kEnvironmentLevels), kEnvironmentCacheVersion };
+        uint64_t hash = 14695981039346656037ull;
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(values);
+        for (size_t i = 0; i < sizeof(values); ++i)
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        const unsigned char *ambient = reinterpret_cast<const unsigned char *>(&kEnvironmentAmbient);
+        for (size_t i = 0; i < sizeof(kEnvironmentAmbient); ++i)
+            hash = (hash ^ ambient[i]) * 1099511628211ull;
+        return hash;
+    }
+
+    bool readCache(const char *filename, uint64_t key) {
+        std::ifstream file(filename, std::ios::binary);
+        CacheHeader header;
+        if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) || std::memcmp(header.magic, "ENVL", 4) != 0 ||
+            header.version != kEnvironmentCacheVersion || header.key != key)
+            return false;
+        std::vector<uint16_t> levels(4 * levelTexels());
+        glm::vec3 sh[9];
+        if (!file.read(reinterpret_cast<char *>(sh), sizeof(sh)) ||
+            !file.read(reinterpret_cast<char *>(levels.data()), levels.size() * sizeof(uint16_t))) {
+            std::cerr << "Warning: environment cache " << filename << " is truncated, recomputing" << std::endl;
+            return false;
+        }
+        std::copy(sh, sh + 9, m_sh);
+        m_levels.swap(levels);
+        return true;
+    }
+
+    void writeCache(const char *filename, uint64_t key) const {
+        const CacheHeader header = { { 'E', 'N', 'V', 'L' }, kEnvironmentCacheVersion, key };
+        std::vector<FileChunk> chunks;
+        chunks.push_back(FileChunk{ &header, sizeof(header) });
+        chunks.push_back(FileChunk{ m_sh, sizeof(m_sh) });
+        chunks.push_back(FileChunk{ m_levels.data(), m_levels.size() * sizeof(uint16_t) });
+        if (!writeFileAtomically(filename, chunks))
+            std::cerr << "Warning: could not write the environment cache " << filename << std::endl;
+    }
+
+    void compute(const StarField &stars) {
+        const int size = kEnvironmentSize;
+        const size_t faceTexels = static_cast<size_t>(size) * size;
+        const CatalogStar *catalog = stars.getStars();
+        const size_t starCount = stars.getStarCount();
+
+        // Radiance projected on the harmonics and splatted into the sharpest level;
+        // one partial sum per block, added up in block order so that the result
+        // does not depend on the scheduling
+        const size_t blocks = (starCount + kEnvironmentStarBlock - 1) / kEnvironmentStarBlock;
+        std::vector<double> blockSh(blocks * 27, 0.0);
+        std::vector<glm::vec3> blockFlux(blocks * 6 * faceTexels, glm::vec3(0.0f));
+        g_jobs.parallelFor(0, blocks, 1, [&](size_t begin, size_t end) {
+            for (size_t b = begin; b < end; ++b) {
+                const size_t first = b * kEnvironmentStarBlock;
+                const size_t last = std::min(first + kEnvironmentStarBlock, starCount);
+                glm::vec3 *flux = &blockFlux[b * 6 * faceTexels];
+                for (size_t batch = first; batch < last; batch += kEnvironmentBatch) {
+                    const int n = static_cast<int>(std::min<size_t>(kEnvironmentBatch, last - batch));
+                    float x[kEnvironmentBatch] = {}, y[kEnvironmentBatch] = {}, z[kEnvironmentBatch] = {};
+                    float rgb[3][kEnvironmentBatch] = {};
+                    for (int j = 0; j < n; ++j) {
+                        const CatalogStar &star = catalog[batch + j];
+                        const glm::vec3 d = decodeOctahedral(star.direction);
+                        const float bv = kMinColorIndex + star.colorIndex / 255.0f * (kMaxColorIndex - kMinColorIndex);
+                        const glm::vec3 light = starColor(bv) * std::pow(10.0f, -0.004f * star.magnitude);
+                        x[j] = d.x;
+                        y[j] = d.y;
+                        z[j] = d.z;
+                        for (int c = 0; c < 3; ++c)
+                            rgb[c][j] = light[c];
+                        flux[glCubeMapTexel(d, size)] += light;
+                    }
+                    float basis[9][kEnvironmentBatch];
+                    for (int j = 0; j < kEnvironmentBatch; ++j) {
+                        basis[0][j] = kShConstants[0];
+                        basis[1][j] = kShConstants[1] * y[j];
+                        basis[2][j] = kShConstants[2] * z[j];
+                        basis[3][j] = kShConstants[3] * x[j];
+                        basis[4][j] = kShConstants[4] * x[j] * y[j];
+                        basis[5][j] = kShConstants[5] * y[j] * z[j];
+                        basis[6][j] = kShConstants[6] * (3.0f * z[j] * z[j] - 1.0f);
+                        basis[7][j] = kShConstants[7] * x[j] * z[j];
+                        basis[8][j] = kShConstants[8] * (x[j] * x[j] - y[j] * y[j]);
+                    }
+                    for (int k = 0; k < 9; ++k) {
+                        for (int c = 0; c < 3; ++c) {
+                            float sum = 0.0f;
+                            for (int j = 0; j < kEnvironmentBatch; ++j)
+                                sum += basis[k][j] * rgb[c][j];
+                            blockSh[b * 27 + k * 3 + c] += sum;
+                        }
+                    }
+                }
+            }
+        });
+        double shSums[27] = { 0.0 };
+        std::vector<glm::vec3> radiance(6 * faceTexels, glm::vec3(0.0f));
+        for (size_t b = 0; b < blocks; ++b) {
+            for (int i = 0; i < 27; ++i)
+                shSums[i] += blockSh[b * 27 + i];
+            for (size_t t = 0; t < radiance.size(); ++t)
+                radiance[t] += blockFlux[b * 6 * faceTexels + t];
+        }
+
+        // Texel directions and solid angles; flux over solid angle is radiance
+        std::vector<glm::vec3> directions(6 * faceTexels);
+        std::vector<float> solidAngles(6 * faceTexels);
+        for (int face = 0; face < 6; ++face) {
+            for (int j = 0; j < size; ++j) {
+                for (int i = 0; i < size; ++i) {
+                    const size_t t = (face * size + j) * size + i;
+                    directions[t] = glCubeMapDirection(face, (2.0f * i + 1.0f) / size - 1.0f, (2.0f * j + 1.0f) / size - 1.0f);
+                    solidAngles[t] = cubeMapTexelSolidAngle(i, j, size);
+                    radiance[t] /= solidAngles[t];
+                }
+            }
+        }
+
+        // Scale to the mean radiance kEnvironmentAmbient (that of Y00's coefficient)
+        const glm::vec3 mean(shSums[0] * kShConstants[0], shSums[1] * kShConstants[0], shSums[2] * kShConstants[0]);
+        const float luminance = glm::dot(mean, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+        if (luminance > 0.0f) {
+            const float scale = kEnvironmentAmbient / luminance;
+            for (int k = 0; k < 9; ++k)
+                m_sh[k] = glm::vec3(shSums[k * 3], shSums[k * 3 + 1], shSums[k * 3 + 2]) * scale *
+                          kShIrradianceBands[k] * kShConstants[k];
+            for (size_t t = 0; t < radiance.size(); ++t)
+                radiance[t] *= scale;
+        } else {
+            std::fill(radiance.begin(), radiance.end(), glm::vec3(kEnvironmentAmbient)); // No catalog: uniform sky
+        }
+
+        // Prefiltered levels, each a weighted average of the sharpest one over a
+        // Phong lobe; texels beyond the lobe's 1e-4 cutoff are skipped
+        m_levels.resize(4 * levelTexels());
+        size_t offset = 0;
+        for (int level = 0; level < kEnvironmentLevels; ++level) {
+            const int levelSize = size >> level;
+            const size_t texels = 6 * static_cast<size_t>(levelSize) * levelSize;
+            uint16_t *out = &m_levels[4 * offset];
+            const float roughness = static_cast<float>(level) / (kEnvironmentLevels - 1);
+            const float exponent = level > 0 ? 2.0f / std::pow(roughness, 4.0f) - 2.0f : 0.0f;
+            const float cutoff = exponent > 0.0f ? std::pow(1.0e-4f, 1.0f / exponent) : 0.0f;
+            g_jobs.parallelFor(0, texels, 16, [&](size_t begin, size_t end) {
+                for (size_t t = begin; t < end; ++t) {
+                    glm::vec3 value;
+                    if (level == 0) {
+                        value = radiance[t];
+                    } else {
+                        const int face = static_cast<int>(t / (levelSize * levelSize));
+                        const int j = static_cast<int>(t / levelSize % levelSize), i = static_cast<int>(t % levelSize);
+                        const glm::vec3 axis = glCubeMapDirection(face, (2.0f * i + 1.0f) / levelSize - 1.0f,
+                                                                  (2.0f * j + 1.0f) / levelSize - 1.0f);
+                        glm::vec3 sum(0.0f);
+                        float weights = 0.0f;
+                        for (size_t s = 0; s < directions.size(); ++s) {
+                            const float cosine = glm::dot(axis, directions[s]);
+                            if (cosine <= cutoff)
+                                continue;
+                            const float weight = solidAngles[s] * std::pow(cosine, exponent);
+                            sum += weight * radiance[s];
+                            weights += weight;
+                        }
+                        value = weights > 0.0f ? sum / weights : glm::vec3(0.0f);
+                    }
+                    for (int c = 0; c < 3; ++c)
+                        out[4 * t + c] = glm::packHalf1x16(value[c]);
+                    out[4 * t + 3] = glm::packHalf1x16(1.0f);
+                }
+            });
+            offset += texels;
+        }
+    }
+
+    glm::vec3 m_sh[9];
+    std::vector<uint16_t> m_levels; // RGBA half floats, level by level and face by face, until uploaded
+    TextureHandle m_texture;
+    double m_buildMs;
+    bool m_cached;
+};
+
+EnvironmentLighting g_environment;
+
+//------------------------------------------------------------------------------
+// Texture residency
+//------------------------------------------------------------------------------
+
+// Video memory budget for textures and meshes. While it is exceeded, body
+// textures are downscaled, the most oversampled on screen first, down to a
+// single texel (evicted). Textures come back from disk once there is room.
+size_t g_vramBudgetBytes = static_cast<size_t>(1024) << 20;
+
+// Frames a new residency target must persist before it is applied, so that a
+// body crossing a threshold does not make its texture bounce between levels
+const int kResidencyDelayFrames = 30;
+
+// A body texture array under residency control; its layers move together. Level
+// L is the files' images downscaled 2^L times, with their mip chain; maxLevel is
+// the 1x1 (evicted) level.
+struct ResidentTexture {
+    TextureHandle handle;
+    std::string name;
+    std::vector<std::string> filenames; // One per layer
+    int fullWidth, fullHeight, numComponents;
+    int maxLevel;
+    int level;         // Resident level
+    int targetLevel;   // Level the budget currently asks for
+    int pendingFrames; // Consecutive frames targetLevel differed from level
+    float screenTexels; // Texels needed across the largest on-screen use, this frame
+    // Reload from disk running on the job system
+    JobSystem::Job *loadJob;
+    std::vector<DecodedImage> loaded;
+    int loadLevel;
+};
+
+// Filled once by initTextures(); jobs keep pointers to its elements
+std::vector<ResidentTexture> g_residentTextures;
+
+inline size_t residentBytes(const ResidentTexture &texture, int level) {
+    return texture.filenames.size() *
+           textureBytes(std::max(texture.fullWidth >> level, 1), std::max(texture.fullHeight >> level, 1), true);
+}
+
+void manageResidency(TextureHandle handle, const std::string &name, const std::vector<const DecodedImage *> &layers) {
+    if (!handle.isValid())
+        return;
+    const DecodedImage &image = *layers[0];
+    ResidentTexture texture;
+    texture.handle = handle;
+    texture.name = name;
+    for (size_t l = 0; l < layers.size(); ++l)
+        texture.filenames.push_back(layers[l]->filename);
+    texture.fullWidth = image.width;
+    texture.fullHeight = image.height;
+    texture.numComponents = image.numComponents;
+    texture.maxLevel = 0;
+    while ((std::max(image.width, image.height) >> texture.maxLevel) > 1)
+        ++texture.maxLevel;
+    texture.level = texture.targetLevel = 0;
+    texture.pendingFrames = 0;
+    texture.screenTexels = 0.0f;
+    texture.loadJob = nullptr;
+    texture.loadLevel = 0;
+    g_residentTextures.push_back(texture);
+}
+
+// Halve an image in place with a 2x2 box filter
+void halveImage(DecodedImage &image) {
+    const int n = image.numComponents;
+    const int width = std::max(image.width / 2, 1), height = std::max(image.height / 2, 1);
+    for (int y = 0; y < height; ++y) {
+        const int y0 = std::min(2 * y, image.height - 1), y1 = std::min(2 * y + 1, image.height - 1);
+        for (int x = 0; x < width; ++x) {
+            const int x0 = std::min(2 * x, image.width - 1), x1 = std::min(2 * x + 1, image.width - 1);
+            int sums[4] = { 0, 0, 0, 0 };
+            for (int c = 0; c < n; ++c)
+                sums[c] = image.data[(y0 * image.width + x0) * n + c] + image.data[(y0 * image.width + x1) * n + c] +
+                          image.data[(y1 * image.width + x0) * n + c] + image.data[(y1 * image.width + x1) * n + c];
+            // Never ahead of the samples still to be read
+            for (int c = 0; c < n; ++c)
+                image.data[(y * width + x) * n + c] = static_cast<unsigned char>((sums[c] + 2) / 4);
+        }
+    }
+    image.width = width;
+    image.height = height;
+}
+
+// Job: decode a resident texture's files and downscale them to its loadLevel
+void loadResidentTextureJob(JobSystem::Job &job) {
+    ResidentTexture &texture = *static_cast<ResidentTexture *>(const_cast<void *>(job.data));
+    texture.loaded.resize(texture.filenames.size());
+    for (size_t l = 0; l < texture.filenames.size(); ++l) {
+        DecodedImage &image = texture.loaded[l];
+        decodeImage(texture.filenames[l], image);
+        for (int i = 0; image.data && i < texture.loadLevel; ++i)
+            halveImage(image);
+    }
+}
+
+// Move a resident texture to a coarser level using the mip already on the GPU:
+// blitted layer by layer into new storage of that size, which then replaces the
+// texture, so nothing goes through the CPU or waits for the GPU
+void downscaleResidentTexture(ResidentTexture &resident, int level) {
+    Texture *texture = g_textures.get(resident.handle);
+    const int mip = level - resident.level;
+    const int width = std::max(texture->width >> mip, 1), height = std::max(texture->height >> mip, 1);
+    const GLsizei layerCount = static_cast<GLsizei>(resident.filenames.size());
+    const GLenum format = formatFromComponents(resident.numComponents);
+
+    GLuint downscaled = 0;
+    glGenTextures(1, &downscaled);
+    g_gl.bindTexture(0, GL_TEXTURE_2D_ARRAY, downscaled);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, format, width, height, layerCount, 0, format, GL_UNSIGNED_BYTE, nullptr);
+
+    // Read from the first framebuffer, draw into the second
+    GLuint framebuffers[2];
+    glGenFramebuffers(2, framebuffers);
+    g_gl.bindFramebuffer(framebuffers[0]);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffers[1]);
+    for (GLint l = 0; l < layerCount; ++l) {
+        glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture->id, mip, l);
+        glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, downscaled, 0, l);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    }
+    g_gl.bindFramebuffer(0); // Both targets
+    g_gl.forgetFramebuffer(framebuffers[0]);
+    glDeleteFramebuffers(2, framebuffers);
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+    g_gl.bindTexture(0, GL_TEXTURE_2D_ARRAY, 0);
+
+    destroyTexture(*texture);
+    texture->id = downscaled;
+    texture->width = width;
+    texture->height = height;
+    texture->gpuBytes = layerCount * textureBytes(width, height, true);
+    resident.level = level;
+}
+
+// Upload a finished reload (during a frame: the layer list is scratch memory)
+void finishResidentTextureLoad(ResidentTexture &resident) {
+    Texture *texture = g_textures.get(resident.handle);
+    ScratchScope scratch;
+    const DecodedImage **layers = scratch.arena().allocateArray<const DecodedImage *>(resident.loaded.size());
+    size_t layerCount = 0;
+    for (size_t l = 0; l < resident.loaded.size(); ++l) {
+        if (!resident.loaded[l].data)
+            std::cerr << "Error: could not reload texture " << resident.filenames[l] << std::endl;
+        else
+            layers[layerCount++] = &resident.loaded[l];
+    }
+    if (texture && layerCount == resident.filenames.size()) {
+        g_gl.bindTexture(0, GL_TEXTURE_2D_ARRAY, texture->id);
+        specifyTextureArray(*texture, layers, layerCount);
+        g_gl.bindTexture(0, GL_TEXTURE_2D_ARRAY, 0);
+        resident.level = resident.loadLevel;
+    }
+    for (size_t l = 0; l < resident.loaded.size(); ++l)
+        stbi_image_free(resident.loaded[l].data);
+    resident.loaded.clear();
+    resident.loadJob = nullptr;
+}
+
+// Video memory of the pools (textures and meshes)
+size_t trackedGpuBytes() {
+    size_t bytes = 0;
+    for (size_t i = 0; i < g_textures.size(); ++i)
+        bytes += g_textures.at(i).gpuBytes;
+    // Meshes are ranges of the arena
+    return bytes + g_geometry.getGpuBytes() + g_stream.getGpuBytes() + g_stars.getGpuBytes();
+}
+
+// Once per frame, after culling: measure how large each resident texture is on
+// screen, pick the levels that fit the budget and move textures towards them
+void updateTextureResidency() {
+    for (size_t t = 0; t < g_residentTextures.size(); ++t) {
+        ResidentTexture &resident = g_residentTextures[t];
+        if (resident.loadJob && g_jobs.isDone(resident.loadJob))
+            finishResidentTextureLoad(resident);
+        resident.screenTexels = 0.0f;
+    }
+
+    // Resident texture of each material slot, -1 if none
+    int materialResidency[kMaterialSlots];
+    for (int m = 0; m < kMaterialSlots; ++m) {
+        materialResidency[m] = -1;
+        for (size_t t = 0; t < g_residentTextures.size() && g_materialTable[m].array >= 0; ++t)
+            if (g_residentTextures[t].handle == g_textureArrays[g_materialTable[m].array])
+                materialResidency[m] = static_cast<int>(t);
+    }
+
+    // The u coordinate wraps around the body: pi texels per pixel of diameter
+    // keep the texture at least as sharp as the screen at the silhouette's middle
+    const glm::vec3 cameraPos = g_camera.getPosition();
+    const float pixelsPerUnit = g_windowHeight * g_resolutionScale / (2.0f * std::tan(glm::radians(g_camera.getFov()) * 0.5f));
+    for (size_t i = 0; i < g_bodies.size(); ++i) {
+        if (!g_bodyVisible[i])
+            continue;
+        const glm::mat4 &world = g_bodyWorldMats[i];
+        const float radius = glm::length(glm::vec3(world[0]));
+        const float distance = std::max(glm::length(glm::vec3(world[3]) - cameraPos), radius);
+        const float diameterPixels = 2.0f * radius * pixelsPerUnit / distance;
+        const int t = materialResidency[g_bodies[i].material];
+        if (t >= 0)
+            g_residentTextures[t].screenTexels = std::max(g_residentTextures[t].screenTexels, PI * diameterPixels);
+    }
+
+    // Start from full resolution and coarsen the most oversampled texture until
+    // the whole fits (unseen textures have no use for texels and go first)
+    size_t total = trackedGpuBytes();
+    for (size_t t = 0; t < g_residentTextures.size(); ++t) {
+        ResidentTexture &resident = g_residentTextures[t];
+        total += residentBytes(resident, 0) - residentBytes(resident, resident.level);
+        resident.targetLevel = 0;
+    }
+    while (total > g_vramBudgetBytes) {
+        int worst = -1;
+        float worstRatio = 0.0f;
+        for (size_t t = 0; t < g_residentTextures.size(); ++t) {
+            const ResidentTexture &resident = g_residentTextures[t];
+            if (resident.targetLevel == resident.maxLevel)
+                continue;
+            const float ratio = resident.screenTexels / std::max(resident.fullWidth >> resident.targetLevel, 1);
+            if (worst < 0 || ratio < worstRatio) {
+                worst = static_cast<int>(t);
+                worstRatio = ratio;
+            }
+        }
+        if (worst < 0)
+            break; // Everything is evicted: the rest of the budget is not ours to free
+        ResidentTexture &resident = g_residentTextures[worst];
+        total -= residentBytes(resident, resident.targetLevel) - residentBytes(resident, resident.targetLevel + 1);
+        ++resident.targetLevel;
+    }
+
+    for (size_t t = 0; t < g_residentTextures.size(); ++t) {
+        ResidentTexture &resident = g_residentTextures[t];
+        if (resident.targetLevel == resident.level || resident.loadJob) {
+            resident.pendingFrames = 0;
+            continue;
+        }
+        if (++resident.pendingFrames < kResidencyDelayFrames)
+            continue;
+        resident.pendingFrames = 0;
+        if (resident.targetLevel > resident.level) {
+            downscaleResidentTexture(resident, resident.targetLevel);
+        } else {
+            resident.loadLevel = resident.targetLevel;
+            resident.loadJob = g_jobs.createDetachedJob(loadResidentTextureJob, &resident);
+            g_jobs.runDetached(resident.loadJob);
+        }
+    }
+}
+
+// Whether the residency targets still differ from what is resident, in which
+// case frames must keep coming for the manager to converge
+bool isTextureResidencyPending() {
+    for (size_t t = 0; t < g_residentTextures.size(); ++t)
+        if (g_residentTextures[t].loadJob || g_residentTextures[t].pendingFrames > 0)
+            return true;
+    return false;
+}
+
+// Wait for the reloads in flight and drop their images
+void shutdownTextureResidency() {
+    for (size_t t = 0; t < g_residentTextures.size(); ++t) {
+        ResidentTexture &resident = g_residentTextures[t];
+        if (resident.loadJob)
+            g_jobs.wait(resident.loadJob);
+        for (size_t l = 0; l < resident.loaded.size(); ++l)
+            stbi_image_free(resident.loaded[l].data);
+    }
+    g_residentTextures.clear();
+}
+
+// Memory use by category, then per resource, on stdout
+void printMemoryReport() {
+    const double MB = 1024.0 * 1024.0;
+    size_t residentGpu = 0, otherTextureGpu = 0, meshGpu = 0, meshCpu = 0, stagingCpu = 0;
+    for (size_t i = 0; i < g_textures.size(); ++i)
+        otherTextureGpu += g_textures.at(i).gpuBytes;
+    for (size_t t = 0; t < g_residentTextures.size(); ++t) {
+        const Texture *texture = g_textures.get(g_residentTextures[t].handle);
+        residentGpu += texture ? texture->gpuBytes : 0;
+        for (size_t l = 0; l < g_residentTextures[t].loaded.size(); ++l) {
+            const DecodedImage &image = g_residentTextures[t].loaded[l];
+            if (image.data)
+                stagingCpu += static_cast<size_t>(image.width) * image.height * image.numComponents;
+        }
+    }
+    otherTextureGpu -= residentGpu;
+    meshGpu = g_geometry.getGpuBytes();
+    for (size_t i = 0; i < g_meshes.size(); ++i)
+        meshCpu += g_meshes.at(i).getCpuBytes();
+    const size_t sceneCpu = g_bodies.capacity() * sizeof(Body) + g_bodyWorldMats.capacity() * sizeof(glm::mat4) +
+                            g_bodyVisible.capacity();
+
+    std::printf("Memory report (MB)\n");
+    std::printf("  GPU  body textures   %8.2f  (%zu under residency control)\n", residentGpu / MB, g_residentTextures.size());
+    std::printf("  GPU  other textures  %8.2f\n", otherTextureGpu / MB);
+    std::printf("  GPU  geometry arena  %8.2f\n", meshGpu / MB);
+    std::printf("  GPU  stream ring     %8.2f\n", g_stream.getGpuBytes() / MB);
+    std::printf("  GPU  star catalog    %8.2f\n", g_stars.getGpuBytes() / MB);
+    std::printf("  GPU  total           %8.2f  of a %.2f budget\n", trackedGpuBytes() / MB, g_vramBudgetBytes / MB);
+    std::printf("  CPU  mesh data       %8.2f\n", meshCpu / MB);
+    std::printf("  CPU  texture staging %8.2f\n", stagingCpu / MB);
+    std::printf("  CPU  star catalog    %8.2f  (0 when mapped from the archive)\n", g_stars.getCpuBytes() / MB);
+    std::printf("  CPU  scene           %8.2f  (%zu bodies)\n", sceneCpu / MB, g_bodies.size());
+    std::printf("  CPU  frame arena     %8.2f  (high water %.2f)\n", g_frameArena.getCapacity() / MB,
+                g_frameArena.getHighWater() / MB);
+    for (size_t i = 0; i < g_textures.size(); ++i) {
+        const Texture &texture = g_textures.at(i);
+        std::printf("  texture %-34s %5dx%-5d %8.2f\n", g_textures.nameAt(i).c_str(), texture.width, texture.height,
+                    texture.gpuBytes / MB);
+    }
+    for (size_t t = 0; t < g_residentTextures.size(); ++t) {
+        const ResidentTexture &resident = g_residentTextures[t];
+        std::printf("  residency %-32s level %d/%d%s%s\n", resident.name.c_str(), resident.level, resident.maxLevel,
+                    resident.level == resident.maxLevel ? " (evicted)" : "", resident.loadJob ? " (reloading)" : "");
+    }
+    for (size_t i = 0; i < g_meshes.size(); ++i)
+        std::printf("  mesh %-37s GPU %8.2f CPU %8.2f\n", g_meshes.nameAt(i).c_str(), g_meshes.at(i).getGpuBytes() / MB,
+                    g_meshes.at(i).getCpuBytes() / MB);
+    std::fflush(stdout);
+}
+
+// Body textures, in the order initTextures() expects them decoded, and the
+// material table slot each one textures
+const std::vector<std::string> kBodyTextureFiles = {
+    "./media/earth2.jpg",
+    "./media/sun2.jpg",
+    "./media/moon.jpg",
+    "./media/saturn2.jpg"
+};
+const int kBodyTextureSlots[] = { MATERIAL_EARTH, MATERIAL_SUN, MATERIAL_MOON, MATERIAL_SATURN };
+
+// Pack the decoded body textures (see kBodyTextureFiles) into one array texture
+// per size and format, fill the material table and release the images; runs on
+// the GL thread
+void initTextures(std::vector<DecodedImage> &images) {
+    for (int m = 0; m < kMaterialSlots; ++m) {
+        g_materialTable[m].array = -1;
+        g_materialTable[m].layer = 0;
+    }
+
+    std::vector<std::vector<const DecodedImage *> > arrays;
+    for (size_t i = 0; i < images.size(); ++i) {
+        const DecodedImage &image = images[i];
+        if (image.data == nullptr) {
+            std::cerr << "Error: texture " << image.filename << " not found" << std::endl;
+            continue;
+        }
+        size_t a = 0;
+        while (a < arrays.size() && (arrays[a][0]->width != image.width || arrays[a][0]->height != image.height ||
+                                     arrays[a][0]->numComponents != image.numComponents))
+            ++a;
+        if (a == arrays.size())
+            arrays.push_back(std::vector<const DecodedImage *>());
+        g_materialTable[kBodyTextureSlots[i]].array = static_cast<int>(a);
+        g_materialTable[kBodyTextureSlots[i]].layer = static_cast<int>(arrays[a].size());
+        arrays[a].push_back(&image);
+    }
+
+    // Body textures may be downscaled or evicted to fit the VRAM budget
+    for (size_t a = 0; a < arrays.size(); ++a) {
+        char name[64];
+        std::snprintf(name, sizeof(name), "body array %dx%dx%d", arrays[a][0]->width, arrays[a][0]->height,
+                      static_cast<int>(arrays[a].size()));
+        g_textureArrays.push_back(uploadTextureArray(arrays[a], name));
+        manageResidency(g_textureArrays.back(), name, arrays[a]);
+    }
+    uploadMaterialTable();
+
+    for (size_t i = 0; i < images.size(); ++i) {
+        stbi_image_free(images[i].data);
+        images[i].data = nullptr;
+    }
+}
+
+// The rings are drawn from a radial profile rather than a texture wrapped around
+// an annulus: the color strip and the transparency strip (outer edge at x = 0),
+// averaged over their rows into one 1D texture, inner edge first, with the
+// opacity at normal incidence in alpha. The ring program samples it along the
+// eye rays, the body programs along the rays to the Sun (the rings' shadow).
+const std::vector<std::string> kRingProfileFiles = { "./media/saturn_ring.jpg", "./media/ring_transparency.gif" };
+TextureHandle g_ringProfile;
+
+// Build and upload the ring profile from the decoded kRingProfileFiles and release them
+void initRingProfile(std::vector<DecodedImage> &images) {
+    const DecodedImage &color = images[0];
+    const DecodedImage &opacity = images[1];
+    if (color.data == nullptr || opacity.data == nullptr || color.width != opacity.width) {
+        std::cerr << "Error: ring profile " << color.filename << " / " << opacity.filename
+                  << " not found or of different widths, rings disabled" << std::endl;
+    } else {
+        const int texels = color.width;
+        std::vector<unsigned char> profile(4 * static_cast<size_t>(texels));
+        for (int x = 0; x < texels; ++x) {
+            const int column = texels - 1 - x;
+            unsigned int sums[4] = { 0, 0, 0, 0 };
+            for (int y = 0; y < color.height; ++y)
+                for (int c = 0; c < 3; ++c)
+                    sums[c] += color.data[(y * color.width + column) * color.numComponents + std::min(c, color.numComponents - 1)];
+            for (int y = 0; y < opacity.height; ++y)
+                sums[3] += opacity.data[(y * opacity.width + column) * opacity.numComponents];
+            for (int c = 0; c < 4; ++c)
+                profile[4 * x + c] = static_cast<unsigned char>(sums[c] / (c < 3 ? color.height : opacity.height));
+        }
+
+        Texture texture = { 0, GL_TEXTURE_1D, texels, 1, textureBytes(texels, 1, true) };
+        glGenTextures(1, &texture.id);
+        g_gl.bindTexture(0, GL_TEXTURE_1D, texture.id);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA8, texels, 0, GL_RGBA, GL_UNSIGNED_BYTE, profile.data());
+        g_gl.countUpload(profile.size());
+        glGenerateMipmap(GL_TEXTURE_1D);
+        g_gl.bindTexture(0, GL_TEXTURE_1D, 0);
+        g_ringProfile = g_textures.create(texture, "ring profile");
+        std::cout << "Built the ring profile (" << texels << " texels) from " << color.filename << " and "
+                  << opacity.filename << std::endl;
+    }
+    for (size_t i = 0; i < images.size(); ++i) {
+        stbi_image_free(images[i].data);
+        images[i].data = nullptr;
+    }
+}
+
+// Whether the rings of ringed planets can be drawn
+inline bool ringsAvailable() { return g_meshes.get(g_ringMesh) && g_textures.get(g_ringProfile); }
+
+void openAssets() {
+    if (!g_assets.open("assets.pak"))
+        std::cout << "No asset archive (assets.pak), reading the loose files" << std::endl;
+}
+
+//------------------------------------------------------------------------------
+// Dynamic resolution
+//------------------------------------------------------------------------------
+
+// The scene is rendered into an offscreen HDR target at g_resolutionScale times
+// the window size, then bloomed, tone mapped and upscaled to the window with some
+// sharpening (renderFrame()). A feedback controller moves the scale every frame
+// towards the GPU time target; without a target the scale stays at 1. Whatever is drawn after the upscale (HUD) stays at
+// native resolution.
+const float kMinResolutionScale = 0.5f;
+const float kResolutionDeadband = 0.05f;   // Relative GPU time error tolerated as is
+const float kResolutionGain = 0.5f;        // Share of the correction applied per measurement
+const float kMaxSharpness = 0.6f;          // At the smallest scale; none at full scale
+const int kGpuTimerQueries = 4;            // Frames in flight before a timer query is read
+const int kBloomLevels = 5;                // Bloom pyramid, from 1/2 down to 1/32 of the scene
+
+// GPU passes of a frame, timed with a timestamp before and after each
+enum GpuPass {
+    GPU_PASS_SCENE, GPU_PASS_BLOOM_DOWN, GPU_PASS_BLOOM_UP, GPU_PASS_EXPOSURE, GPU_PASS_COMPOSITE, GPU_PASS_COUNT
+};
+
+struct RenderTarget {
+    GLuint framebuffer;
+    TextureHandle color; // RGBA16F: the Sun is brighter than 1
+    TextureHandle depth;
+    int width, height;   // Allocated size, the window's: scaling only changes the viewport
+    GLuint bloomFramebuffers[kBloomLevels];
+    TextureHandle bloom[kBloomLevels]; // R11F_G11F_B10F, each half the size of the one before
+    GLuint emptyVao;     // Full-screen triangles are generated from gl_VertexID
+    GLuint timerQueries[kGpuTimerQueries][GPU_PASS_COUNT + 1];
+    bool timerIssued[kGpuTimerQueries];
+    int frame;
+    double gpuMs;        // Last measured GPU time of the whole frame
+    double passMs[GPU_PASS_COUNT];
+};
+
+RenderTarget g_renderTarget;
+
+// Size of a bloom level for a scene of the given size
+inline glm::ivec2 bloomLevelSize(int width, int height, int level) {
+    return glm::ivec2(std::max(width >> (level + 1), 1), std::max(height >> (level + 1), 1));
+}
+
+// Filtered, edge-clamped 2D texture for an offscreen color attachment
+GLuint createColorAttachment(int width, int height, GLenum internalFormat, GLenum format, GLenum type) {
+    GLuint id;
+    glGenTextures(1, &id);
+    g_gl.bindTexture(0, GL_TEXTURE_2D, id);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return id;
+}
+
+// (Re)create the offscreen color, depth and bloom textures at the given size
+void resizeRenderTarget(int width, int height) {
+    RenderTarget &target = g_renderTarget;
+    g_textures.release(target.color);
+    g_textures.release(target.depth);
+    for (int level = 0; level < kBloomLevels; ++level)
+        g_textures.release(target.bloom[level]);
+
+    Texture color = { 0, GL_TEXTURE_2D, width, height, 2 * textureBytes(width, height, false) };
+    color.id = createColorAttachment(width, height, GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT);
+
+    Texture depth = { 0, GL_TEXTURE_2D, width, height, textureBytes(width, height, false) };
+    glGenTextures(1, &depth.id);
+    g_gl.bindTexture(0, GL_TEXTURE_2D, depth.id);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    g_gl.bindTexture(0, GL_TEXTURE_2D, 0);
+
+    g_gl.bindFramebuffer(target.framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color.id, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth.id, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cerr << "ERROR: offscreen render target is incomplete" << std::endl;
+    g_gl.bindFramebuffer(0);
+
+    target.color = g_textures.create(color, "render target color");
+    target.depth = g_textures.create(depth, "render target depth");
+    target.width = width;
+    target.height = height;
+
+    // Packed float bloom levels: half the bandwidth of RGBA16F, and bloom has no alpha
+    for (int level = 0; level < kBloomLevels; ++level) {
+        const glm::ivec2 size = bloomLevelSize(width, height, level);
+        Texture bloom = { 0, GL_TEXTURE_2D, size.x, size.y, textureBytes(size.x, size.y, false) };
+        bloom.id = createColorAttachment(size.x, size.y, GL_R11F_G11F_B10F, GL_RGB, GL_FLOAT);
+        g_gl.bindFramebuffer(target.bloomFramebuffers[level]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, bloom.id, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "ERROR: bloom level " << level << " is incomplete" << std::endl;
+        char name[32];
+        std::snprintf(name, sizeof(name), "bloom level %d", level + 1);
+        target.bloom[level] = g_textures.create(bloom, name);
+    }
+    g_gl.bindTexture(0, GL_TEXTURE_2D, 0);
+    g_gl.bindFramebuffer(0);
+}
+
+void initRenderTarget() {
+    RenderTarget &target = g_renderTarget;
+    target.width = target.height = 0;
+    target.frame = 0;
+    target.gpuMs = 0.0;
+    for (int pass = 0; pass < GPU_PASS_COUNT; ++pass)
+        target.passMs[pass] = 0.0;
+    glGenFramebuffers(1, &target.framebuffer);
+    glGenFramebuffers(kBloomLevels, target.bloomFramebuffers);
+    glGenVertexArrays(1, &target.emptyVao);
+    glGenQueries(kGpuTimerQueries * (GPU_PASS_COUNT + 1), &target.timerQueries[0][0]);
+    for (int i = 0; i < kGpuTimerQueries; ++i)
+        target.timerIssued[i] = false;
+    resizeRenderTarget(g_windowWidth, g_windowHeight);
+}
+
+void shutdownRenderTarget() {
+    RenderTarget &target = g_renderTarget;
+    if (target.width == 0)
+        return;
+    g_textures.release(target.color);
+    g_textures.release(target.depth);
+    g_gl.forgetFramebuffer(target.framebuffer);
+    g_gl.forgetVertexArray(target.emptyVao);
+    glDeleteFramebuffers(1, &target.framebuffer);
+    for (int level = 0; level < kBloomLevels; ++level) {
+        g_textures.release(target.bloom[level]);
+        g_gl.forgetFramebuffer(target.bloomFramebuffers[level]);
+    }
+    glDeleteFramebuffers(kBloomLevels, target.bloomFramebuffers);
+    glDeleteVertexArrays(1, &target.emptyVao);
+    glDeleteQueries(kGpuTimerQueries * (GPU_PASS_COUNT + 1), &target.timerQueries[0][0]);
+    target.width = target.height = 0;
+}
+
+// Read the oldest frame's timestamps if the GPU is done with them, and steer the
+// scale. Pixel cost goes with the square of the scale, hence the square root.
+void updateResolutionScale() {
+    RenderTarget &target = g_renderTarget;
+    const int oldest = (target.frame + 1) % kGpuTimerQueries;
+    if (!target.timerIssued[oldest])
+        return;
+    GLint available = 0;
+    glGetQueryObjectiv(target.timerQueries[oldest][GPU_PASS_COUNT], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+        return; // The last timestamp is written last
+    GLuint64 timestamps[GPU_PASS_COUNT + 1];
+    for (int i = 0; i <= GPU_PASS_COUNT; ++i)
+        glGetQueryObjectui64v(target.timerQueries[oldest][i], GL_QUERY_RESULT, &timestamps[i]);
+    target.timerIssued[oldest] = false;
+    for (int pass = 0; pass < GPU_PASS_COUNT; ++pass)
+        target.passMs[pass] = (timestamps[pass + 1] - timestamps[pass]) * 1e-6;
+    target.gpuMs = (timestamps[GPU_PASS_COUNT] - timestamps[0]) * 1e-6;
+
+    if (g_targetFrameMs <= 0.0f)
+        return; // No controller: the scale stays at 1
+    const float ratio = static_cast<float>(target.gpuMs) / g_targetFrameMs;
+    if (std::abs(ratio - 1.0f) <= kResolutionDeadband || target.gpuMs <= 0.0)
+        return;
+    const float desired = g_resolutionScale / std::sqrt(ratio);
+    g_resolutionScale = glm::clamp(g_resolutionScale + kResolutionGain * (desired - g_resolutionScale),
+                                   kMinResolutionScale, 1.0f);
+}
+
+//------------------------------------------------------------------------------
+// HDR, bloom and exposure
+//------------------------------------------------------------------------------
+
+// Into the HDR target the Sun is drawn at kSunEmissiveIntensity; what exceeds the
+// bloom threshold is blurred through a pyramid at reduced resolution (dual filter:
+// five taps per texel down, eight up, every level half the size of the one above)
+// and added back before tone mapping. The benchmarks, which draw straight to the
+// window, keep the Sun at kSunLdrIntensity.
+const float kSunEmissiveIntensity = 4.0f;
+const float kSunLdrIntensity = 0.8f;
+const float kBloomThreshold = 1.0f;
+const float kBloomKnee = 0.5f;
+float g_bloomStrength = 0.3f; // --bloom S, 0 skips the pyramid
+float g_exposure = 1.0f; // Scale before tone mapping: adapted every frame unless --exposure E
+
+// Uniforms of a full-screen pass reading the rendered part (size) of a texture
+// allocated at allocated, through upscaleVertexShader.glsl
+void setSourceUniforms(GLuint program, const glm::ivec2 &size, const glm::ivec2 &allocated) {
+    const glm::vec2 texel = 1.0f / glm::vec2(allocated);
+    g_gl.uniform2f(glGetUniformLocation(program, "uvScale"), size.x * texel.x, size.y * texel.y);
+    g_gl.uniform2f(glGetUniformLocation(program, "texelSize"), texel.x, texel.y);
+    g_gl.uniform2f(glGetUniformLocation(program, "uvMin"), 0.5f * texel.x, 0.5f * texel.y);
+    g_gl.uniform2f(glGetUniformLocation(program, "uvMax"), (size.x - 0.5f) * texel.x, (size.y - 0.5f) * texel.y);
+}
+
+// Down the pyramid from the scene, of which width x height was rendered
+void downsampleBloom(int width, int height) {
+    RenderTarget &target = g_renderTarget;
+    const GLuint program = programId(g_bloomDownProgram);
+    g_gl.useProgram(program);
+    g_gl.uniform1f(glGetUniformLocation(program, "threshold"), kBloomThreshold);
+    g_gl.uniform1f(glGetUniformLocation(program, "knee"), kBloomKnee);
+    g_gl.bindVertexArray(target.emptyVao);
+    for (int level = 0; level < kBloomLevels; ++level) {
+        const glm::ivec2 size = bloomLevelSize(width, height, level);
+        g_gl.bindFramebuffer(target.bloomFramebuffers[level]);
+        g_gl.viewport(0, 0, size.x, size.y);
+        if (level == 0) {
+            setSourceUniforms(program, glm::ivec2(width, height), glm::ivec2(target.width, target.height));
+            g_gl.bindTexture(0, GL_TEXTURE_2D, textureId(target.color));
+        } else {
+            setSourceUniforms(program, bloomLevelSize(width, height, level - 1),
+                              bloomLevelSize(target.width, target.height, level - 1));
+            g_gl.bindTexture(0, GL_TEXTURE_2D, textureId(target.bloom[level - 1]));
+        }
+        g_gl.uniform1i(glGetUniformLocation(program, "prefilter"), level == 0 ? GL_TRUE : GL_FALSE);
+        g_gl.drawArrays(GL_TRIANGLES, 0, 3);
+    }
+}
+
+// Back up, each level added onto the one above; the first level ends up with the bloom
+void upsampleBloom(int width, int height) {
+    RenderTarget &target = g_renderTarget;
+    const GLuint program = programId(g_bloomUpProgram);
+    g_gl.useProgram(program);
+    g_gl.bindVertexArray(target.emptyVao);
+    g_gl.setEnabled(GL_BLEND, true);
+    g_gl.blendFunc(GL_ONE, GL_ONE);
+    for (int level = kBloomLevels - 1; level > 0; --level) {
+        const glm::ivec2 size = bloomLevelSize(width, height, level - 1);
+        g_gl.bindFramebuffer(target.bloomFramebuffers[level - 1]);
+        g_gl.viewport(0, 0, size.x, size.y);
+        setSourceUniforms(program, bloomLevelSize(width, height, level),
+                          bloomLevelSize(target.width, target.height, level));
+        g_gl.bindTexture(0, GL_TEXTURE_2D, textureId(target.bloom[level]));
+        g_gl.drawArrays(GL_TRIANGLES, 0, 3);
+    }
+    g_gl.setEnabled(GL_BLEND, false);
+}
+
+// Auto exposure. Every frame the scene is reduced on the GPU to a fixed grid of
+// log2 luminances (16 taps per cell, so the cost does not grow with the window)
+// and read back asynchronously through a few fenced pixel buffers. Once a
+// readback's fence has passed, the cells are reduced in parallel to a histogram;
+// the mean between two percentiles of the lit cells sets the target exposure,
+// which the exposure follows at a bounded rate (faster when brightening).
+const int kExposureGrid = 64;
+const int kExposureReadbacks = 3;
+const int kExposureBins = 64;
+const float kMinLogLuminance = -10.0f; // log2 range of the histogram
+const float kMaxLogLuminance = 6.0f;
+const float kExposureLowPercentile = 0.4f;  // Lit cells left out below and above:
+const float kExposureHighPercentile = 0.95f; // shadows, and the Sun's disk
+const float kExposureKey = 0.5f;       // Mean luminance brought to this on screen
+const float kSkyLuminance = 0.01f;     // Darker taps are not metered
+const float kMinExposure = 0.25f;
+const float kMaxExposure = 16.0f;
+const float kExposureSpeedUp = 3.0f;   // Per second, on log2 exposure
+const float kExposureSpeedDown = 1.0f;
+bool g_autoExposure = true; // --exposure E fixes g_exposure instead
+
+class ExposureMeter {
+public:
+    ExposureMeter() : m_framebuffer(0), m_next(0), m_targetExposure(1.0f), m_meanLuminance(0.0f) {
+        for (int i = 0; i < kExposureReadbacks; ++i) {
+            m_pixelBuffers[i] = 0;
+            m_fences[i] = nullptr;
+        }
+    }
+
+    void init() {
+        Texture grid = { 0, GL_TEXTURE_2D, kExposureGrid, kExposureGrid, kExposureGrid * kExposureGrid * 4 };
+        glGenTextures(1, &grid.id);
+        g_gl.bindTexture(0, GL_TEXTURE_2D, grid.id);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, kExposureGrid, kExposureGrid, 0, GL_RG, GL_HALF_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        g_gl.bindTexture(0, GL_TEXTURE_2D, 0);
+        glGenFramebuffers(1, &m_framebuffer);
+        g_gl.bindFramebuffer(m_framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, grid.id, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "ERROR: exposure grid is incomplete" << std::endl;
+        g_gl.bindFramebuffer(0);
+        m_grid = g_textures.create(grid, "exposure grid");
+
+        glGenBuffers(kExposureReadbacks, m_pixelBuffers);
+        for (int i = 0; i < kExposureReadbacks; ++i) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pixelBuffers[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, kReadbackBytes, nullptr, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    void destroy() {
+        if (!m_framebuffer)
+            return;
+        for (int i = 0; i < kExposureReadbacks; ++i) {
+            glDeleteSync(m_fences[i]);
+            m_fences[i] = nullptr;
+        }
+        glDeleteBuffers(kExposureReadbacks, m_pixelBuffers);
+        g_textures.release(m_grid);
+        g_gl.forgetFramebuffer(m_framebuffer);
+        glDeleteFramebuffers(1, &m_framebuffer);
+        m_framebuffer = 0;
+    }
+
+    // Reduce the size part of the scene (allocated at allocated) to the grid and
+    // start reading it back; skipped while every pixel buffer is in flight
+    void measure(GLuint sceneTexture, const glm::ivec2 &size, const glm::ivec2 &allocated) {
+        if (m_fences[m_next])
+            return;
+        const GLuint program = programId(g_luminanceProgram);
+        g_gl.useProgram(program);
+        setSourceUniforms(program, size, allocated);
+        g_gl.uniform2f(glGetUniformLocation(program, "cellSize"), static_cast<float>(size.x) / allocated.x / kExposureGrid,
+                    static_cast<float>(size.y) / allocated.y / kExposureGrid);
+        g_gl.uniform1f(glGetUniformLocation(program, "minLuminance"), kSkyLuminance);
+        g_gl.bindFramebuffer(m_framebuffer);
+        g_gl.viewport(0, 0, kExposureGrid, kExposureGrid);
+        g_gl.bindTexture(0, GL_TEXTURE_2D, sceneTexture);
+        g_gl.bindVertexArray(g_renderTarget.emptyVao);
+        g_gl.drawArrays(GL_TRIANGLES, 0, 3);
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pixelBuffers[m_next]);
+        glReadPixels(0, 0, kExposureGrid, kExposureGrid, GL_RG, GL_FLOAT, nullptr);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        m_fences[m_next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        m_next = (m_next + 1) % kExposureReadbacks;
+    }
+
+    // Take the readbacks the GPU is done with, oldest first, without waiting
+    void collect() {
+        for (int n = 0; n < kExposureReadbacks; ++n) {
+            const int i = (m_next + n) % kExposureReadbacks;
+            if (!m_fences[i])
+                continue;
+            const GLenum status = glClientWaitSync(m_fences[i], 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                return;
+            glDeleteSync(m_fences[i]);
+            m_fences[i] = nullptr;
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pixelBuffers[i]);
+            const float *cells = static_cast<const float *>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, kReadbackBytes,
+                                                                             GL_MAP_READ_BIT));
+            if (cells) {
+                meter(cells);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+    }
+
+    // Move the exposure towards the target over dt seconds
+    float adapt(float exposure, float dt) const {
+        const float current = std::log2(exposure), target = std::log2(m_targetExposure);
+        const float rate = target > current ? kExposureSpeedUp : kExposureSpeedDown;
+        return std::exp2(current + (target - current) * (1.0f - std::exp(-rate * std::min(dt, 0.25f))));
+    }
+
+    bool isConverged(float exposure) const { return std::abs(std::log2(exposure / m_targetExposure)) < 0.01f; }
+    float getMeanLuminance() const { return m_meanLuminance; }
+
+private:
+    static const size_t kReadbackBytes = kExposureGrid * kExposureGrid * 2 * sizeof(float);
+
+    // Histogram of the cells' log luminances, weighted by their lit share, in
+    // parallel; the mean between the percentiles sets the target exposure
+    void meter(const float *cells) {
+        std::atomic<unsigned int> histogram[kExposureBins];
+        for (int b = 0; b < kExposureBins; ++b)
+            histogram[b] = 0;
+        const float binScale = kExposureBins / (kMaxLogLuminance - kMinLogLuminance);
+        g_jobs.parallelFor(0, kExposureGrid * kExposureGrid, 512, [&](size_t begin, size_t end) {
+            unsigned int local[kExposureBins] = { 0 };
+            for (size_t c = begin; c < end; ++c) {
+                const int bin = glm::clamp(static_cast<int>((cells[2 * c] - kMinLogLuminance) * binScale), 0,
+                                           kExposureBins - 1);
+                local[bin] += static_cast<unsigned int>(cells[2 * c + 1] * 16.0f + 0.5f); // Lit taps
+            }
+            for (int b = 0; b < kExposureBins; ++b)
+                if (local[b])
+                    histogram[b] += local[b];
+        });
+
+        unsigned int total = 0;
+        for (int b = 0; b < kExposureBins; ++b)
+            total += histogram[b].load();
+        if (total == 0)
+            return; // Only sky in view: keep the exposure
+        const float low = kExposureLowPercentile * total, high = kExposureHighPercentile * total;
+        float below = 0.0f, weight = 0.0f, logSum = 0.0f;
+        for (int b = 0; b < kExposureBins; ++b) {
+            const float count = static_cast<float>(histogram[b].load());
+            const float inRange = std::max(0.0f, std::min(below + count, high) - std::max(below, low));
+            logSum += inRange * (kMinLogLuminance + (b + 0.5f) / binScale);
+            weight += inRange;
+            below += count;
+        }
+        if (weight <= 0.0f)
+            return;
+        m_meanLuminance = std::exp2(logSum / weight);
+        m_targetExposure = glm::clamp(kExposureKey / m_meanLuminance, kMinExposure, kMaxExposure);
+    }
+
+    GLuint m_framebuffer;
+    TextureHandle m_grid;
+    GLuint m_pixelBuffers[kExposureReadbacks];
+    GLsync m_fences[kExposureReadbacks];
+    int m_next; // Pixel buffer of the next measurement
+    float m_targetExposure;
+    float m_meanLuminance; // Of the last metered frame
+};
+
+ExposureMeter g_exposureMeter;
+
+//------------------------------------------------------------------------------
+// Atmospheric scattering
+//------------------------------------------------------------------------------
+
+// Bodies with an atmosphere (the Earth material) get precomputed scattering after
+// Bruneton and Neyret. Three lookup tables, in km around a planet of radius
+// bottomRadius, where r is the distance to the center and mu, muS and nu the
+// cosines of the view and sun directions with the zenith and with each other:
+//   transmittance to the top of the atmosphere (r, mu), 256x64;
+//   single Rayleigh and Mie scattering (r, mu, muS, nu), a 3D texture 256x128x32
+//   with nu folded into the width (Rayleigh in rgb, Mie's red in alpha);
+//   sky irradiance on the ground (r, muS), 64x16.
+// Multiple scattering is left out: a few percent of the light of a day sky for
+// several times the build time. The tables are computed on the job system at the
+// first run and cached on disk as half floats, in a file named after a hash of the
+// parameters and sizes, so later runs only read them (--atmosphere-benchmark
+// times both). The sun's irradiance is pi, so that a white surface facing it has
+// a radiance of 1 as in the body shaders.
+//
+// The body shaders light the ground with the sunlight left after crossing the
+// atmosphere and with the sky's irradiance (two lookups). A shell drawn over the
+// body (a camera-facing quad, the whole screen from inside) adds the light
+// scattered towards the camera along the view ray and, through dual-source
+// blending, attenuates what lies behind (three lookups).
+
+struct AtmosphereParams {
+    float bottomRadius;           // km
+    float topRadius;              // km
+    glm::vec3 rayleighScattering; // Per km at the ground
+    float rayleighScaleHeight;    // km
+    float mieScattering;          // Per km at the ground
+    float mieExtinction;
+    float mieScaleHeight;         // km
+    float miePhaseG;              // Asymmetry of the Cornette-Shanks phase function
+    float sunAngularRadius;       // Radians
+};
+
+const AtmosphereParams kEarthAtmosphere = {
+    6360.0f, 6420.0f, glm::vec3(5.802e-3f, 13.558e-3f, 33.1e-3f), 8.0f, 3.996e-3f, 4.44e-3f, 1.2f, 0.8f, 0.004675f
+};
+
+const int kTransmittanceWidth = 256;  // mu
+const int kTransmittanceHeight = 64;  // r
+const int kScatteringNu = 8;
+const int kScatteringMuS = 32;
+const int kScatteringMu = 128;
+const int kScatteringR = 32;
+const int kIrradianceWidth = 64;      // muS
+const int kIrradianceHeight = 16;     // r
+const int kTransmittanceSamples = 100;
+const int kScatteringSamples = 40;
+const float kMinMuS = -0.2f;          // Sun 11.5 degrees below the horizon: the sky is dark
+const uint32_t kAtmosphereCacheVersion = 1;
+
+inline float safeSqrt(float a) { return std::sqrt(std::max(a, 0.0f)); }
+inline float clampCosine(float mu) { return glm::clamp(mu, -1.0f, 1.0f); }
+// Texture coordinate of x in [0, 1] such that 0 and 1 fall on the first and last texel centers, and back
+inline float unitToTexCoord(float x, int size) { return 0.5f / size + x * (1.0f - 1.0f / size); }
+inline float texCoordToUnit(float u, int size) { return (u - 0.5f / size) / (1.0f - 1.0f / size); }
+
+inline float distanceToTop(const AtmosphereParams &a, float r, float mu) {
+    return std::max(-r * mu + safeSqrt(r * r * (mu * mu - 1.0f) + a.topRadius * a.topRadius), 0.0f);
+}
+inline float distanceToBottom(const AtmosphereParams &a, float r, float mu) {
+    return std::max(-r * mu - safeSqrt(r * r * (mu * mu - 1.0f) + a.bottomRadius * a.bottomRadius), 0.0f);
+}
+inline bool rayIntersectsGround(const AtmosphereParams &a, float r, float mu) {
+    return mu < 0.0f && r * r * (mu * mu - 1.0f) + a.bottomRadius * a.bottomRadius >= 0.0f;
+}
+
+// Clamp-to-edge bilinear and trilinear fetches from the float tables being built
+template <typename T>
+T sampleTable2D(const std::vector<T> &table, int width, int height, float u, float v) {
+    const float x = glm::clamp(u * width - 0.5f, 0.0f, width - 1.0f);
+    const float y = glm::clamp(v * height - 0.5f, 0.0f, height - 1.0f);
+    const int x0 = static_cast<int>(x), y0 = static_cast<int>(y);
+    const int x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1);
+    const float fx = x - x0, fy = y - y0;
+    return glm::mix(glm::mix(table[y0 * width + x0], table[y0 * width + x1], fx),
+                    glm::mix(table[y1 * width + x0], table[y1 * width + x1], fx), fy);
+}
+template <typename T>
+T sampleTable3D(const std::vector<T> &table, int width, int height, int depth, float u, float v, float w) {
+    const float z = glm::clamp(w * depth - 0.5f, 0.0f, depth - 1.0f);
+    const int z0 = static_cast<int>(z), z1 = std::min(z0 + 1, depth - 1);
+    const size_t slice = static_cast<size_t>(width) * height;
+    const float x = glm::clamp(u * width - 0.5f, 0.0f, width - 1.0f);
+    const float y = glm::clamp(v * height - 0.5f, 0.0f, height - 1.0f);
+    const int x0 = static_cast<int>(x), y0 = static_cast<int>(y);
+    const int x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1);
+    const float fx = x - x0, fy = y - y0;
+    T layers[2];
+    for (int l = 0; l < 2; ++l) {
+        const T *s = &table[(l == 0 ? z0 : z1) * slice];
+        layers[l] = glm::mix(glm::mix(s[y0 * width + x0], s[y0 * width + x1], fx),
+                             glm::mix(s[y1 * width + x0], s[y1 * width + x1], fx), fy);
+    }
+    return glm::mix(layers[0], layers[1], z - z0);
+}
+
+// Transmittance table coordinates of (r, mu) (the same mapping as the shaders)
+glm::vec2 transmittanceUv(const AtmosphereParams &a, float r, float mu) {
+    const float H = std::sqrt(a.topRadius * a.topRadius - a.bottomRadius * a.bottomRadius);
+    const float rho = safeSqrt(r * r - a.bottomRadius * a.bottomRadius);
+    const float dMin = a.topRadius - r, dMax = rho + H;
+    const float xMu = (distanceToTop(a, r, mu) - dMin) / (dMax - dMin);
+    return glm::vec2(unitToTexCoord(xMu, kTransmittanceWidth), unitToTexCoord(rho / H, kTransmittanceHeight));
+}
+
+// Scattering table coordinates of (r, mu, muS, nu): nu in [0, 1] (between slices), muS, mu, r
+glm::vec4 scatteringUvwz(const AtmosphereParams &a, float r, float mu, float muS, float nu, bool intersectsGround) {
+    const float H = std::sqrt(a.topRadius * a.topRadius - a.bottomRadius * a.bottomRadius);
+    const float rho = safeSqrt(r * r - a.bottomRadius * a.bottomRadius);
+    const float uR = unitToTexCoord(rho / H, kScatteringR);
+
+    // Rays to the ground fill the lower half of mu, rays to the sky the upper half
+    const float rMu = r * mu;
+    const float discriminant = rMu * rMu - r * r + a.bottomRadius * a.bottomRadius;
+    float uMu;
+    if (intersectsGround) {
+        const float d = -rMu - safeSqrt(discriminant);
+        const float dMin = r - a.bottomRadius, dMax = rho;
+        uMu = 0.5f - 0.5f * unitToTexCoord(dMax == dMin ? 0.0f : (d - dMin) / (dMax - dMin), kScatteringMu / 2);
+    } else {
+        const float d = -rMu + safeSqrt(discriminant + H * H);
+        const float dMin = a.topRadius - r, dMax = rho + H;
+        uMu = 0.5f + 0.5f * unitToTexCoord((d - dMin) / (dMax - dMin), kScatteringMu / 2);
+    }
+
+    const float dMin = a.topRadius - a.bottomRadius, dMax = H;
+    const float d = distanceToTop(a, a.bottomRadius, muS);
+    const float alpha = (d - dMin) / (dMax - dMin);
+    const float A = (distanceToTop(a, a.bottomRadius, kMinMuS) - dMin) / (dMax - dMin);
+    const float uMuS = unitToTexCoord(std::max(1.0f - alpha / A, 0.0f) / (1.0f + alpha), kScatteringMuS);
+    return glm::vec4((nu + 1.0f) * 0.5f, uMuS, uMu, uR);
+}
+
+// The atmosphere's lookup tables: computed, read from the cache and uploaded
+class Atmosphere {
+public:
+    Atmosphere() : m_params(kEarthAtmosphere), m_buildMs(0.0), m_cached(false) {}
+
+    // Read the tables from the cache file of params or compute (and cache) them;
+    // CPU only. cacheReads false always computes, as a cold start would.
+    void build(const AtmosphereParams &params, bool cacheReads = true) {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        m_params = params;
+        const std::string filename = cacheFilename();
+        m_cached = cacheReads && readCache(filename);
+        if (!m_cached) {
+            compute();
+            writeCache(filename);
+        }
+        m_buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (m_cached)
+            std::printf("Atmosphere tables read from %s in %.1f ms (warm start)\n", filename.c_str(), m_buildMs);
+        else
+            std::printf("Atmosphere tables computed in %.1f ms on %d threads (cold start), cached in %s\n", m_buildMs,
+                        g_jobs.getWorkerCount(), filename.c_str());
+    }
+
+    // Upload the tables, then drop the CPU copies; GL thread
+    void init() {
+        if (m_transmittance.empty())
+            return;
+        m_textures[0] = upload(GL_TEXTURE_2D, kTransmittanceWidth, kTransmittanceHeight, 1, m_transmittance,
+                               "atmosphere transmittance");
+        m_textures[1] = upload(GL_TEXTURE_3D, kScatteringNu * kScatteringMuS, kScatteringMu, kScatteringR, m_scattering,
+                               "atmosphere scattering");
+        m_textures[2] = upload(GL_TEXTURE_2D, kIrradianceWidth, kIrradianceHeight, 1, m_irradiance,
+                               "atmosphere irradiance");
+        std::vector<uint16_t>().swap(m_transmittance);
+        std::vector<uint16_t>().swap(m_scattering);
+        std::vector<uint16_t>().swap(m_irradiance);
+    }
+
+    void destroy() {
+        for (int t = 0; t < 3; ++t)
+            g_textures.release(m_textures[t]);
+    }
+
+    bool isReady() const { return g_textures.get(m_textures[2]) != nullptr; }
+    const AtmosphereParams &getParams() const { return m_params; }
+    double getBuildMs() const { return m_buildMs; }
+    bool wasCached() const { return m_cached; }
+
+    // Bind the tables from kAtmosphereTextureUnit on
+    void bind() const {
+        const GLenum targets[] = { GL_TEXTURE_2D, GL_TEXTURE_3D, GL_TEXTURE_2D };
+        for (int t = 0; t < 3; ++t)
+            g_gl.bindTexture(kAtmosphereTextureUnit + t, targets[t], textureId(m_textures[t]));
+    }
+
+private:
+    struct CacheHeader {
+        char magic[4]; // "ATMO"
+        uint32_t version;
+        uint64_t key;
+    };
+
+    // FNV-1a over the parameters, the table sizes and the format version
+    uint64_t cacheKey() const {
+        const int sizes[] = { kTransmittanceWidth, kTransmittanceHeight, kScatteringNu, kScatteringMuS, kScatteringMu,
+                              kScatteringR, kIrradianceWidth, kIrradianceHeight, kTransmittanceSamples,
+                              kScatteringSamples, static_cast<int>(kAtmosphereCacheVersion) };
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&](const void *data, size_t size) {
+            for (size_t i = 0; i < size; ++i)
+                hash = (hash ^ static_cast<const unsigned char *>(data)[i]) * 1099511628211ull;
+        };
+        mix(&m_params, sizeof(m_params));
+        mix(sizes, sizeof(sizes));
+        return hash;
+    }
+
+    std::string cacheFilename() const {
+        char name[64];
+        std::snprintf(name, sizeof(name), "atmosphere-%016llx.lut", static_cast<unsigned long long>(cacheKey()));
+        return name;
+    }
+
+    static size_t texelCount(int table) {
+        const size_t counts[] = { static_cast<size_t>(kTransmittanceWidth) * kTransmittanceHeight,
+                                  static_cast<size_t>(kScatteringNu) * kScatteringMuS * kScatteringMu * kScatteringR,
+                                  static_cast<size_t>(kIrradianceWidth) * kIrradianceHeight };
+        return counts[table];
+    }
+
+    bool readCache(const std::string &filename) {
+        std::ifstream file(filename.c_str(), std::ios::binary);
+        CacheHeader header;
+        if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) || std::memcmp(header.magic, "ATMO", 4) != 0 ||
+            header.version != kAtmosphereCacheVersion || header.key != cacheKey())
+            return false;
+        std::vector<uint16_t> *tables[] = { &m_transmittance, &m_scattering, &m_irradiance };
+        for (int t = 0; t < 3; ++t) {
+            tables[t]->resize(4 * texelCount(t));
+            if (!file.read(reinterpret_cast<char *>(tables[t]->data()), tables[t]->size() * sizeof(uint16_t))) {
+                std::cerr << "Warning: atmosphere cache " << filename << " is truncated, recomputing" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void writeCache(const std::string &filename) const {
+        const CacheHeader header = { { 'A', 'T', 'M', 'O' }, kAtmosphereCacheVersion, cacheKey() };
+        std::vector<FileChunk> chunks;
+        chunks.push_back(FileChunk{ &header, sizeof(header) });
+        const std::vector<uint16_t> *tables[] = { &m_transmittance, &m_scattering, &m_irradiance };
+        for (int t = 0; t < 3; ++t)
+            chunks.push_back(FileChunk{ tables[t]->data(), tables[t]->size() * sizeof(uint16_t) });
+        if (!writeFileAtomically(filename, chunks))
+            std::cerr << "Warning: could not write the atmosphere cache " << filename << std::endl;
+    }
+
+    static void packHalves(const glm::vec4 &value, uint16_t *out) {
+        for (int c = 0; c < 4; ++c)
+            out[c] = glm::packHalf1x16(value[c]);
+    }
+
+    glm::vec3 transmittanceToTop(const std::vector<glm::vec3> &table, float r, float mu) const {
+        const glm::vec2 uv = transmittanceUv(m_params, r, mu);
+        return sampleTable2D(table, kTransmittanceWidth, kTransmittanceHeight, uv.x, uv.y);
+    }
+
+    // Transmittance over distance d from (r, mu), whether the ray goes to the ground or not
+    glm::vec3 transmittanceOver(const std::vector<glm::vec3> &table, float r, float mu, float d, bool toGround) const {
+        const float rD = glm::clamp(std::sqrt(d * d + 2.0f * r * mu * d + r * r), m_params.bottomRadius, m_params.topRadius);
+        const float muD = clampCosine((r * mu + d) / rD);
+        const glm::vec3 ratio = toGround ? transmittanceToTop(table, rD, -muD) / transmittanceToTop(table, r, -mu)
+                                         : transmittanceToTop(table, r, mu) / transmittanceToTop(table, rD, muD);
+        return glm::min(ratio, glm::vec3(1.0f));
+    }
+
+    // Transmittance towards the Sun, faded over its disk as it sets behind the horizon
+    glm::vec3 transmittanceToSun(const std::vector<glm::vec3> &table, float r, float muS) const {
+        const float sinHorizon = m_params.bottomRadius / r;
+        const float cosHorizon = -safeSqrt(1.0f - sinHorizon * sinHorizon);
+        const float edge = sinHorizon * m_params.sunAngularRadius;
+        return transmittanceToTop(table, r, muS) * glm::smoothstep(-edge, edge, muS - cosHorizon);
+    }
+
+    void compute() {
+        const AtmosphereParams &a = m_params;
+        const float H = std::sqrt(a.topRadius * a.topRadius - a.bottomRadius * a.bottomRadius);
+        const float kSolarIrradiance = PI;
+
+        // Transmittance: optical depth to the top, trapezoidal rule
+        std::vector<glm::vec3> transmittance(texelCount(0));
+        g_jobs.parallelFor(0, kTransmittanceHeight, 1, [&](size_t begin, size_t end) {
+            for (size_t y = begin; y < end; ++y) {
+                const float rho = H * texCoordToUnit((y + 0.5f) / kTransmittanceHeight, kTransmittanceHeight);
+                const float r = std::sqrt(rho * rho + a.bottomRadius * a.bottomRadius);
+                for (int x = 0; x < kTransmittanceWidth; ++x) {
+                    const float dMin = a.topRadius - r, dMax = rho + H;
+                    const float d = dMin + texCoordToUnit((x + 0.5f) / kTransmittanceWidth, kTransmittanceWidth) * (dMax - dMin);
+                    const float mu = d == 0.0f ? 1.0f : clampCosine((H * H - rho * rho - d * d) / (2.0f * r * d));
+                    const float dx = distanceToTop(a, r, mu) / kTransmittanceSamples;
+                    float rayleigh = 0.0f, mie = 0.0f;
+                    for (int i = 0; i <= kTransmittanceSamples; ++i) {
+                        const float di = i * dx;
+                        const float altitude = std::sqrt(di * di + 2.0f * r * mu * di + r * r) - a.bottomRadius;
+                        const float weight = (i == 0 || i == kTransmittanceSamples) ? 0.5f : 1.0f;
+                        rayleigh += weight * std::exp(-altitude / a.rayleighScaleHeight);
+                        mie += weight * std::exp(-altitude / a.mieScaleHeight);
+                    }
+                    transmittance[y * kTransmittanceWidth + x] =
+                        glm::exp(-(a.rayleighScattering * rayleigh + glm::vec3(a.mieExtinction * mie)) * dx);
+                }
+            }
+        });
+
+        // Single scattering: sunlight scattered once along the ray, Rayleigh in rgb, Mie's red in alpha
+        const int width = kScatteringNu * kScatteringMuS;
+        std::vector<glm::vec4> scattering(texelCount(1));
+        g_jobs.parallelFor(0, static_cast<size_t>(kScatteringMu) * kScatteringR, 16, [&](size_t begin, size_t end) {
+            for (size_t row = begin; row < end; ++row) {
+                const int y = static_cast<int>(row % kScatteringMu), z = static_cast<int>(row / kScatteringMu);
+                const float rho = H * texCoordToUnit((z + 0.5f) / kScatteringR, kScatteringR);
+                const float r = std::sqrt(rho * rho + a.bottomRadius * a.bottomRadius);
+                const float uMu = (y + 0.5f) / kScatteringMu;
+                float mu;
+                bool toGround;
+                if (uMu < 0.5f) {
+                    const float dMin = r - a.bottomRadius, dMax = rho;
+                    const float d = dMin + (dMax - dMin) * texCoordToUnit(1.0f - 2.0f * uMu, kScatteringMu / 2);
+                    mu = d == 0.0f ? -1.0f : clampCosine(-(rho * rho + d * d) / (2.0f * r * d));
+                    toGround = true;
+                } else {
+                    const float dMin = a.topRadius - r, dMax = rho + H;
+                    const float d = dMin + (dMax - dMin) * texCoordToUnit(2.0f * uMu - 1.0f, kScatteringMu / 2);
+                    mu = d == 0.0f ? 1.0f : clampCosine((H * H - rho * rho - d * d) / (2.0f * r * d));
+                    toGround = false;
+                }
+                // Along the view ray: radius, transmittance from the origin and densities at each sample
+                const float dx = (toGround ? distanceToBottom(a, r, mu) : distanceToTop(a, r, mu)) / kScatteringSamples;
+                float radii[kScatteringSamples + 1];
+                glm::vec3 rayleighWeights[kScatteringSamples + 1];
+                float mieWeights[kScatteringSamples + 1];
+                for (int i = 0; i <= kScatteringSamples; ++i) {
+                    const float d = i * dx;
+                    radii[i] = glm::clamp(std::sqrt(d * d + 2.0f * r * mu * d + r * r), a.bottomRadius, a.topRadius);
+                    const glm::vec3 weight = ((i == 0 || i == kScatteringSamples) ? 0.5f : 1.0f) * dx * kSolarIrradiance *
+                                             transmittanceOver(transmittance, r, mu, d, toGround);
+                    rayleighWeights[i] = weight * a.rayleighScattering * std::exp(-(radii[i] - a.bottomRadius) / a.rayleighScaleHeight);
+                    mieWeights[i] = weight.r * a.mieScattering * std::exp(-(radii[i] - a.bottomRadius) / a.mieScaleHeight);
+                }
+                for (int x = 0; x < width; ++x) {
+                    const float xMuS = texCoordToUnit(((x % kScatteringMuS) + 0.5f) / kScatteringMuS, kScatteringMuS);
+                    const float dMin = a.topRadius - a.bottomRadius, dMax = H;
+                    const float A = (distanceToTop(a, a.bottomRadius, kMinMuS) - dMin) / (dMax - dMin);
+                    const float alpha = (A - xMuS * A) / (1.0f + xMuS * A);
+                    const float dS = dMin + std::min(alpha, A) * (dMax - dMin);
+                    const float muS = dS == 0.0f ? 1.0f : clampCosine((H * H - dS * dS) / (2.0f * a.bottomRadius * dS));
+                    const float spread = safeSqrt((1.0f - mu * mu) * (1.0f - muS * muS));
+                    const float nu = glm::clamp(static_cast<float>(x / kScatteringMuS) / (kScatteringNu - 1) * 2.0f - 1.0f,
+                                                mu * muS - spread, mu * muS + spread);
+                    glm::vec3 rayleigh(0.0f);
+                    float mie = 0.0f;
+                    for (int i = 0; i <= kScatteringSamples; ++i) {
+                        const glm::vec3 sun = transmittanceToSun(transmittance, radii[i], clampCosine((r * muS + i * dx * nu) / radii[i]));
+                        rayleigh += rayleighWeights[i] * sun;
+                        mie += mieWeights[i] * sun.r;
+                    }
+                    scattering[(static_cast<size_t>(z) * kScatteringMu + y) * width + x] = glm::vec4(rayleigh, mie);
+                }
+            }
+        });
+
+        // Sky irradiance: the scattered radiance over the upper hemisphere, cosine weighted
+        const int kThetaSteps = 16, kPhiSteps = 32;
+        std::vector<glm::vec3> irradiance(texelCount(2));
+        g_jobs.parallelFor(0, kIrradianceHeight, 1, [&](size_t begin, size_t end) {
+            for (size_t y = begin; y < end; ++y) {
+                const float r = a.bottomRadius + texCoordToUnit((y + 0.5f) / kIrradianceHeight, kIrradianceHeight) *
+                                                     (a.topRadius - a.bottomRadius);
+                for (int x = 0; x < kIrradianceWidth; ++x) {
+                    const float muS = clampCosine(2.0f * texCoordToUnit((x + 0.5f) / kIrradianceWidth, kIrradianceWidth) - 1.0f);
+                    const glm::vec3 sun(safeSqrt(1.0f - muS * muS), 0.0f, muS);
+                    glm::vec3 sum(0.0f);
+                    const float dTheta = 0.5f * PI / kThetaSteps, dPhi = 2.0f * PI / kPhiSteps;
+                    for (int j = 0; j < kThetaSteps; ++j) {
+                        const float theta = (j + 0.5f) * dTheta;
+                        for (int i = 0; i < kPhiSteps; ++i) {
+                            const float phi = (i + 0.5f) * dPhi;
+                            const glm::vec3 w(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta));
+                            const float nu = glm::dot(w, sun);
+                            const glm::vec4 s = sampleScattering(scattering, r, w.z, muS, nu, rayIntersectsGround(a, r, w.z));
+                            const glm::vec3 mie = s.x > 0.0f ? glm::vec3(s) * (s.w / s.x) * (a.rayleighScattering.x / a.rayleighScattering)
+                                                             : glm::vec3(0.0f);
+                            sum += (glm::vec3(s) * rayleighPhase(nu) + mie * miePhase(nu)) * w.z * std::sin(theta) * dTheta * dPhi;
+                        }
+                    }
+                    irradiance[y * kIrradianceWidth + x] = sum;
+                }
+            }
+        });
+
+        m_transmittance.resize(4 * transmittance.size());
+        for (size_t i = 0; i < transmittance.size(); ++i)
+            packHalves(glm::vec4(transmittance[i], 1.0f), &m_transmittance[4 * i]);
+        m_scattering.resize(4 * scattering.size());
+        g_jobs.parallelFor(0, scattering.size(), 65536, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+                packHalves(scattering[i], &m_scattering[4 * i]);
+        });
+        m_irradiance.resize(4 * irradiance.size());
+        for (size_t i = 0; i < irradiance.size(); ++i)
+            packHalves(glm::vec4(irradiance[i], 1.0f), &m_irradiance[4 * i]);
+    }
+
+    static float rayleighPhase(float nu) { return 3.0f / (16.0f * PI) * (1.0f + nu * nu); }
+    float miePhase(float nu) const {
+        const float g = m_params.miePhaseG;
+        const float k = 3.0f / (8.0f * PI) * (1.0f - g * g) / (2.0f + g * g);
+        return k * (1.0f + nu * nu) / std::pow(1.0f + g * g - 2.0f * g * nu, 1.5f);
+    }
+
+    // The scattering table at (r, mu, muS, nu), interpolated between the two nu slices around
+    glm::vec4 sampleScattering(const std::vector<glm::vec4> &table, float r, float mu, float muS, float nu,
+                               bool intersectsGround) const {
+        const glm::vec4 uvwz = scatteringUvwz(m_params, r, mu, muS, nu, intersectsGround);
+        const float x = uvwz.x * (kScatteringNu - 1);
+        const float slice = std::min(std::floor(x), kScatteringNu - 2.0f);
+        const int width = kScatteringNu * kScatteringMuS;
+        const glm::vec4 s0 = sampleTable3D(table, width, kScatteringMu, kScatteringR,
+                                           (slice + uvwz.y) / kScatteringNu, uvwz.z, uvwz.w);
+        const glm::vec4 s1 = sampleTable3D(table, width, kScatteringMu, kScatteringR,
+                                           (slice + 1.0f + uvwz.y) / kScatteringNu, uvwz.z, uvwz.w);
+        return glm::mix(s0, s1, x - slice);
+    }
+
+    static TextureHandle upload(GLenum target, int width, int height, int depth, const std::vector<uint16_t> &texels,
+                                const char *name) {
+        Texture texture = { 0, target, width, height, static_cast<size_t>(width) * height * depth * 8 };
+        glGenTextures(1, &texture.id);
+        g_gl.bindTexture(0, target, texture.id);
+        glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        if (target == GL_TEXTURE_3D) {
+            glTexParameteri(target, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+            glTexImage3D(target, 0, GL_RGBA16F, width, height, depth, 0, GL_RGBA, GL_HALF_FLOAT, texels.data());
+        } else {
+            glTexImage2D(target, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_HALF_FLOAT, texels.data());
+        }
+        g_gl.countUpload(texels.size() * sizeof(uint16_t));
+        g_gl.bindTexture(0, target, 0);
+        return g_textures.create(texture, name);
+    }
+
+    AtmosphereParams m_params;
+    std::vector<uint16_t> m_transmittance, m_scattering, m_irradiance; // RGBA half floats until uploaded
+    TextureHandle m_textures[3];
+    double m_buildMs;
+    bool m_cached;
+};
+
+Atmosphere g_atmosphere;
+
+// Time the table build from scratch and from the cache it leaves, then exit (--atmosphere-benchmark)
+int runAtmosphereBenchmark() {
+    g_jobs.start();
+    Atmosphere cold, warm;
+    cold.build(kEarthAtmosphere, false);
+    warm.build(kEarthAtmosphere);
+    g_jobs.stop();
+    if (!warm.wasCached()) {
+        std::cerr << "Error: the atmosphere tables were not read back from the cache" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::printf("cold_ms,warm_ms,threads\n%.1f,%.1f,%d\n", cold.getBuildMs(), warm.getBuildMs(), g_jobs.getWorkerCount());
+    return EXIT_SUCCESS;
 }
 
-void initCamera() {
-    int width, height;
-    glfwGetWindowSize(g_window, &width, &height);
-    g_camera.setAspectRatio(static_cast<float>(width) / static_cast<float>(height));
+//------------------------------------------------------------------------------
+// Clustered lights
+//------------------------------------------------------------------------------
 
-    g_camera.setPosition(glm::vec3(0.0f, 0.0f, 30.0f));
+// Besides the Sun, any number of point lights (see PointLight). The view frustum
+// is cut into tiles on screen and into slices in depth, spaced exponentially from
+// the near to the far plane so that clusters stay about as deep as they are wide.
+// Every frame the CPU lists, per cluster, the lights whose range reaches it: the
+// screen and depth bounds of the lights in parallel, then one job per slice for
+// the lists of its clusters. The lists are compacted and streamed with the lights,
+// and the fragment shaders loop only over the lights of their cluster, so shading
+// costs what overlaps a fragment, not what is in the scene. GL 3.3 has no storage
+// buffers: the shaders read lights and lists through buffer textures over the
+// stream buffer. The Sun keeps its own path (eclipses, rings, atmosphere).
+const int kClusterTilesX = 16; // As in fragmentShader.glsl and impostorFragmentShader.glsl
+const int kClusterTilesY = 9;
+const int kClusterSlices = 24;
+const int kClusterCount = kClusterTilesX * kClusterTilesY * kClusterSlices;
+const int kMaxLightsPerCluster = 32; // Later lights of a fuller cluster are dropped
+
+class LightClusters {
+public:
+    struct Stats {
+        unsigned int visibleLights; // Lights reaching at least one cluster
+        unsigned int maxPerCluster; // Longest list, before the cap
+        unsigned int fullClusters;  // Clusters whose list was capped
+        size_t indices;             // Entries over all the lists
+        double buildMs;             // CPU time of build()
+
+        Stats() : visibleLights(0), maxPerCluster(0), fullClusters(0), indices(0), buildMs(0.0) {}
+    };
 
-    g_camera.setNear(0.1f);
-    g_camera.setFar(100.0f);
-}
-
-GLuint earthTexture, moonTexture, saturnTexture, sunTexture;
-
-void initTextures() {
-    earthTexture = loadTextureFromFileToGPU("./media/earth2.jpg");
-    sunTexture = loadTextureFromFileToGPU("./media/sun2.jpg");
-    moonTexture = loadTextureFromFileToGPU("./media/moon.jpg");
-    saturnTexture = loadTextureFromFileToGPU("./media/saturn2.jpg");
-    ringTexture = loadTextureFromFileToGPU("./media/saturn_ring.jpg");
-    
-    std::string textureFolderPath = "./media/skyboxDefault"; // Change to "./media/skybox" to get a nebulae skybox
-    std::string textureExtension = ".png";
-
-    std::vector<std::string> faces = {
-        textureFolderPath + "/right" + textureExtension,
-        textureFolderPath + "/left" + textureExtension,
-        textureFolderPath + "/top" + textureExtension,
-        textureFolderPath + "/bottom" + textureExtension,
-        textureFolderPath + "/front" + textureExtension,
-        textureFolderPath + "/back" + textureExtension
+    LightClusters()
+        : m_attachedGeneration(0), m_maxTexels(0), m_active(false), m_lightTexel(0), m_clusterTexel(0),
+          m_depthScale(0.0f), m_depthBias(0.0f), m_tileScale(0.0f) {}
+
+    // Buffer textures over the stream buffer, attached in build(); GL thread
+    void init() {
+        GLint maxTexels = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+        m_maxTexels = static_cast<size_t>(std::max(maxTexels, 0));
+        const char *names[] = { "point lights", "light clusters" };
+        for (int i = 0; i < 2; ++i) {
+            Texture texture = { 0, GL_TEXTURE_BUFFER, 0, 0, 0 }; // Storage is the stream ring's
+            glGenTextures(1, &texture.id);
+            m_textures[i] = g_textures.create(texture, names[i]);
+        }
+    }
+
+    void destroy() {
+        g_textures.release(m_textures[0]);
+        g_textures.release(m_textures[1]);
+        m_attachedGeneration = 0;
+    }
+
+    // List the lights of each cluster of this view and stream them with the lights;
+    // viewportHeight in pixels. Without lights the shaders skip the lookup.
+    void build(const glm::mat4 &viewMatrix, const glm::mat4 &projMatrix, int viewportHeight) {
+        const Clock::time_point start = Clock::now();
+        m_frame = Stats();
+        m_active = false;
+        const size_t lightCount = g_lightSpheres.size();
+        if (lightCount == 0 || !g_textures.get(m_textures[0]))
+            return;
+
+        const float near = g_camera.getNear();
+        m_depthScale = kClusterSlices / std::log(g_camera.getFar() / near);
+        m_depthBias = -std::log(near) * m_depthScale;
+        const float viewportWidth = viewportHeight * projMatrix[1][1] / projMatrix[0][0];
+        m_tileScale = glm::vec2(kClusterTilesX / viewportWidth, kClusterTilesY / static_cast<float>(viewportHeight));
+
+        // Clusters reached by each light: a box of tiles and slices, empty if out of view
+        LightBounds *bounds = g_frameArena.allocateArray<LightBounds>(lightCount);
+        g_jobs.parallelFor(0, lightCount, 64, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+                bounds[i] = lightBounds(viewMatrix * glm::vec4(glm::vec3(g_lightSpheres[i]), 1.0f),
+                                        g_lightSpheres[i].w, projMatrix, near);
+        });
+
+        // One job per slice fills the lists of its own clusters
+        uint8_t *counts = g_frameArena.allocateArray<uint8_t>(kClusterCount);
+        uint16_t *lists = g_frameArena.allocateArray<uint16_t>(kClusterCount * kMaxLightsPerCluster);
+        unsigned int *longest = g_frameArena.allocateArray<unsigned int>(kClusterSlices);
+        g_jobs.parallelFor(0, kClusterSlices, 1, [&](size_t begin, size_t end) {
+            for (size_t slice = begin; slice < end; ++slice) {
+                const int first = static_cast<int>(slice) * kClusterTilesX * kClusterTilesY;
+                std::fill(counts + first, counts + first + kClusterTilesX * kClusterTilesY, 0);
+                unsigned int reached[kClusterTilesX * kClusterTilesY] = {}; // Counts past the cap
+                for (size_t i = 0; i < lightCount; ++i) {
+                    const LightBounds &b = bounds[i];
+                    if (static_cast<int>(slice) < b.minSlice || static_cast<int>(slice) > b.maxSlice)
+                        continue;
+                    for (int y = b.minTile.y; y <= b.maxTile.y; ++y) {
+                        for (int x = b.minTile.x; x <= b.maxTile.x; ++x) {
+                            const int tile = y * kClusterTilesX + x;
+                            uint8_t &count = counts[first + tile];
+                            if (count < kMaxLightsPerCluster)
+                                lists[(first + tile) * kMaxLightsPerCluster + count++] = static_cast<uint16_t>(i);
+                            ++reached[tile];
+                        }
+                    }
+                }
+                longest[slice] = *std::max_element(reached, reached + kClusterTilesX * kClusterTilesY);
+            }
+        });
+
+        size_t indices = 0;
+        for (int c = 0; c < kClusterCount; ++c) {
+            indices += counts[c];
+            m_frame.fullClusters += counts[c] == kMaxLightsPerCluster ? 1 : 0;
+        }
+        for (int slice = 0; slice < kClusterSlices; ++slice)
+            m_frame.maxPerCluster = std::max(m_frame.maxPerCluster, longest[slice]);
+        for (size_t i = 0; i < lightCount; ++i)
+            m_frame.visibleLights += bounds[i].minSlice <= bounds[i].maxSlice ? 1 : 0;
+        m_frame.indices = indices;
+
+        // Stream the lights (position and range, then color) and the lists: one word per
+        // cluster, first | count << 24 from the start of the words, then the indices
+        GLintptr lightOffset = 0, clusterOffset = 0;
+        glm::vec4 *lights = static_cast<glm::vec4 *>(g_stream.allocate(lightCount * 2 * sizeof(glm::vec4),
+                                                                       sizeof(glm::vec4), lightOffset));
+        uint32_t *words = static_cast<uint32_t *>(g_stream.allocate((kClusterCount + indices) * sizeof(uint32_t),
+                                                                    sizeof(uint32_t), clusterOffset));
+        if (!lights || !words)
+            return;
+        m_lightTexel = static_cast<int>(lightOffset / sizeof(glm::vec4));
+        m_clusterTexel = static_cast<int>(clusterOffset / sizeof(uint32_t));
+        if (static_cast<size_t>(m_lightTexel) + 2 * lightCount > m_maxTexels ||
+            static_cast<size_t>(m_clusterTexel) + kClusterCount + indices > m_maxTexels) {
+            std::cerr << "ERROR: point lights beyond the texture buffer size (" << m_maxTexels << " texels)" << std::endl;
+            return;
+        }
+        for (size_t i = 0; i < lightCount; ++i) {
+            lights[2 * i] = g_lightSpheres[i];
+            lights[2 * i + 1] = glm::vec4(g_lights[i].color, 0.0f);
+        }
+        uint32_t *list = words + kClusterCount;
+        for (int c = 0; c < kClusterCount; ++c) {
+            words[c] = static_cast<uint32_t>(list - words) | static_cast<uint32_t>(counts[c]) << 24;
+            for (int k = 0; k < counts[c]; ++k)
+                *list++ = lists[c * kMaxLightsPerCluster + k];
+        }
+
+        // The stream buffer is replaced when it grows, often under the same name
+        if (g_stream.getGeneration() != m_attachedGeneration) {
+            m_attachedGeneration = g_stream.getGeneration();
+            const GLenum formats[] = { GL_RGBA32F, GL_R32UI };
+            for (int i = 0; i < 2; ++i) {
+                g_gl.activeTexture(kLightTextureUnit + i);
+                g_gl.bindTexture(kLightTextureUnit + i, GL_TEXTURE_BUFFER, textureId(m_textures[i]));
+                glTexBuffer(GL_TEXTURE_BUFFER, formats[i], g_stream.getBuffer());
+            }
+        }
+        m_active = true;
+        m_frame.buildMs = elapsedMs(start);
+    }
+
+    void bind() const {
+        g_gl.bindTexture(kLightTextureUnit, GL_TEXTURE_BUFFER, textureId(m_textures[0]));
+        g_gl.bindTexture(kLightTextureUnit + 1, GL_TEXTURE_BUFFER, textureId(m_textures[1]));
+    }
+
+    // This frame's lookup, for a program reading the lights (see fragmentShader.glsl)
+    void setUniforms(GLuint program) const {
+        g_gl.uniform1i(glGetUniformLocation(program, "pointLights"), m_active ? GL_TRUE : GL_FALSE);
+        if (!m_active)
+            return;
+        g_gl.uniform1i(glGetUniformLocation(program, "lightTexel"), m_lightTexel);
+        g_gl.uniform1i(glGetUniformLocation(program, "clusterTexel"), m_clusterTexel);
+        g_gl.uniform2f(glGetUniformLocation(program, "clusterTileScale"), m_tileScale.x, m_tileScale.y);
+        g_gl.uniform2f(glGetUniformLocation(program, "clusterDepthScaleBias"), m_depthScale, m_depthBias);
+    }
+
+    const Stats &frameStats() const { return m_frame; }
+
+private:
+    // Tiles and slices reached by a light; minSlice > maxSlice when out of view
+    struct LightBounds {
+        glm::ivec2 minTile, maxTile;
+        int minSlice, maxSlice;
     };
-    cubemapTexture = loadCubemap(faces);
-}
+
+    int slice(float depth) const {
+        return glm::clamp(static_cast<int>(std::log(depth) * m_depthScale + m_depthBias), 0, kClusterSlices - 1);
+    }
+
+    // Range of x / depth over a sphere seen from the origin, in the plane of one
+    // screen axis and the view axis; the sphere lies beyond the near plane
+    static glm::vec2 tangentBounds(float x, float depth, float radius) {
+        const float center = std::atan2(x, depth);
+        const float halfAngle = std::asin(std::min(radius / std::sqrt(x * x + depth * depth), 1.0f));
+        const float limit = 0.5f * PI - 1.0e-4f;
+        return glm::vec2(std::tan(std::max(center - halfAngle, -limit)), std::tan(std::min(center + halfAngle, limit)));
+    }
+
+    LightBounds lightBounds(const glm::vec4 &center, float radius, const glm::mat4 &projMatrix, float near) const {
+        LightBounds b = { glm::ivec2(0), glm::ivec2(kClusterTilesX - 1, kClusterTilesY - 1), 1, 0 };
+        const float depth = -center.z;
+        if (depth + radius <= near)
+            return b; // Behind the camera
+        if (depth - radius > near) {
+            // Projected extent on each axis, in normalized device coordinates
+            const glm::vec2 x = projMatrix[0][0] * tangentBounds(center.x, depth, radius);
+            const glm::vec2 y = projMatrix[1][1] * tangentBounds(center.y, depth, radius);
+            if (x.y < -1.0f || x.x > 1.0f || y.y < -1.0f || y.x > 1.0f)
+                return b;
+            const glm::vec2 tiles(kClusterTilesX, kClusterTilesY);
+            const glm::vec2 lo = glm::floor((glm::vec2(x.x, y.x) * 0.5f + 0.5f) * tiles);
+            const glm::vec2 hi = glm::floor((glm::vec2(x.y, y.y) * 0.5f + 0.5f) * tiles);
+            b.minTile = glm::clamp(glm::ivec2(lo), glm::ivec2(0), glm::ivec2(tiles) - 1);
+            b.maxTile = glm::clamp(glm::ivec2(hi), glm::ivec2(0), glm::ivec2(tiles) - 1);
+        }
+        b.minSlice = slice(std::max(depth - radius, near));
+        b.maxSlice = slice(depth + radius);
+        return b;
+    }
+
+    TextureHandle m_textures[2]; // Lights (RGBA32F), cluster words and indices (R32UI)
+    unsigned int m_attachedGeneration; // Of the stream buffer the textures read, 0: none
+    size_t m_maxTexels;
+    bool m_active;               // Lights streamed for this frame
+    int m_lightTexel, m_clusterTexel; // Where this frame's data starts, in texels
+    float m_depthScale, m_depthBias;  // Slice = log(view depth) * scale + bias
+    glm::vec2 m_tileScale;            // Tiles per pixel
+    Stats m_frame;
+};
+
+LightClusters g_lightClusters;
+
+//------------------------------------------------------------------------------
+// Startup graph
+//------------------------------------------------------------------------------
+
+// Start of the process, to report when the first frame is shown
+const std::chrono::steady_clock::time_point g_processStart = std::chrono::steady_clock::now();
+
+// init() as a dependency graph. CPU tasks go to the job system as soon as their
+// dependencies are done (a finishing CPU task launches the ones it unblocked);
+// context tasks (GLFW, GL) run one at a time, in the order they were added, on
+// the thread that calls run(), which helps with the CPU tasks while no context
+// task is ready. Every task is timed for the trace.
+class StartupGraph {
+public:
+    typedef std::function<void()> Function;
+
+    StartupGraph() : m_jobsInFlight(0), m_totalMs(0.0) {}
+
+    int add(const char *name, bool onContextThread, const Function &function, std::initializer_list<int> dependencies = {}) {
+        Task task;
+        task.name = name;
+        task.onContextThread = onContextThread;
+        task.function = function;
+        task.dependencies.assign(dependencies.begin(), dependencies.end());
+        task.startMs = task.endMs = 0.0;
+        task.worker = 0;
+        task.contextPredecessor = -1;
+        m_tasks.push_back(task);
+        return static_cast<int>(m_tasks.size() - 1);
+    }
+
+    void run() {
+        m_origin = std::chrono::steady_clock::now();
+        m_started.reset(new std::atomic<bool>[m_tasks.size()]);
+        m_done.reset(new std::atomic<bool>[m_tasks.size()]);
+        for (size_t i = 0; i < m_tasks.size(); ++i)
+            m_started[i] = m_done[i] = false;
+
+        int lastContextTask = -1;
+        for (;;) {
+            launchReadyTasks();
+            bool allDone = true;
+            int readyContextTask = -1;
+            for (size_t i = 0; i < m_tasks.size(); ++i) {
+                allDone = allDone && m_done[i];
+                if (readyContextTask < 0 && m_tasks[i].onContextThread && !m_started[i] && dependenciesDone(i))
+                    readyContextTask = static_cast<int>(i);
+            }
+            if (allDone && m_jobsInFlight.load() == 0)
+                break; // No job refers to the graph any more: the caller may destroy it
+
+            if (readyContextTask >= 0) {
+                m_started[readyContextTask] = true;
+                m_tasks[readyContextTask].contextPredecessor = lastContextTask;
+                execute(readyContextTask);
+                lastContextTask = readyContextTask;
+            } else if (!g_jobs.runPendingJob()) {
+                std::this_thread::yield();
+            }
+        }
+        m_totalMs = elapsedSince(m_origin);
+    }
+
+    // Per-task timeline, then the critical path: from the task that finished
+    // last, repeatedly step to whichever of its dependencies (or, for a context
+    // task, the context task before it) finished last
+    void printTrace() const {
+        std::vector<bool> critical(m_tasks.size(), false);
+        int last = -1;
+        for (size_t i = 0; i < m_tasks.size(); ++i)
+            if (last < 0 || m_tasks[i].endMs > m_tasks[last].endMs)
+                last = static_cast<int>(i);
+        std::string path;
+        for (int t = last; t >= 0;) {
+            critical[t] = true;
+            path = std::string(m_tasks[t].name) + (path.empty() ? "" : " > ") + path;
+            int predecessor = m_tasks[t].contextPredecessor;
+            for (size_t d = 0; d < m_tasks[t].dependencies.size(); ++d) {
+                const int dependency = m_tasks[t].dependencies[d];
+                if (predecessor < 0 || m_tasks[dependency].endMs > m_tasks[predecessor].endMs)
+                    predecessor = dependency;
+            }
+            t = predecessor;
+        }
+
+        std::printf("Startup trace (ms)          thread    start      end     time\n");
+        for (size_t i = 0; i < m_tasks.size(); ++i) {
+            const Task &task = m_tasks[i];
+            char thread[16];
+            if (task.onContextThread)
+                std::snprintf(thread, sizeof(thread), "context");
+            else
+                std::snprintf(thread, sizeof(thread), "worker %d", task.worker);
+            std::printf("  %-25s %-8s %8.1f %8.1f %8.1f %s\n", task.name, thread, task.startMs, task.endMs,
+                        task.endMs - task.startMs, critical[i] ? "*" : "");
+        }
+        std::printf("Startup took %.1f ms; critical path (*): %s\n", m_totalMs, path.c_str());
+        std::fflush(stdout);
+    }
+
+private:
+    struct Task {
+        const char *name;
+        bool onContextThread;
+        Function function;
+        std::vector<int> dependencies;
+        double startMs, endMs;
+        int worker;
+        int contextPredecessor; // Context task that ran just before (context tasks are serialized)
+    };
+
+    static double elapsedSince(const std::chrono::steady_clock::time_point &origin) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - origin).count();
+    }
+
+    void execute(size_t i) {
+        Task &task = m_tasks[i];
+        task.worker = JobSystem::currentWorkerIndex();
+        task.startMs = elapsedSince(m_origin);
+        task.function();
+        task.endMs = elapsedSince(m_origin);
+        m_done[i] = true;
+    }
+
+    static void taskJob(JobSystem::Job &job) {
+        StartupGraph &graph = *static_cast<StartupGraph *>(const_cast<void *>(job.data));
+        graph.execute(job.begin);
+        graph.launchReadyTasks();
+        --graph.m_jobsInFlight; // Last use of the graph
+    }
+
+    // Queue the CPU tasks whose dependencies are done; callable from any worker
+    void launchReadyTasks() {
+        for (size_t i = 0; i < m_tasks.size(); ++i) {
+            if (m_tasks[i].onContextThread || m_started[i] || !dependenciesDone(i) || m_started[i].exchange(true))
+                continue;
+            ++m_jobsInFlight;
+            g_jobs.run(g_jobs.createJob(&StartupGraph::taskJob, this, nullptr, i, i + 1));
+        }
+    }
+
+    bool dependenciesDone(size_t i) const {
+        for (size_t d = 0; d < m_tasks[i].dependencies.size(); ++d)
+            if (!m_done[m_tasks[i].dependencies[d]])
+                return false;
+        return true;
+    }
+
+    std::vector<Task> m_tasks; // Not modified while running: jobs refer to it
+    std::unique_ptr<std::atomic<bool>[]> m_started;
+    std::unique_ptr<std::atomic<bool>[]> m_done;
+    std::atomic<int> m_jobsInFlight; // Task jobs queued or running, which run() waits for
+    std::chrono::steady_clock::time_point m_origin;
+    double m_totalMs;
+};
 
 void init() {
-    initGLFW();
-    initOpenGL();
-    initCPUgeometry();
-    initGPUprogram();
-    initGPUgeometry();
-    initCamera();
-    initTextures();
+    g_jobs.start();
+
+    // Handed over from the CPU tasks to the context tasks
+    Mesh sphere, ring;
+    std::vector<DecodedImage> bodyImages, ringImages;
+
+    StartupGraph graph;
+    const int assets = graph.add("open asset archive", false, openAssets);
+    const int window = graph.add("create window", true, initGLFW);
+    const int context = graph.add("load GL", true, initOpenGL, { window });
+    graph.add("build scene", false, [] { buildScene(g_scenario); });
+    const int sphereMesh = graph.add("sphere mesh", false, [&] { sphere = Mesh::genSphere(16); });
+    const int ringMesh = graph.add("ring mesh", false, [&] { ring = genRingMesh(); });
+    const int bodyDecode = graph.add("decode body textures", false,
+                                     [&] { bodyImages = decodeImages(kBodyTextureFiles); }, { assets });
+    const int ringDecode = graph.add("decode ring profile", false,
+                                     [&] { ringImages = decodeImages(kRingProfileFiles); }, { assets });
+    const int starRead = graph.add("read star catalog", false, [] { g_stars.load("stars.bin"); }, { assets });
+    const int atmosphere = graph.add("atmosphere tables", false, [] { g_atmosphere.build(kEarthAtmosphere); });
+    graph.add("compile programs", true, initGPUprogram, { context, assets });
+    graph.add("upload geometry", true, [&] { initGPUgeometry(sphere, ring); },
+              { context, sphereMesh, ringMesh });
+    graph.add("camera", true, initCamera, { window });
+    graph.add("render target", true, initRenderTarget, { context });
+    graph.add("exposure meter", true, [] { g_exposureMeter.init(); }, { context });
+    const int stream = graph.add("stream ring", true, [] { g_stream.init(kStreamRegionBytes); }, { context });
+    graph.add("light clusters", true, [] { g_lightClusters.init(); }, { context, stream });
+    graph.add("upload body textures", true, [&] { initTextures(bodyImages); }, { context, bodyDecode });
+    graph.add("upload ring profile", true, [&] { initRingProfile(ringImages); }, { context, ringDecode });
+    graph.add("upload star catalog", true, [] { g_stars.init(); }, { context, starRead });
+    const int environment = graph.add("environment lighting", false, [] { g_environment.build(g_stars); }, { starRead });
+    graph.add("upload environment", true, [] { g_environment.init(); }, { context, environment });
+    graph.add("upload atmosphere tables", true, [] { g_atmosphere.init(); }, { context, atmosphere });
+    graph.run();
+    graph.printTrace();
 
     glfwSetTime(0.0);
 }
 
+// Destroy released resources the GPU is done with; called once per frame
+void collectGpuGarbage(bool waitForGpu = false) {
+    g_meshes.collectGarbage(waitForGpu);
+    g_textures.collectGarbage(waitForGpu);
+    g_programs.collectGarbage(waitForGpu);
+}
+
 void clear() {
-    glDeleteProgram(g_program);
-    glDeleteProgram(skyboxProgram);
+    shutdownTextureResidency();
+    g_exposureMeter.destroy();
+    shutdownRenderTarget();
+    g_programs.release(g_program);
+    g_programs.release(upscaleProgram);
+    g_programs.release(g_bloomDownProgram);
+    g_programs.release(g_bloomUpProgram);
+    g_programs.release(g_luminanceProgram);
+    g_programs.release(g_impostorProgram);
+    g_programs.release(g_pointProgram);
+    g_programs.release(g_ringProgram);
+    g_programs.release(g_atmosphereProgram);
+    g_programs.release(g_starProgram);
+    g_meshes.release(g_sphereMesh);
+    g_meshes.release(g_ringMesh);
+    g_meshes.release(g_impostorMesh);
+    g_meshes.release(g_pointMesh);
+    g_textures.release(g_ringProfile);
+    g_atmosphere.destroy();
+    g_environment.destroy();
+    g_lightClusters.destroy();
+    shutdownMaterials();
+    collectGpuGarbage(true);
+    g_geometry.destroy();
+    g_stars.destroy();
+    g_stream.destroy();
+
+    // Whatever is still alive was never released
+    const size_t leaks = g_meshes.reportLeaks() + g_textures.reportLeaks() + g_programs.reportLeaks();
+    if (leaks > 0)
+        std::cerr << leaks << " GPU resource(s) leaked" << std::endl;
 
     glfwDestroyWindow(g_window);
     glfwTerminate();
+
+    g_jobs.stop();
+}
+
+// Angle reached after t seconds by a motion of the given period (0 means static)
+inline float periodicAngle(float t, float period) {
+    return period != 0.0f ? (t / period) * 2.0f * PI : 0.0f;
+}
+
+// World matrix of body i at simulation time t (its parent must be up to date)
+void updateBody(const size_t i, const float t) {
+    const Body &body = g_bodies[i];
+    glm::mat4 local = glm::rotate(glm::mat4(1.0f), body.orbitInclination, glm::vec3(1.0f, 0.0f, 0.0f)) *
+                      glm::rotate(glm::mat4(1.0f), body.orbitPhase + periodicAngle(t, body.orbitPeriod), glm::vec3(0.0f, 1.0f, 0.0f)) *
+                      glm::translate(glm::mat4(1.0f), glm::vec3(body.orbitRadius, 0.0f, 0.0f)) *
+                      glm::rotate(glm::mat4(1.0f), periodicAngle(t, body.rotationPeriod), glm::vec3(0.0f, 1.0f, 0.0f)) *
+                      glm::scale(glm::mat4(1.0f), glm::vec3(body.size));
+
+    // Apply the parent's transformation (e.g. Earth's for the Moon)
+    g_bodyWorldMats[i] = body.parent >= 0 ? g_bodyWorldMats[body.parent] * local : local;
+}
+
+// Position and range of each point light at simulation time t, from the world
+// matrices of the bodies they orbit (center and radius only: not their spin)
+void updateLights(const float t) {
+    g_lightSpheres.resize(g_lights.size());
+    for (size_t i = 0; i < g_lights.size(); ++i) {
+        const PointLight &light = g_lights[i];
+        const glm::mat4 &world = g_bodyWorldMats[light.body];
+        const float radius = glm::length(glm::vec3(world[0]));
+        const glm::mat4 orbit = glm::rotate(glm::mat4(1.0f), light.orbitInclination, glm::vec3(1.0f, 0.0f, 0.0f)) *
+                                glm::rotate(glm::mat4(1.0f), light.orbitPhase + periodicAngle(t, light.orbitPeriod),
+                                            glm::vec3(0.0f, 1.0f, 0.0f));
+        const glm::vec3 offset = glm::vec3(orbit * glm::vec4(light.orbitRadius * radius, 0.0f, 0.0f, 0.0f));
+        g_lightSpheres[i] = glm::vec4(glm::vec3(world[3]) + offset, light.range * radius);
+    }
+}
+
+// Compute every body's world matrix at simulation time t. Bodies only depend on
+// shallower ones, so each depth level is one parallel pass. The lights follow.
+void updateBodies(const float t) {
+    for (int depth = 0; depth <= g_maxBodyDepth; ++depth) {
+        g_jobs.parallelFor(0, g_bodies.size(), 256, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                if (g_bodies[i].depth == depth)
+                    updateBody(i, t);
+            }
+        });
+    }
+    updateLights(t);
+}
+
+// Frustum culling of the bodies' bounding spheres, in parallel; fills g_bodyVisible
+void cullBodies(const glm::mat4 &viewProj) {
+    // Planes (left, right, bottom, top, near, far) from the rows of the view-projection matrix
+    const glm::mat4 m = glm::transpose(viewProj);
+    glm::vec4 planes[6] = { m[3] + m[0], m[3] - m[0], m[3] + m[1], m[3] - m[1], m[3] + m[2], m[3] - m[2] };
+    for (int p = 0; p < 6; ++p)
+        planes[p] /= glm::length(glm::vec3(planes[p]));
+
+    g_bodyVisible.resize(g_bodies.size());
+    g_jobs.parallelFor(0, g_bodies.size(), 1024, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const glm::mat4 &world = g_bodyWorldMats[i];
+            const glm::vec4 center = world[3];
+            // Rings reach kRingOuterRadius out from the center, in the planet's frame, and
+            // atmospheres their top radius
+            const AtmosphereParams &air = g_atmosphere.getParams();
+            const float radius = glm::length(glm::vec3(world[0])) *
+                                 (g_bodies[i].hasRing ? std::max(1.0f, kRingOuterRadius) : 1.0f) *
+                                 (g_bodies[i].hasAtmosphere ? air.topRadius / air.bottomRadius : 1.0f);
+            bool visible = true;
+            for (int p = 0; p < 6 && visible; ++p)
+                visible = glm::dot(planes[p], center) > -radius;
+            g_bodyVisible[i] = visible ? 1 : 0;
+        }
+    });
+}
+
+//------------------------------------------------------------------------------
+// Eclipse shadows
+//------------------------------------------------------------------------------
+
+// Bodies shadow each other analytically, without shadow maps: the fragment
+// shaders compute, for each occluder of the body drawn, the share of the Sun's
+// disk it hides (penumbra included). Every frame the CPU lists, per visible
+// receiver, the bodies whose penumbra cone can reach it, into one uniform block
+// streamed with the draws. Only planets and moons take part, within a family (a
+// planet and its moons): ring particles and asteroids are too small to matter and
+// would make the pairs quadratic.
+const int kMaxOccludersPerBody = 4;  // Loop bound of the shaders
+const int kShadowListCapacity = 256; // Spheres in the Occluders block of lighting.glsl, the Sun first
+
+// Whether the penumbra of the occluder sphere, lit by the sun sphere, reaches the receiver sphere
+inline bool canShadow(const glm::vec4 &sun, const glm::vec4 &occluder, const glm::vec4 &receiver) {
+    const glm::vec3 fromSun = glm::vec3(occluder) - glm::vec3(sun);
+    const float sunDistance = glm::length(fromSun);
+    if (sunDistance <= sun.w + occluder.w)
+        return false;
+    const glm::vec3 axis = fromSun / sunDistance;
+    const glm::vec3 offset = glm::vec3(receiver) - glm::vec3(occluder);
+    const float along = glm::dot(offset, axis);
+    if (along <= -receiver.w)
+        return false; // Sunward of the occluder
+    const float penumbraRadius = occluder.w + std::max(along, 0.0f) * (sun.w + occluder.w) / sunDistance;
+    return glm::length(offset - along * axis) < penumbraRadius + receiver.w;
+}
+
+inline bool castsShadows(const Body &body) { return body.kind == BODY_PLANET || body.kind == BODY_MOON; }
+
+// Set in the shadow list of the draws of ringed planets, shaded by their rings too,
+// and of bodies with an atmosphere, lit through it
+const uint32_t kRingShadowFlag = 1u << 31;
+const uint32_t kAtmosphereFlag = 1u << 30;
+
+// Fill occluders (up to capacity spheres: center, radius; the Sun first) and
+// return, per body, its list in them as first | count << 24 (0: unshadowed),
+// first counted after the Sun like the shaders' occluders array; null if there is no Sun
+uint32_t *buildShadowLists(glm::vec4 *occluders, size_t capacity) {
+    const size_t bodyCount = g_bodies.size();
+    int sunIndex = -1;
+    for (size_t i = 0; i < bodyCount && sunIndex < 0; ++i)
+        if (g_bodies[i].kind == BODY_STAR)
+            sunIndex = static_cast<int>(i);
+    if (sunIndex < 0 || !occluders)
+        return nullptr;
+    auto sphereOf = [](size_t i) {
+        const glm::mat4 &world = g_bodyWorldMats[i];
+        return glm::vec4(glm::vec3(world[3]), glm::length(glm::vec3(world[0])));
+    };
+    const glm::vec4 sun = sphereOf(sunIndex);
+    occluders[0] = sun;
+
+    // Moons of each body, grouped by parent (counting sort)
+    uint32_t *moonStart = g_frameArena.allocateArray<uint32_t>(bodyCount + 1);
+    uint32_t *moons = g_frameArena.allocateArray<uint32_t>(bodyCount);
+    std::fill(moonStart, moonStart + bodyCount + 1, 0u);
+    for (size_t i = 0; i < bodyCount; ++i)
+        if (g_bodies[i].kind == BODY_MOON && g_bodies[i].parent >= 0)
+            ++moonStart[g_bodies[i].parent + 1];
+    for (size_t i = 0; i < bodyCount; ++i)
+        moonStart[i + 1] += moonStart[i];
+    uint32_t *next = g_frameArena.allocateArray<uint32_t>(bodyCount);
+    std::copy(moonStart, moonStart + bodyCount, next);
+    for (size_t i = 0; i < bodyCount; ++i)
+        if (g_bodies[i].kind == BODY_MOON && g_bodies[i].parent >= 0)
+            moons[next[g_bodies[i].parent]++] = static_cast<uint32_t>(i);
+
+    uint32_t *lists = g_frameArena.allocateArray<uint32_t>(bodyCount);
+    std::fill(lists, lists + bodyCount, 0u);
+    size_t used = 1;
+    for (size_t i = 0; i < bodyCount && used < capacity; ++i) {
+        const Body &body = g_bodies[i];
+        if (!g_bodyVisible[i] || !castsShadows(body))
+            continue;
+        // The family: a planet and its moons
+        const size_t planet = body.kind == BODY_MOON && body.parent >= 0 ? static_cast<size_t>(body.parent) : i;
+        const glm::vec4 receiver = sphereOf(i);
+        size_t count = 0;
+        auto consider = [&](size_t candidate) {
+            if (candidate == i || count == kMaxOccludersPerBody || used + count == capacity ||
+                !castsShadows(g_bodies[candidate]))
+                return;
+            const glm::vec4 occluder = sphereOf(candidate);
+            if (canShadow(sun, occluder, receiver))
+                occluders[used + count++] = occluder;
+        };
+        consider(planet);
+        for (uint32_t m = moonStart[planet]; m < moonStart[planet + 1]; ++m)
+            consider(moons[m]);
+        if (count > 0) {
+            lists[i] = static_cast<uint32_t>(used - 1) | static_cast<uint32_t>(count << 24);
+            used += count;
+        }
+    }
+    return lists;
+}
+
+//--------------------------------------------------------------------------------
+// Render queue
+//--------------------------------------------------------------------------------
+// Workers emit one packet per draw with a 64-bit sort key; the packets are radix
+// sorted and executed on the GL thread, which only changes the state that differs
+// from the previous packet. Key fields, most significant first:
+//   opaque, sky:  pass(2) program(4) texture(8) mesh(4) depth(24) body(22)
+//   transparent:  pass(2) ~depth(24) program(4) texture(8) mesh(4) body(22)
+// where texture is the body texture array (materials sharing one draw together)
+// so opaque draws are grouped by state and front-to-back within a group (early-z),
+// transparent ones back-to-front. Depth is log2(1 + distance) over the far range.
+//
+// Each body is drawn at one of three tiers, by its diameter on screen: the sphere
+// mesh; above the point threshold and below the impostor one, a camera-facing
+// quad in which the fragment shader ray-casts the exact sphere (depth, normal and
+// texture coordinates included); below the point threshold, a point that carries
+// the disk-averaged light of the sphere, blended with its coverage as alpha.
+// Points do not write depth, so they go after the sky and before the rings.
+// The sky is one packet that draws the star catalog (see StarField::draw).
+//
+// Rings are a box around the ring slab (12 triangles, the far faces drawn so that
+// the camera may be inside) in which the fragment shader ray-marches the slab:
+// the radial profile gives color and opacity, with as many samples as the ray
+// crosses radial detail, so they keep their thickness edge-on. The planet hides
+// and shadows them analytically, and they shadow the planet (ringTransmittance in
+// the body shaders).
+//
+// Atmospheres are a camera-facing quad around their top (the whole screen once the
+// camera is inside) whose shader adds the light scattered along the view ray and
+// attenuates, by dual-source blending, what lies behind (see Atmospheric scattering).
+
+enum RenderPass { PASS_OPAQUE, PASS_SKY, PASS_POINTS, PASS_TRANSPARENT }; // Execution order
+enum RenderProgram {
+    RENDER_PROGRAM_BODY, RENDER_PROGRAM_IMPOSTOR, RENDER_PROGRAM_POINT, RENDER_PROGRAM_STARS, RENDER_PROGRAM_RING,
+    RENDER_PROGRAM_ATMOSPHERE
+};
+enum RenderMesh { RENDER_MESH_SPHERE, RENDER_MESH_RING, RENDER_MESH_QUAD, RENDER_MESH_POINT, RENDER_MESH_STARS };
+const unsigned int kNoTexture = 0xfe; // Texture key value past the arrays
+
+struct DrawPacket {
+    uint64_t key;
+    uint32_t body; // Index in g_bodies (unused by the sky)
+};
+
+const int kDepthBits = 24;
+const int kBodyBits = 22;
+
+inline uint64_t makeSortKey(RenderPass pass, RenderProgram program, unsigned int texture,
+                            RenderMesh mesh, uint32_t depth, uint32_t body) {
+    const uint64_t state = (uint64_t(program) << 12) | (uint64_t(texture & 0xff) << 4) | uint64_t(mesh);
+    const uint64_t bodyBits = body & ((1u << kBodyBits) - 1);
+    if (pass == PASS_TRANSPARENT) {
+        const uint64_t farFirst = (~depth) & ((1u << kDepthBits) - 1);
+        return (uint64_t(pass) << 62) | (farFirst << 38) | (state << kBodyBits) | bodyBits;
+    }
+    return (uint64_t(pass) << 62) | (state << 46) | (uint64_t(depth) << kBodyBits) | bodyBits;
+}
+
+inline RenderPass keyPass(uint64_t key) { return static_cast<RenderPass>(key >> 62); }
+inline uint64_t keyState(uint64_t key) {
+    return keyPass(key) == PASS_TRANSPARENT ? (key >> kBodyBits) & 0xffff : (key >> 46) & 0xffff;
+}
+inline RenderProgram keyProgram(uint64_t key) { return static_cast<RenderProgram>(keyState(key) >> 12); }
+inline unsigned int keyTexture(uint64_t key) { return (keyState(key) >> 4) & 0xff; }
+
+// Texture key of a material slot: its array, or kNoTexture
+inline unsigned int materialTextureKey(int material) {
+    const int array = g_materialTable[material].array;
+    return array >= 0 ? static_cast<unsigned int>(array) : kNoTexture;
+}
+inline RenderMesh keyMesh(uint64_t key) { return static_cast<RenderMesh>(keyState(key) & 0xf); }
+
+// Distance from the camera quantized on a log scale to kDepthBits
+inline uint32_t quantizeDepth(float distance, float logDepthScale) {
+    const float depth = glm::clamp(std::log2(1.0f + distance) * logDepthScale, 0.0f, 1.0f);
+    return static_cast<uint32_t>(depth * float((1u << kDepthBits) - 1));
+}
+
+// LSD radix sort on 8-bit digits; digits equal for every key are skipped.
+// Stable, so packets with equal keys keep their emission order.
+DrawPacket *radixSort(DrawPacket *packets, DrawPacket *scratch, size_t count) {
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t offsets[256] = { 0 };
+        for (size_t i = 0; i < count; ++i)
+            ++offsets[(packets[i].key >> shift) & 0xff];
+        if (count == 0 || offsets[(packets[0].key >> shift) & 0xff] == count)
+            continue;
+        size_t sum = 0;
+        for (int d = 0; d < 256; ++d) {
+            const size_t n = offsets[d];
+            offsets[d] = sum;
+            sum += n;
+        }
+        for (size_t i = 0; i < count; ++i)
+            scratch[offsets[(packets[i].key >> shift) & 0xff]++] = packets[i];
+        std::swap(packets, scratch);
+    }
+    return packets;
+}
+
+// Diameters on screen, in pixels, below which bodies become impostors and points
+// (--impostor-px, --point-px; 0 disables a tier)
+float g_impostorPixels = 48.0f;
+float g_pointPixels = 1.0f;
+
+// Bodies drawn at each tier by the last frame
+struct TierCounts {
+    unsigned int meshes;
+    unsigned int impostors;
+    unsigned int points;
+};
+TierCounts g_tierCounts = { 0, 0, 0 };
+
+enum BodyTier { TIER_MESH, TIER_IMPOSTOR, TIER_POINT };
+
+// Tier of a sphere from its apparent diameter. pixelScale converts the tangent of
+// an angle from the view axis to pixels (viewport height / 2 * projection[1][1]).
+inline BodyTier selectTier(float radius, float distance, float pixelScale) {
+    if (distance <= radius)
+        return TIER_MESH;
+    const float diameterPixels = 2.0f * pixelScale * radius / std::sqrt(distance * distance - radius * radius);
+    if (diameterPixels < g_pointPixels)
+        return TIER_POINT;
+    return diameterPixels < g_impostorPixels ? TIER_IMPOSTOR : TIER_MESH;
+}
+
+// Ring model matrix: the planet's frame tilted about its X axis
+inline glm::mat4 ringModelMatrix(const glm::mat4 &bodyWorld) {
+    return glm::rotate(bodyWorld, glm::radians(kRingTiltDegrees), glm::vec3(1.0f, 0.0f, 0.0f));
+}
+
+// Emit the packets of the visible bodies (and their rings and atmospheres) in
+// parallel, each at its tier. Each chunk reserves its slots with one atomic add. Returns the packet count.
+size_t buildRenderQueue(DrawPacket *packets, const glm::vec3 &camPosition, float logDepthScale, float pixelScale) {
+    std::atomic<size_t> packetCount(0);
+    std::atomic<unsigned int> tierCounts[3];
+    for (int t = 0; t < 3; ++t)
+        tierCounts[t] = 0;
+    const bool drawsRings = ringsAvailable();
+    const bool drawsAtmospheres = g_atmosphere.isReady();
+    uint8_t *tiers = g_frameArena.allocateArray<uint8_t>(g_bodies.size()); // Picked when counting, used when emitting
+    g_jobs.parallelFor(0, g_bodies.size(), 1024, [&](size_t begin, size_t end) {
+        unsigned int chunkTiers[3] = { 0, 0, 0 };
+        size_t count = 0;
+        for (size_t i = begin; i < end; ++i) {
+            if (!g_bodyVisible[i])
+                continue;
+            const glm::mat4 &world = g_bodyWorldMats[i];
+            const float distance = glm::distance(glm::vec3(world[3]), camPosition);
+            const BodyTier tier = selectTier(glm::length(glm::vec3(world[0])), distance, pixelScale);
+            tiers[i] = static_cast<uint8_t>(tier);
+            ++chunkTiers[tier];
+            count += 1 + ((g_bodies[i].hasRing && drawsRings && tier != TIER_POINT) ? 1 : 0) +
+                     ((g_bodies[i].hasAtmosphere && drawsAtmospheres && tier != TIER_POINT) ? 1 : 0);
+        }
+        for (int t = 0; t < 3; ++t)
+            tierCounts[t] += chunkTiers[t];
+
+        size_t slot = packetCount.fetch_add(count);
+        for (size_t i = begin; i < end; ++i) {
+            if (!g_bodyVisible[i])
+                continue;
+            const Body &body = g_bodies[i];
+            const float distance = glm::distance(glm::vec3(g_bodyWorldMats[i][3]), camPosition);
+            const uint32_t depth = quantizeDepth(distance, logDepthScale);
+            const uint32_t index = static_cast<uint32_t>(i);
+            const unsigned int texture = materialTextureKey(body.material);
+            switch (static_cast<BodyTier>(tiers[i])) {
+            case TIER_MESH:
+                packets[slot].key = makeSortKey(PASS_OPAQUE, RENDER_PROGRAM_BODY, texture, RENDER_MESH_SPHERE, depth, index);
+                break;
+            case TIER_IMPOSTOR:
+                packets[slot].key = makeSortKey(PASS_OPAQUE, RENDER_PROGRAM_IMPOSTOR, texture, RENDER_MESH_QUAD, depth, index);
+                break;
+            case TIER_POINT:
+                packets[slot].key = makeSortKey(PASS_POINTS, RENDER_PROGRAM_POINT, texture, RENDER_MESH_POINT, depth, index);
+                packets[slot++].body = index;
+                continue; // Neither are the rings and atmosphere of a sub-pixel planet
+            }
+            packets[slot++].body = index;
+            if (body.hasRing && drawsRings) {
+                packets[slot].key = makeSortKey(PASS_TRANSPARENT, RENDER_PROGRAM_RING, kNoTexture, RENDER_MESH_RING,
+                                                depth, index);
+                packets[slot++].body = index;
+            }
+            if (body.hasAtmosphere && drawsAtmospheres) {
+                packets[slot].key = makeSortKey(PASS_TRANSPARENT, RENDER_PROGRAM_ATMOSPHERE, kNoTexture,
+                                                RENDER_MESH_QUAD, depth, index);
+                packets[slot++].body = index;
+            }
+        }
+    });
+    g_tierCounts.meshes = tierCounts[TIER_MESH].load();
+    g_tierCounts.impostors = tierCounts[TIER_IMPOSTOR].load();
+    g_tierCounts.points = tierCounts[TIER_POINT].load();
+    return packetCount.load();
+}
+
+// Fixed-function state of each pass
+void applyPassState(RenderPass pass) {
+    switch (pass) {
+    case PASS_OPAQUE:
+        g_gl.setEnabled(GL_CULL_FACE, true);
+        g_gl.cullFace(GL_BACK);
+        g_gl.depthFunc(GL_GREATER);
+        break;
+    case PASS_SKY:
+        // Stars are at depth 0, behind everything, and add up where they overlap
+        g_gl.depthFunc(GL_GEQUAL);
+        g_gl.depthMask(false);
+        g_gl.setEnabled(GL_BLEND, true);
+        g_gl.blendFunc(GL_ONE, GL_ONE);
+        break;
+    case PASS_POINTS:
+        g_gl.depthFunc(GL_GREATER);
+        g_gl.depthMask(false);
+        g_gl.setEnabled(GL_BLEND, true);
+        g_gl.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        break;
+    case PASS_TRANSPARENT:
+        // Culling and blending depend on the program (applyProgramState)
+        g_gl.depthFunc(GL_GREATER);
+        g_gl.depthMask(false);
+        g_gl.setEnabled(GL_BLEND, true);
+        break;
+    }
+}
+
+// Fixed-function state of the transparent programs
+void applyProgramState(RenderProgram program) {
+    switch (program) {
+    case RENDER_PROGRAM_RING:
+        // Ring boxes draw their far faces, and their shader the depth of the ring
+        g_gl.setEnabled(GL_CULL_FACE, true);
+        g_gl.cullFace(GL_FRONT);
+        g_gl.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        break;
+    case RENDER_PROGRAM_ATMOSPHERE:
+        // In-scattered light added, what lies behind times the transmittance (second output)
+        g_gl.setEnabled(GL_CULL_FACE, false);
+        g_gl.blendFunc(GL_ONE, GL_SRC1_COLOR);
+        break;
+    default:
+        break;
+    }
+}
+
+void restoreDefaultState() {
+    g_gl.setEnabled(GL_CULL_FACE, true);
+    g_gl.cullFace(GL_BACK);
+    g_gl.depthFunc(GL_GREATER);
+    g_gl.depthMask(true);
+    g_gl.setEnabled(GL_BLEND, false);
+}
+
+// Run the sorted packets. Pass state, program and texture array change only where
+// they differ from the previous packet; the draws of each run sharing them go out
+// as one multi-draw (or a base-vertex loop) from the geometry arena, whose
+// instances and commands (count of each) the caller reserved with beginDraws.
+void executeRenderQueue(const DrawPacket *packets, size_t count, const glm::mat4 &viewMatrix,
+                        const glm::mat4 &projMatrix, float logDepthScale, float pixelScale, float emissiveIntensity,
+                        const uint32_t *shadowLists, DrawInstance *instances, DrawElementsIndirectCommand *commands) {
+    const GLuint programs[] = { programId(g_program), programId(g_impostorProgram), programId(g_pointProgram),
+                                programId(g_starProgram), programId(g_ringProgram), programId(g_atmosphereProgram) };
+    const Mesh *meshes[] = { g_meshes.get(g_sphereMesh), g_meshes.get(g_ringMesh), g_meshes.get(g_impostorMesh),
+                             g_meshes.get(g_pointMesh) }; // Stars come from the catalog, not the arena
+
+    g_gl.bindTexture(1, GL_TEXTURE_1D, textureId(g_ringProfile));
+    g_atmosphere.bind();
+    g_environment.bind();
+    g_lightClusters.bind();
+    const bool drawsRings = ringsAvailable();
+    const bool drawsAtmospheres = g_atmosphere.isReady();
+    for (size_t p = 0; p < count; ++p) {
+        const DrawPacket &packet = packets[p];
+        const RenderMesh mesh = keyMesh(packet.key);
+        if (mesh == RENDER_MESH_STARS) {
+            // Drawn from the catalog; an empty command keeps commands and packets aligned
+            const DrawElementsIndirectCommand none = { 0, 0, 0, 0, static_cast<GLuint>(p) };
+            commands[p] = none;
+            continue;
+        }
+        const glm::mat4 &world = g_bodyWorldMats[packet.body];
+        const Body &body = g_bodies[packet.body];
+        instances[p].model = mesh == RENDER_MESH_RING ? ringModelMatrix(world) : world;
+        instances[p].color = glm::vec4(body.color, 1.0f);
+        instances[p].material = body.material;
+        instances[p].shadows = 0;
+        if (mesh != RENDER_MESH_RING && keyProgram(packet.key) != RENDER_PROGRAM_ATMOSPHERE) {
+            instances[p].shadows = shadowLists ? shadowLists[packet.body] : 0;
+            if (body.hasRing && drawsRings)
+                instances[p].shadows |= kRingShadowFlag;
+            if (body.hasAtmosphere && drawsAtmospheres)
+                instances[p].shadows |= kAtmosphereFlag;
+        }
+        const GeometryRange &range = meshes[mesh]->getRange();
+        const DrawElementsIndirectCommand command = { range.indexCount, 1, range.firstIndex, range.baseVertex,
+                                                      static_cast<GLuint>(p) };
+        commands[p] = command;
+    }
+    g_geometry.endDraws();
+
+    int pass = -1, program = -1, texture = -1;
+    GLenum mode = GL_TRIANGLES;
+    size_t runStart = 0;
+    for (size_t p = 0; p < count; ++p) {
+        const DrawPacket &packet = packets[p];
+        const bool passChanged = keyPass(packet.key) != pass;
+        const bool programChanged = keyProgram(packet.key) != program;
+        const bool textureChanged = static_cast<int>(keyTexture(packet.key)) != texture;
+        if (!passChanged && !programChanged && !textureChanged)
+            continue;
+        g_geometry.draw(mode, instances, commands, runStart, p - runStart); // Flush the previous run
+        runStart = p;
+        mode = keyMesh(packet.key) == RENDER_MESH_POINT ? GL_POINTS : GL_TRIANGLES;
+
+        if (passChanged) {
+            pass = keyPass(packet.key);
+            applyPassState(static_cast<RenderPass>(pass));
+        }
+        if (programChanged) {
+            program = keyProgram(packet.key);
+            applyProgramState(static_cast<RenderProgram>(program));
+            if (program != RENDER_PROGRAM_STARS) {
+                // Mesh, impostor, point, ring and atmosphere programs share their uniforms
+                const GLuint bodyProgram = programs[program];
+                g_gl.useProgram(bodyProgram);
+                g_gl.uniformMatrix4fv(glGetUniformLocation(bodyProgram, "viewMat"), viewMatrix);
+                g_gl.uniformMatrix4fv(glGetUniformLocation(bodyProgram, "projMat"), projMatrix);
+                const glm::vec3 camPosition = g_camera.getPosition();
+                g_gl.uniform3fv(glGetUniformLocation(bodyProgram, "camPos"), camPosition);
+                const glm::vec3 lightPosition = glm::vec3(0.0f, 0.0f, 0.0f);
+                g_gl.uniform3fv(glGetUniformLocation(bodyProgram, "lightPos"), lightPosition);
+                g_gl.uniform1f(glGetUniformLocation(bodyProgram, "logDepthScale"), logDepthScale);
+                g_gl.uniform1f(glGetUniformLocation(bodyProgram, "emissiveIntensity"), emissiveIntensity);
+                if (program == RENDER_PROGRAM_POINT)
+                    g_gl.uniform1f(glGetUniformLocation(bodyProgram, "pixelScale"), pixelScale);
+                g_gl.uniform2f(glGetUniformLocation(bodyProgram, "ringRadii"), kRingInnerRadius, kRingOuterRadius);
+                g_gl.uniform1f(glGetUniformLocation(bodyProgram, "ringHalfThickness"), kRingHalfThickness);
+                g_gl.uniform3fv(glGetUniformLocation(bodyProgram, "ringAxis"),
+                                glm::vec3(ringModelMatrix(glm::mat4(1.0f))[1]));
+                const AtmosphereParams &air = g_atmosphere.getParams();
+                g_gl.uniform2f(glGetUniformLocation(bodyProgram, "atmosphereRadii"), air.bottomRadius, air.topRadius);
+                g_gl.uniform3fv(glGetUniformLocation(bodyProgram, "rayleighScattering"), air.rayleighScattering);
+                g_gl.uniform1f(glGetUniformLocation(bodyProgram, "miePhaseG"), air.miePhaseG);
+                g_gl.uniform3fv(glGetUniformLocation(bodyProgram, "ambientSH"), g_environment.getIrradianceSH(), 9);
+                g_lightClusters.setUniforms(bodyProgram);
+            } else {
+                // The whole catalog in one call; no run of arena draws follows
+                const GLuint stars = programs[RENDER_PROGRAM_STARS];
+                const glm::mat4 viewProjection = projMatrix * glm::mat4(glm::mat3(viewMatrix)); // Stars are at infinity
+                const float limit = g_stars.limitingMagnitude(g_camera.getFov());
+                g_gl.useProgram(stars);
+                g_gl.uniformMatrix4fv(glGetUniformLocation(stars, "viewProjection"), viewProjection);
+                g_gl.uniform1f(glGetUniformLocation(stars, "limitingMagnitude"), limit);
+                g_gl.uniform1f(glGetUniformLocation(stars, "maxPointSize"), kMaxStarPointSize);
+                g_stars.draw(viewProjection, limit);
+                g_gl.bindVertexArray(g_geometry.getVao()); // The runs that follow draw from the arena
+                runStart = p + 1;
+            }
+        }
+        if (textureChanged) {
+            texture = keyTexture(packet.key);
+            if (texture != static_cast<int>(kNoTexture))
+                g_gl.bindTexture(0, GL_TEXTURE_2D_ARRAY, textureId(g_textureArrays[texture]));
+        }
+    }
+    g_geometry.draw(mode, instances, commands, runStart, count - runStart);
+    restoreDefaultState();
 }
 
-void render() {
+// Draw the scene into the bound framebuffer, whose viewport is viewportHeight pixels
+// high; emissive bodies at emissiveIntensity (above 1 only into an HDR target)
+void render(int viewportHeight, float emissiveIntensity = kSunLdrIntensity) {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     const glm::mat4 viewMatrix = g_camera.computeViewMatrix();
     const glm::mat4 projMatrix = g_camera.computeProjectionMatrix();
+    cullBodies(projMatrix * viewMatrix);
+
+    // Worst case: every body is visible, ringed and with an atmosphere, plus the sky
+    const size_t capacity = 3 * g_bodies.size() + 1;
+    DrawPacket *packets = g_frameArena.allocateArray<DrawPacket>(capacity);
+    DrawPacket *scratch = g_frameArena.allocateArray<DrawPacket>(capacity);
+
+    const float logDepthScale = 1.0f / std::log2(1.0f + g_camera.getFar());
+    const float pixelScale = 0.5f * static_cast<float>(viewportHeight) * projMatrix[1][1];
+    size_t count = buildRenderQueue(packets, g_camera.getPosition(), logDepthScale, pixelScale);
+    packets[count].key = makeSortKey(PASS_SKY, RENDER_PROGRAM_STARS, kNoTexture, RENDER_MESH_STARS, 0, 0);
+    packets[count++].body = 0;
+
+    // Per-draw data and commands of the whole frame, handed over at once. Reserved
+    // first: the stream ring only grows within a frame on its first allocation.
+    DrawInstance *instances = nullptr;
+    DrawElementsIndirectCommand *commands = nullptr;
+    const bool drawsReserved = g_geometry.beginDraws(count, instances, commands);
+
+    // Occluder lists, streamed ahead of the draws and bound as the Occluders block
+    GLintptr occluderOffset = 0;
+    const size_t occluderBytes = kShadowListCapacity * sizeof(glm::vec4);
+    glm::vec4 *occluders = static_cast<glm::vec4 *>(
+        g_stream.allocate(occluderBytes, g_stream.getUniformAlignment(), occluderOffset));
+    const uint32_t *shadowLists = buildShadowLists(occluders, kShadowListCapacity);
+    g_lightClusters.build(viewMatrix, projMatrix, viewportHeight);
+    // Bound after the frame's allocations, every frame: a grown stream buffer may keep its name
+    if (occluders)
+        glBindBufferRange(GL_UNIFORM_BUFFER, kShadowBlockBinding, g_stream.getBuffer(), occluderOffset, occluderBytes);
+
+    packets = radixSort(packets, scratch, count);
+    if (drawsReserved)
+        executeRenderQueue(packets, count, viewMatrix, projMatrix, logDepthScale, pixelScale, emissiveIntensity,
+                           shadowLists, instances, commands);
+    g_stream.endFrame();
+}
+
+// Draw the scene at the current resolution scale into the offscreen HDR target,
+// bloom and meter it and upscale it, tone mapped, to the window; each pass is
+// timed on the GPU, the whole frame for the controller
+void renderFrame() {
+    RenderTarget &target = g_renderTarget;
+    if (g_windowWidth <= 0 || g_windowHeight <= 0)
+        return; // Minimized
+    if (target.width != g_windowWidth || target.height != g_windowHeight)
+        resizeRenderTarget(g_windowWidth, g_windowHeight);
+    updateResolutionScale();
+
+    const int slot = target.frame % kGpuTimerQueries;
+    GLuint *timestamps = target.timerQueries[slot];
+    glQueryCounter(timestamps[GPU_PASS_SCENE], GL_TIMESTAMP);
+
+    const int width = std::max(1, static_cast<int>(target.width * g_resolutionScale + 0.5f));
+    const int height = std::max(1, static_cast<int>(target.height * g_resolutionScale + 0.5f));
+    g_gl.bindFramebuffer(target.framebuffer);
+    g_gl.viewport(0, 0, width, height);
+    render(height, kSunEmissiveIntensity);
+    glQueryCounter(timestamps[GPU_PASS_BLOOM_DOWN], GL_TIMESTAMP);
+
+    g_gl.setEnabled(GL_DEPTH_TEST, false);
+    if (g_bloomStrength > 0.0f)
+        downsampleBloom(width, height);
+    glQueryCounter(timestamps[GPU_PASS_BLOOM_UP], GL_TIMESTAMP);
+    if (g_bloomStrength > 0.0f)
+        upsampleBloom(width, height);
+    glQueryCounter(timestamps[GPU_PASS_EXPOSURE], GL_TIMESTAMP);
+    if (g_autoExposure) {
+        g_exposureMeter.collect();
+        g_exposure = g_exposureMeter.adapt(g_exposure, deltaTime);
+        g_exposureMeter.measure(textureId(target.color), glm::ivec2(width, height),
+                                glm::ivec2(target.width, target.height));
+    }
+    glQueryCounter(timestamps[GPU_PASS_COMPOSITE], GL_TIMESTAMP);
+    g_gl.bindFramebuffer(0);
+    g_gl.viewport(0, 0, g_windowWidth, g_windowHeight);
+
+    // Upscale with a full-screen triangle; sharpen more the lower the scale. The
+    // bloom is added (its levels sum up, hence the division) and the sum tone mapped.
+    const GLuint program = programId(upscaleProgram);
+    g_gl.useProgram(program);
+    setSourceUniforms(program, glm::ivec2(width, height), glm::ivec2(target.width, target.height));
+    g_gl.uniform1f(glGetUniformLocation(program, "sharpness"),
+                kMaxSharpness * (1.0f - g_resolutionScale) / (1.0f - kMinResolutionScale));
+    const glm::ivec2 bloomSize = bloomLevelSize(width, height, 0);
+    const glm::ivec2 bloomAllocated = bloomLevelSize(target.width, target.height, 0);
+    g_gl.uniform2f(glGetUniformLocation(program, "bloomUvScale"), static_cast<float>(bloomSize.x) / bloomAllocated.x,
+                static_cast<float>(bloomSize.y) / bloomAllocated.y);
+    g_gl.uniform2f(glGetUniformLocation(program, "bloomUvMax"), (bloomSize.x - 0.5f) / bloomAllocated.x,
+                (bloomSize.y - 0.5f) / bloomAllocated.y);
+    g_gl.uniform1f(glGetUniformLocation(program, "bloomStrength"), g_bloomStrength / kBloomLevels);
+    g_gl.uniform1f(glGetUniformLocation(program, "exposure"), g_exposure);
+    g_gl.bindTexture(0, GL_TEXTURE_2D, textureId(target.color));
+    g_gl.bindTexture(1, GL_TEXTURE_2D, textureId(target.bloom[0]));
+    g_gl.bindVertexArray(target.emptyVao);
+    g_gl.drawArrays(GL_TRIANGLES, 0, 3);
+    g_gl.setEnabled(GL_DEPTH_TEST, true);
+
+    glQueryCounter(timestamps[GPU_PASS_COUNT], GL_TIMESTAMP);
+    target.timerIssued[slot] = true;
+    ++target.frame;
+}
+
+//------------------------------------------------------------------------------
+// Frame statistics
+//------------------------------------------------------------------------------
+
+// Resident set size of the process in bytes (0 where unsupported)
+size_t currentResidentBytes() {
+#ifdef __linux__
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    if (statm >> pages >> resident)
+        return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+    return 0;
+}
 
-    // Draw celestial bodies
-    glUseProgram(g_program);
-
-    glUniformMatrix4fv(glGetUniformLocation(g_program, "viewMat"), 1, GL_FALSE, glm::value_ptr(viewMatrix));
-    glUniformMatrix4fv(glGetUniformLocation(g_program, "projMat"), 1, GL_FALSE, glm::value_ptr(projMatrix));
-
-    const glm::vec3 camPosition = g_camera.getPosition();
-    glUniform3f(glGetUniformLocation(g_program, "camPos"), camPosition.x, camPosition.y, camPosition.z);
-
-    glm::vec3 lightPosition = glm::vec3(0.0f, 0.0f, 0.0f);
-    glUniform3fv(glGetUniformLocation(g_program, "lightPos"), 1, glm::value_ptr(lightPosition));
-
-    // Render the Sun
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, sunTexture);
-    glm::mat4 modelMat = g_sun;
-    glm::mat3 normalMat = glm::transpose(glm::inverse(glm::mat3(modelMat)));
-    glUniformMatrix4fv(glGetUniformLocation(g_program, "modelMat"), 1, GL_FALSE, glm::value_ptr(modelMat));
-    glUniformMatrix3fv(glGetUniformLocation(g_program, "normalMat"), 1, GL_FALSE, glm::value_ptr(normalMat));
-    glUniform3fv(glGetUniformLocation(g_program, "objectColor"), 1, glm::value_ptr(sunColor));
-    glUniform1i(glGetUniformLocation(g_program, "useTexture"), GL_TRUE);
-    glUniform1i(glGetUniformLocation(g_program, "isSun"), GL_TRUE);
-    g_sphereMesh->render();
-
-    // Render the Earth
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, earthTexture);
-    modelMat = g_earth;
-    normalMat = glm::transpose(glm::inverse(glm::mat3(modelMat)));
-    glUniformMatrix4fv(glGetUniformLocation(g_program, "modelMat"), 1, GL_FALSE, glm::value_ptr(modelMat));
-    glUniformMatrix3fv(glGetUniformLocation(g_program, "normalMat"), 1, GL_FALSE, glm::value_ptr(normalMat));
-    glUniform1i(glGetUniformLocation(g_program, "useTexture"), GL_TRUE);
-    glUniform1i(glGetUniformLocation(g_program, "isSun"), GL_FALSE);
-    g_sphereMesh->render();
-
-    // Render the Moon
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, moonTexture);
-    modelMat = g_moon;
-    normalMat = glm::transpose(glm::inverse(glm::mat3(modelMat)));
-    glUniformMatrix4fv(glGetUniformLocation(g_program, "modelMat"), 1, GL_FALSE, glm::value_ptr(modelMat));
-    glUniformMatrix3fv(glGetUniformLocation(g_program, "normalMat"), 1, GL_FALSE, glm::value_ptr(normalMat));
-    glUniform1i(glGetUniformLocation(g_program, "useTexture"), GL_TRUE);
-    glUniform1i(glGetUniformLocation(g_program, "isSun"), GL_FALSE);
-    g_sphereMesh->render();
-
-    // Render Saturn
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, saturnTexture);
-    modelMat = g_saturn;
-    normalMat = glm::transpose(glm::inverse(glm::mat3(modelMat)));
-    glUniformMatrix4fv(glGetUniformLocation(g_program, "modelMat"), 1, GL_FALSE, glm::value_ptr(modelMat));
-    glUniformMatrix3fv(glGetUniformLocation(g_program, "normalMat"), 1, GL_FALSE, glm::value_ptr(normalMat));
-    glUniform1i(glGetUniformLocation(g_program, "useTexture"), GL_TRUE);
-    glUniform1i(glGetUniformLocation(g_program, "isSun"), GL_FALSE);
-    g_sphereMesh->render();
-
-    // Render Saturn's Rings
-    if (g_ringMesh) {
-        glDisable(GL_CULL_FACE); // Disable face culling for rings
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, ringTexture);
-        glm::mat4 ringModelMat = g_saturn;
-
-        // Tilt the rings
-        float ringTiltAngle = glm::radians(27.0f);
-        ringModelMat = glm::rotate(ringModelMat, ringTiltAngle, glm::vec3(1.0f, 0.0f, 0.0f));
-
-        normalMat = glm::transpose(glm::inverse(glm::mat3(ringModelMat)));
-        glUniformMatrix4fv(glGetUniformLocation(g_program, "modelMat"), 1, GL_FALSE, glm::value_ptr(ringModelMat));
-        glUniformMatrix3fv(glGetUniformLocation(g_program, "normalMat"), 1, GL_FALSE, glm::value_ptr(normalMat));
-        glUniform3fv(glGetUniformLocation(g_program, "objectColor"), 1, glm::value_ptr(glm::vec3(1.0f))); // Not used when textured
-        glUniform1i(glGetUniformLocation(g_program, "useTexture"), GL_TRUE);
-        glUniform1i(glGetUniformLocation(g_program, "isSun"), GL_FALSE);
-        g_ringMesh->render();
-        glEnable(GL_CULL_FACE);
-    }
-
-    // Draw skybox
-    glDepthFunc(GL_LEQUAL);
-    glUseProgram(skyboxProgram);
-    glm::mat4 view = glm::mat4(glm::mat3(g_camera.computeViewMatrix())); // Remove translation from the view matrix
-    glUniformMatrix4fv(glGetUniformLocation(skyboxProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(glGetUniformLocation(skyboxProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projMatrix));
-
-    glBindVertexArray(skyboxMesh->getVao());
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture);
-    skyboxMesh->render();
-    glBindVertexArray(0);
-    glDepthFunc(GL_LESS);
+struct FrameStats {
+    double frameMs;      // CPU time of the last update + render
+    double simulationMs; // Time spent in updateBodies during the last frame
+    unsigned long long heapAllocations; // operator new calls during the last frame
+    // Accumulated since the window title was last refreshed
+    double accumFrameMs;
+    double accumSimulationMs;
+    double accumHeapAllocations;
+    int accumFrames;
+    double lastTitleUpdate;
+
+    FrameStats() : frameMs(0.0), simulationMs(0.0), heapAllocations(0), accumFrameMs(0.0),
+                   accumSimulationMs(0.0), accumHeapAllocations(0.0), accumFrames(0), lastTitleUpdate(0.0) {}
+};
+
+FrameStats g_frameStats;
+
+// The window title doubles as the stats overlay, refreshed twice per second
+void updateStatsOverlay(const double now) {
+    g_frameStats.accumFrameMs += g_frameStats.frameMs;
+    g_frameStats.accumSimulationMs += g_frameStats.simulationMs;
+    g_frameStats.accumHeapAllocations += g_frameStats.heapAllocations;
+    ++g_frameStats.accumFrames;
+    if (now - g_frameStats.lastTitleUpdate < 0.5)
+        return;
+
+    // Formatted in place: the overlay itself must not allocate
+    const double frames = static_cast<double>(g_frameStats.accumFrames);
+    char title[1024];
+    int length = std::snprintf(title, sizeof(title),
+                               "Solar System | %.2f fps | frame %.2f ms | sim %.2f ms | %d/%d bodies | allocs/frame %.1f"
+                               " | VRAM %.0f/%.0f MB | res %d%% | GPU %.2f ms",
+                               frames / (now - g_frameStats.lastTitleUpdate),
+                               g_frameStats.accumFrameMs / frames,
+                               g_frameStats.accumSimulationMs / frames,
+                               static_cast<int>(std::count(g_bodyVisible.begin(), g_bodyVisible.end(), 1)),
+                               static_cast<int>(g_bodies.size()),
+                               g_frameStats.accumHeapAllocations / frames,
+                               trackedGpuBytes() / (1024.0 * 1024.0), g_vramBudgetBytes / (1024.0 * 1024.0),
+                               static_cast<int>(100.0f * g_resolutionScale + 0.5f), g_renderTarget.gpuMs);
+
+    // GPU time of each pass: scene, bloom down and up the pyramid, exposure metering,
+    // upscale and tone mapping; then the current exposure
+    const double *passMs = g_renderTarget.passMs;
+    length += std::snprintf(title + length, sizeof(title) - length,
+                            " (scene %.2f, bloom %.2f+%.2f, exposure %.2f, composite %.2f) | exposure %.2f",
+                            passMs[GPU_PASS_SCENE], passMs[GPU_PASS_BLOOM_DOWN], passMs[GPU_PASS_BLOOM_UP],
+                            passMs[GPU_PASS_EXPOSURE], passMs[GPU_PASS_COMPOSITE], g_exposure);
+
+    // GL calls of the last frame: issued, filtered by the state cache, draws, bytes uploaded
+    const GLStateCache::Stats &gl = g_gl.frameStats();
+    length += std::snprintf(title + length, sizeof(title) - length, " | GL %u calls, %u filtered, %u draws, %.1f KB",
+                            gl.issued, gl.filtered, gl.drawCalls, gl.uploadedBytes / 1024.0);
+    length += std::snprintf(title + length, sizeof(title) - length, " | mesh/impostor/point %u/%u/%u",
+                            g_tierCounts.meshes, g_tierCounts.impostors, g_tierCounts.points);
+    length += std::snprintf(title + length, sizeof(title) - length, " | %u stars", g_stars.getDrawnStars());
+    const StreamRing::Stats &stream = g_stream.frameStats();
+    length += std::snprintf(title + length, sizeof(title) - length, " | stream %.1f KB, fence wait %.2f ms",
+                            stream.bytes / 1024.0, stream.fenceWaitMs);
+
+    // Job system utilization: share of the window each worker spent running jobs
+    const std::vector<JobSystem::WorkerStats> &workers = g_jobs.collectStats();
+    const double windowMs = (now - g_frameStats.lastTitleUpdate) * 1000.0;
+    length += std::snprintf(title + length, sizeof(title) - length, " | jobs");
+    for (size_t i = 0; i < workers.size() && length < static_cast<int>(sizeof(title)); ++i)
+        length += std::snprintf(title + length, sizeof(title) - length, " %d%%",
+                                static_cast<int>(100.0 * workers[i].busyMs / windowMs));
+    glfwSetWindowTitle(g_window, title);
+
+    g_frameStats.accumFrameMs = 0.0;
+    g_frameStats.accumSimulationMs = 0.0;
+    g_frameStats.accumHeapAllocations = 0.0;
+    g_frameStats.accumFrames = 0;
+    g_frameStats.lastTitleUpdate = now;
 }
 
 void update(const float currentFrame) {
@@ -879,47 +6227,611 @@ void update(const float currentFrame) {
         simulationTime += deltaTime;
     }
 
-    // Calculate orbital and rotation angles
-    float earthOrbitAngle = (simulationTime / earthOrbitPeriod) * 2.0f * PI;
-    float earthRotationAngle = (simulationTime / earthRotationPeriod) * 2.0f * PI;
+    const Clock::time_point simStart = Clock::now();
+    updateBodies(simulationTime);
+    g_frameStats.simulationMs = elapsedMs(simStart);
+
+    // Process camera movement
+    doMovement();
+}
+
+//------------------------------------------------------------------------------
+// Scaling study driver
+//------------------------------------------------------------------------------
+
+// Stress scene with roughly n bodies: a few planets and moons, the rest split
+// between ring particles and asteroid-belt members
+ScenarioConfig scenarioForBodyCount(const int n, const unsigned int seed) {
+    ScenarioConfig config;
+    config.seed = seed;
+    config.planets = std::min(std::max(n / 500, 2), 16);
+    config.moonsPerPlanet = std::min(std::max(n / 2000, 1), 8);
+    const int rest = std::max(n - 1 - config.planets * (1 + config.moonsPerPlanet), 0);
+    config.ringParticles = rest / 3;
+    config.asteroids = rest - config.ringParticles;
+    return config;
+}
+
+// Render the same scene over growing body counts and write one CSV row per count:
+// bodies, frame time, simulation step time, resident memory and heap allocations
+// per frame. Returns false if any measured frame allocated.
+bool runScalingSweep(const int maxBodies, const std::string &csvFilename) {
+    const int kWarmupFrames = 10;
+    const int kMeasuredFrames = 100;
+    bool allocationFree = true;
+
+    std::ofstream csv(csvFilename.c_str());
+    csv << "bodies,frame_ms,simulation_ms,resident_mb,allocations_per_frame,gl_calls,gl_filtered,draw_calls" << std::endl;
+    std::cout << "bodies\tframe_ms\tsimulation_ms\tresident_mb\tallocations_per_frame\tgl_calls\tgl_filtered\tdraw_calls"
+              << std::endl;
+
+    for (int n = 100; n <= maxBodies && !glfwWindowShouldClose(g_window); n *= 2) {
+        buildScene(scenarioForBodyCount(n, g_scenario.seed));
+
+        double frameMs = 0.0, simulationMs = 0.0;
+        unsigned long long allocations = 0, glCalls = 0, glFiltered = 0, drawCalls = 0;
+        for (int frame = 0; frame < kWarmupFrames + kMeasuredFrames; ++frame) {
+            const unsigned long long allocationsBefore = g_heapAllocations.load();
+            g_frameArena.reset();
+            const Clock::time_point frameStart = Clock::now();
+            const Clock::time_point simStart = Clock::now();
+            updateBodies(frame * (1.0f / 60.0f));
+            const double stepMs = elapsedMs(simStart);
+            render(g_windowHeight);
+            glFinish(); // Include the GPU work in the frame time
+            const double totalMs = elapsedMs(frameStart);
+            g_gl.endFrame();
+            if (frame >= kWarmupFrames) {
+                frameMs += totalMs;
+                simulationMs += stepMs;
+                allocations += g_heapAllocations.load() - allocationsBefore;
+                glCalls += g_gl.frameStats().issued;
+                glFiltered += g_gl.frameStats().filtered;
+                drawCalls += g_gl.frameStats().drawCalls;
+            }
+            glfwSwapBuffers(g_window);
+            glfwPollEvents();
+        }
+
+        const double residentMb = currentResidentBytes() / (1024.0 * 1024.0);
+        const double allocationsPerFrame = static_cast<double>(allocations) / kMeasuredFrames;
+        csv << g_bodies.size() << "," << frameMs / kMeasuredFrames << ","
+            << simulationMs / kMeasuredFrames << "," << residentMb << "," << allocationsPerFrame << ","
+            << glCalls / kMeasuredFrames << "," << glFiltered / kMeasuredFrames << "," << drawCalls / kMeasuredFrames << std::endl;
+        std::cout << g_bodies.size() << "\t" << frameMs / kMeasuredFrames << "\t"
+                  << simulationMs / kMeasuredFrames << "\t" << residentMb << "\t" << allocationsPerFrame << "\t"
+                  << glCalls / kMeasuredFrames << "\t" << glFiltered / kMeasuredFrames << "\t" << drawCalls / kMeasuredFrames
+                  << std::endl;
+
+        // The frame loop must not touch the heap once warmed up
+        if (allocations != 0) {
+            std::cerr << "ERROR: " << allocationsPerFrame << " heap allocations per frame after warm-up with "
+                      << g_bodies.size() << " bodies" << std::endl;
+            allocationFree = false;
+        }
+    }
+    std::cout << "Scaling curves written to " << csvFilename << std::endl;
+    return allocationFree;
+}
+
+// Render the same scene of about n bodies with every body as a mesh, then with the
+// impostor and point tiers, and write one CSV row per mode: bodies per tier, CPU
+// frame time, GPU time and draw calls
+void runLodBenchmark(const int bodies, const std::string &csvFilename) {
+    const int kWarmupFrames = 10;
+    const int kMeasuredFrames = 100;
+    struct Mode {
+        const char *name;
+        float impostorPixels, pointPixels;
+    };
+    const Mode modes[] = { { "mesh", 0.0f, 0.0f }, { "tiered", g_impostorPixels, g_pointPixels } };
+
+    buildScene(scenarioForBodyCount(bodies, g_scenario.seed));
+    GLuint timerQuery = 0;
+    glGenQueries(1, &timerQuery);
+
+    std::ofstream csv(csvFilename.c_str());
+    csv << "mode,bodies,meshes,impostors,points,frame_ms,gpu_ms,draw_calls" << std::endl;
+    std::cout << "mode\tbodies\tmeshes\timpostors\tpoints\tframe_ms\tgpu_ms\tdraw_calls" << std::endl;
+    double gpuMsPerMode[2] = { 0.0, 0.0 };
+    for (int m = 0; m < 2 && !glfwWindowShouldClose(g_window); ++m) {
+        g_impostorPixels = modes[m].impostorPixels;
+        g_pointPixels = modes[m].pointPixels;
+        double frameMs = 0.0, gpuMs = 0.0;
+        unsigned long long drawCalls = 0;
+        for (int frame = 0; frame < kWarmupFrames + kMeasuredFrames; ++frame) {
+            g_frameArena.reset();
+            const Clock::time_point frameStart = Clock::now();
+            updateBodies(frame * (1.0f / 60.0f));
+            glBeginQuery(GL_TIME_ELAPSED, timerQuery);
+            render(g_windowHeight);
+            glEndQuery(GL_TIME_ELAPSED);
+            glFinish();
+            const double totalMs = elapsedMs(frameStart);
+            g_gl.endFrame();
+            if (frame >= kWarmupFrames) {
+                GLuint64 nanoseconds = 0;
+                glGetQueryObjectui64v(timerQuery, GL_QUERY_RESULT, &nanoseconds);
+                frameMs += totalMs;
+                gpuMs += nanoseconds * 1.0e-6;
+                drawCalls += g_gl.frameStats().drawCalls;
+            }
+            glfwSwapBuffers(g_window);
+            glfwPollEvents();
+        }
+        gpuMsPerMode[m] = gpuMs / kMeasuredFrames;
+        csv << modes[m].name << "," << g_bodies.size() << "," << g_tierCounts.meshes << "," << g_tierCounts.impostors
+            << "," << g_tierCounts.points << "," << frameMs / kMeasuredFrames << "," << gpuMsPerMode[m] << ","
+            << drawCalls / kMeasuredFrames << std::endl;
+        std::cout << modes[m].name << "\t" << g_bodies.size() << "\t" << g_tierCounts.meshes << "\t"
+                  << g_tierCounts.impostors << "\t" << g_tierCounts.points << "\t" << frameMs / kMeasuredFrames << "\t"
+                  << gpuMsPerMode[m] << "\t" << drawCalls / kMeasuredFrames << std::endl;
+    }
+    g_impostorPixels = modes[1].impostorPixels;
+    g_pointPixels = modes[1].pointPixels;
+    glDeleteQueries(1, &timerQuery);
+    if (gpuMsPerMode[1] > 0.0)
+        std::printf("GPU time, mesh / tiered: %.2fx\n", gpuMsPerMode[0] / gpuMsPerMode[1]);
+    std::cout << "Level-of-detail benchmark written to " << csvFilename << std::endl;
+}
+
+// Render a scene of many planets, moons and asteroids with 1 to 1000 point lights
+// and write one CSV row per light count: lights in view, the longest cluster list,
+// the capped clusters, the list entries, the CPU time of the cluster lists, the
+// frame time and the GPU time. With the lights spread over the bodies, the GPU
+// time should stay about flat.
+void runLightBenchmark(const std::string &csvFilename) {
+    const int kWarmupFrames = 10;
+    const int kMeasuredFrames = 100;
+    const int lightCounts[] = { 1, 10, 100, 1000 };
+    const int modeCount = sizeof(lightCounts) / sizeof(lightCounts[0]);
+
+    ScenarioConfig config;
+    config.seed = g_scenario.seed;
+    config.planets = 16;
+    config.moonsPerPlanet = 8;
+    config.asteroids = 2000;
+    GLuint timerQuery = 0;
+    glGenQueries(1, &timerQuery);
+
+    std::ofstream csv(csvFilename.c_str());
+    csv << "lights,visible_lights,max_per_cluster,full_clusters,list_entries,cluster_ms,frame_ms,gpu_ms" << std::endl;
+    std::cout << "lights\tvisible_lights\tmax_per_cluster\tfull_clusters\tlist_entries\tcluster_ms\tframe_ms\tgpu_ms"
+              << std::endl;
+    double gpuMsPerMode[modeCount] = {};
+    for (int m = 0; m < modeCount && !glfwWindowShouldClose(g_window); ++m) {
+        config.lights = lightCounts[m];
+        buildScene(config);
+        double clusterMs = 0.0, frameMs = 0.0, gpuMs = 0.0;
+        unsigned int visibleLights = 0, maxPerCluster = 0, fullClusters = 0;
+        size_t listEntries = 0;
+        for (int frame = 0; frame < kWarmupFrames + kMeasuredFrames; ++frame) {
+            g_frameArena.reset();
+            const Clock::time_point frameStart = Clock::now();
+            updateBodies(frame * (1.0f / 60.0f));
+            glBeginQuery(GL_TIME_ELAPSED, timerQuery);
+            render(g_windowHeight);
+            glEndQuery(GL_TIME_ELAPSED);
+            glFinish();
+            const double totalMs = elapsedMs(frameStart);
+            g_gl.endFrame();
+            if (frame >= kWarmupFrames) {
+                GLuint64 nanoseconds = 0;
+                glGetQueryObjectui64v(timerQuery, GL_QUERY_RESULT, &nanoseconds);
+                const LightClusters::Stats &stats = g_lightClusters.frameStats();
+                clusterMs += stats.buildMs;
+                frameMs += totalMs;
+                gpuMs += nanoseconds * 1.0e-6;
+                visibleLights = std::max(visibleLights, stats.visibleLights);
+                maxPerCluster = std::max(maxPerCluster, stats.maxPerCluster);
+                fullClusters = std::max(fullClusters, stats.fullClusters);
+                listEntries = std::max(listEntries, stats.indices);
+            }
+            glfwSwapBuffers(g_window);
+            glfwPollEvents();
+        }
+        gpuMsPerMode[m] = gpuMs / kMeasuredFrames;
+        csv << lightCounts[m] << "," << visibleLights << "," << maxPerCluster << "," << fullClusters << ","
+            << listEntries << "," << clusterMs / kMeasuredFrames << "," << frameMs / kMeasuredFrames << ","
+            << gpuMsPerMode[m] << std::endl;
+        std::cout << lightCounts[m] << "\t" << visibleLights << "\t" << maxPerCluster << "\t" << fullClusters << "\t"
+                  << listEntries << "\t" << clusterMs / kMeasuredFrames << "\t" << frameMs / kMeasuredFrames << "\t"
+                  << gpuMsPerMode[m] << std::endl;
+    }
+    glDeleteQueries(1, &timerQuery);
+    buildScene(g_scenario);
+    if (gpuMsPerMode[0] > 0.0)
+        std::printf("GPU time, %d / %d lights: %.2fx\n", lightCounts[modeCount - 1], lightCounts[0],
+                    gpuMsPerMode[modeCount - 1] / gpuMsPerMode[0]);
+    std::cout << "Light benchmark written to " << csvFilename << std::endl;
+}
+
+//------------------------------------------------------------------------------
+// Golden-image regression tests
+//------------------------------------------------------------------------------
+
+// A fixed scene, simulation time and camera pose rendered headless and compared
+// against a stored reference image
+struct GoldenCase {
+    const char *name;
+    int planets, moonsPerPlanet, ringParticles, asteroids; // All 0: default scene
+    float simulationTime;
+    glm::vec3 cameraPos;
+    float yaw, pitch, fov;
+    float maxBadPixelRatio; // Fraction of visible differences tolerated: below the smallest feature in view
+};
+
+const GoldenCase kGoldenCases[] = {
+    { "default_overview", 0, 0, 0, 0, 0.0f, glm::vec3(0.0f, 0.0f, 30.0f), -90.0f, 0.0f, 45.0f, 0.0002f },
+    { "default_top", 0, 0, 0, 0, 1.3f, glm::vec3(0.0f, 45.0f, 0.1f), -90.0f, -89.0f, 45.0f, 0.0001f },
+    { "default_saturn_close", 0, 0, 0, 0, 0.0f, glm::vec3(25.0f, 1.5f, 5.0f), -90.0f, -15.0f, 30.0f, 0.002f },
+    { "default_earth_moon", 0, 0, 0, 0, 0.5f, glm::vec3(6.15f, 0.5f, -4.31f), -71.6f, -9.8f, 30.0f, 0.002f },
+    { "stress_small", 6, 2, 500, 2000, 3.0f, glm::vec3(0.0f, 20.0f, 35.0f), -90.0f, -30.0f, 45.0f, 0.002f },
+};
+const int kGoldenCaseCount = sizeof(kGoldenCases) / sizeof(kGoldenCases[0]);
+
+const int kGoldenImageSize = 256;
+const int kGoldenTimedFrames = 5;
+const float kGoldenMaxDeltaE = 6.0f; // Per-pixel CIE76 difference considered visible
+const float kGoldenExposure = 1.0f;  // Fixed: auto exposure would depend on the frame count
+
+std::string g_goldenReferenceDir = "golden";
+std::string g_goldenOutputDir = "golden_out";
+std::string g_goldenCase;  // Set in the child process rendering a single case
+bool g_goldenRun = false;
+bool g_goldenUpdate = false;
+int g_goldenJobs = 0;      // 0: one job per hardware thread
+
+bool writePPM(const std::string &filename, int width, int height, const unsigned char *rgb) {
+    std::ofstream out(filename.c_str(), std::ios::binary);
+    if (!out.is_open())
+        return false;
+    out << "P6\n" << width << " " << height << "\n255\n";
+    out.write(reinterpret_cast<const char *>(rgb), static_cast<std::streamsize>(width) * height * 3);
+    return out.good();
+}
+
+// sRGB (8 bits per channel) to CIELAB, D65 white point
+glm::vec3 srgbToLab(const unsigned char *rgb) {
+    glm::vec3 c;
+    for (int i = 0; i < 3; ++i) {
+        const float v = rgb[i] / 255.0f;
+        c[i] = v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+    }
+    const glm::vec3 xyz(0.4124f * c.r + 0.3576f * c.g + 0.1805f * c.b,
+                        0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b,
+                        0.0193f * c.r + 0.1192f * c.g + 0.9505f * c.b);
+    const glm::vec3 white(0.95047f, 1.0f, 1.08883f);
+    glm::vec3 f;
+    for (int i = 0; i < 3; ++i) {
+        const float t = xyz[i] / white[i];
+        f[i] = t > 0.008856f ? std::cbrt(t) : 7.787f * t + 16.0f / 116.0f;
+    }
+    return glm::vec3(116.0f * f.y - 16.0f, 500.0f * (f.x - f.y), 200.0f * (f.y - f.z));
+}
 
-    float moonOrbitAngle = (simulationTime / moonOrbitPeriod) * 2.0f * PI;
-    float moonRotationAngle = (simulationTime / moonRotationPeriod) * 2.0f * PI;
+// Render one golden case in this (headless) process, compare it against the
+// reference and write <run>.ppm, <run>_diff.ppm and <run>.result to the output dir,
+// where the run is the case name, suffixed with _fallback under --gl-fallback
+int runGoldenCase(const std::string &name) {
+    const GoldenCase *goldenCase = nullptr;
+    for (int i = 0; i < kGoldenCaseCount; ++i)
+        if (name == kGoldenCases[i].name)
+            goldenCase = &kGoldenCases[i];
+    if (!goldenCase) {
+        std::cerr << "ERROR: unknown golden case " << name << std::endl;
+        return EXIT_FAILURE;
+    }
 
-    float saturnOrbitAngle = (simulationTime / saturnOrbitPeriod) * 2.0f * PI;
-    float saturnRotationAngle = (simulationTime / saturnRotationPeriod) * 2.0f * PI;
+    g_scenario.planets = goldenCase->planets;
+    g_scenario.moonsPerPlanet = goldenCase->moonsPerPlanet;
+    g_scenario.ringParticles = goldenCase->ringParticles;
+    g_scenario.asteroids = goldenCase->asteroids;
+    g_headless = true;
+    g_targetFrameMs = 0.0f; // References are rendered at native resolution (scale 1)
+    g_autoExposure = false;
+    g_exposure = kGoldenExposure;
+    g_windowWidth = g_windowHeight = kGoldenImageSize;
+    init();
 
-    // Update Earth
-    g_earth = glm::rotate(glm::mat4(1.0f), earthOrbitAngle, glm::vec3(0.0f, 1.0f, 0.0f)) *
-              glm::translate(glm::mat4(1.0f), glm::vec3(kRadOrbitEarth, 0.0f, 0.0f)) *
-              glm::rotate(glm::mat4(1.0f), earthRotationAngle, glm::vec3(0.0f, 1.0f, 0.0f)) *
-              glm::scale(glm::mat4(1.0f), glm::vec3(kSizeEarth));
+    g_camera.setPosition(goldenCase->cameraPos);
+    g_camera.setOrientation(goldenCase->yaw, goldenCase->pitch);
+    g_camera.setFoV(goldenCase->fov);
+    simulationTime = goldenCase->simulationTime;
+    updateBodies(simulationTime);
+
+    // Through the whole frame path (HDR target, bloom, tone mapping) into the window.
+    // First frame warms up the driver, the following ones are timed.
+    renderFrame();
+    glFinish();
+    const Clock::time_point renderStart = Clock::now();
+    for (int i = 0; i < kGoldenTimedFrames; ++i) {
+        renderFrame();
+        glFinish();
+    }
+    const double renderMs = elapsedMs(renderStart) / kGoldenTimedFrames;
+
+    const int size = kGoldenImageSize;
+    std::vector<unsigned char> pixels(size * size * 3), image(size * size * 3);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, size, size, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+    for (int y = 0; y < size; ++y) // OpenGL rows go bottom-up
+        std::memcpy(&image[y * size * 3], &pixels[(size - 1 - y) * size * 3], size * 3);
+    clear();
 
-    // Update Moon
-    glm::mat4 moonLocal = glm::rotate(glm::mat4(1.0f), moonOrbitAngle, glm::vec3(0.0f, 1.0f, 0.0f)) *
-                          glm::translate(glm::mat4(1.0f), glm::vec3(kRadOrbitMoon, 0.0f, 0.0f)) *
-                          glm::rotate(glm::mat4(1.0f), moonRotationAngle, glm::vec3(0.0f, 1.0f, 0.0f)) *
-                          glm::scale(glm::mat4(1.0f), glm::vec3(kSizeMoon));
+    const std::string runName = g_glFallback ? name + "_fallback" : name;
+    const std::string outBase = g_goldenOutputDir + "/" + runName;
+    const std::string referenceFile = g_goldenReferenceDir + "/" + name + ".ppm";
+    writePPM(outBase + ".ppm", size, size, image.data());
+
+    std::string status = "pass";
+    float maxDeltaE = 0.0f;
+    float badRatio = 0.0f;
+    if (g_goldenUpdate) {
+        status = writePPM(referenceFile, size, size, image.data()) ? "updated" : "error";
+    } else {
+        int width, height, numComponents;
+        unsigned char *reference = stbi_load(referenceFile.c_str(), &width, &height, &numComponents, 3);
+        if (!reference) {
+            status = "missing";
+        } else if (width != size || height != size) {
+            status = "fail";
+            badRatio = 1.0f;
+            stbi_image_free(reference);
+        } else {
+            // Diff image: dimmed reference, visible differences in red
+            std::vector<unsigned char> diff(size * size * 3);
+            int badPixels = 0;
+            for (int i = 0; i < size * size; ++i) {
+                const float deltaE = glm::length(srgbToLab(&image[i * 3]) - srgbToLab(&reference[i * 3]));
+                maxDeltaE = std::max(maxDeltaE, deltaE);
+                const unsigned char gray = static_cast<unsigned char>(
+                    (reference[i * 3] + reference[i * 3 + 1] + reference[i * 3 + 2]) / 12);
+                const bool bad = deltaE > kGoldenMaxDeltaE;
+                badPixels += bad ? 1 : 0;
+                diff[i * 3] = bad ? 255 : gray;
+                diff[i * 3 + 1] = bad ? 0 : gray;
+                diff[i * 3 + 2] = bad ? 0 : gray;
+            }
+            stbi_image_free(reference);
+            writePPM(outBase + "_diff.ppm", size, size, diff.data());
+            badRatio = static_cast<float>(badPixels) / (size * size);
+            status = badRatio <= goldenCase->maxBadPixelRatio ? "pass" : "fail";
+        }
+    }
 
-    // Apply Earth's transformation to the Moon
-    g_moon = g_earth * moonLocal;
+    std::ofstream result((outBase + ".result").c_str());
+    result << runName << " " << status << " " << maxDeltaE << " " << badRatio << " " << renderMs << std::endl;
+    return (status == "pass" || status == "updated") ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    // Update Saturn
-    g_saturn = glm::rotate(glm::mat4(1.0f), saturnOrbitAngle, glm::vec3(0.0f, 1.0f, 0.0f)) *
-               glm::translate(glm::mat4(1.0f), glm::vec3(kRadOrbitSaturn, 0.0f, 0.0f)) *
-               glm::rotate(glm::mat4(1.0f), saturnRotationAngle, glm::vec3(0.0f, 1.0f, 0.0f)) *
-               glm::scale(glm::mat4(1.0f), glm::vec3(kSizeSaturn));
+// Run every golden case in its own headless process, several at a time, then
+// print a report with the image comparison and render timing of each run. Each
+// case runs twice against the same reference: with the GL features the context
+// offers, then with --gl-fallback so that the GL 3.3 paths are covered on any
+// driver. Updating the references only takes the first run.
+int runGoldenSuite(const std::string &executable) {
+    if (std::system(("mkdir -p \"" + g_goldenOutputDir + "\" \"" + g_goldenReferenceDir + "\"").c_str()) != 0)
+        std::cerr << "Warning: could not create the golden output directories" << std::endl;
+
+    const int runCount = g_goldenUpdate ? kGoldenCaseCount : 2 * kGoldenCaseCount;
+    auto runName = [](int run) {
+        return std::string(kGoldenCases[run % kGoldenCaseCount].name) + (run >= kGoldenCaseCount ? "_fallback" : "");
+    };
+    int jobs = g_goldenJobs > 0 ? g_goldenJobs : static_cast<int>(std::thread::hardware_concurrency());
+    jobs = std::max(1, std::min(jobs, runCount));
+
+    std::atomic<int> nextRun(0);
+    std::vector<std::thread> workers;
+    for (int j = 0; j < jobs; ++j) {
+        workers.push_back(std::thread([&]() {
+            for (int i = nextRun++; i < runCount; i = nextRun++) {
+                std::string command = "\"" + executable + "\" --golden-case " +
+                                      kGoldenCases[i % kGoldenCaseCount].name + " --golden " + g_goldenReferenceDir +
+                                      " --golden-out " + g_goldenOutputDir;
+                if (i >= kGoldenCaseCount)
+                    command += " --gl-fallback";
+                if (g_goldenUpdate)
+                    command += " --golden-update";
+                command += " > \"" + g_goldenOutputDir + "/" + runName(i) + ".log\" 2>&1";
+                std::system(command.c_str());
+            }
+        }));
+    }
+    for (size_t j = 0; j < workers.size(); ++j)
+        workers[j].join();
+
+    int failures = 0;
+    std::ofstream report((g_goldenOutputDir + "/report.csv").c_str());
+    report << "case,status,max_delta_e,bad_pixel_ratio,render_ms" << std::endl;
+    std::cout << "case\tstatus\tmax_delta_e\tbad_pixel_ratio\trender_ms" << std::endl;
+    for (int i = 0; i < runCount; ++i) {
+        std::ifstream result((g_goldenOutputDir + "/" + runName(i) + ".result").c_str());
+        std::string name, status = "crashed";
+        float maxDeltaE = 0.0f, badRatio = 0.0f, renderMs = 0.0f;
+        result >> name >> status >> maxDeltaE >> badRatio >> renderMs;
+        if (status != "pass" && status != "updated")
+            ++failures;
+        report << runName(i) << "," << status << "," << maxDeltaE << "," << badRatio << "," << renderMs << std::endl;
+        std::cout << runName(i) << "\t" << status << "\t" << maxDeltaE << "\t" << badRatio << "\t" << renderMs << std::endl;
+    }
+    std::cout << (runCount - failures) << "/" << runCount << " golden runs passed, images and diffs in "
+              << g_goldenOutputDir << std::endl;
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    // Process camera movement
-    doMovement();
+// Command line: scene selection, scaling sweep, golden-image tests, VRAM budget and asset packing
+//   --seed S --planets N --moons N --ring-particles N --asteroids N --true-scale
+//   --sweep [maxBodies] --lod-benchmark [bodies]
+//   --impostor-px D --point-px D (body tiers by diameter on screen, 0: tier off)
+//   --golden [referenceDir] [--golden-update] [--golden-out dir] [--jobs N]
+//   --gl-fallback (GL 3.3 paths only: no persistent mapping, multi-draw indirect or clip control)
+//   --vram-budget MB --target-frame-ms ms (0: fixed full resolution)
+//   --star-magnitude M (faintest star at a 45 degree field of view)
+//   --bloom S (bloom strength, 0: off) --exposure E (fixed exposure instead of automatic)
+//   --pack archive file... (build step: pack the assets and exit)
+//   --make-star-catalog file [stars] (build step: synthetic star catalog)
+//   --import-star-catalog csv file (star catalog from a CSV such as HYG)
+//   --atmosphere-benchmark (time the atmosphere tables cold and from the cache, then exit)
+//   --lights N (point lights orbiting the bodies) --light-benchmark (1 to 1000 lights)
+int g_sweepMaxBodies = 0;
+int g_lodBenchmarkBodies = 0;
+bool g_lightBenchmark = false;
+std::string g_packArchive;
+std::vector<std::string> g_packFiles;
+std::string g_starCatalogOut;
+std::string g_starCatalogCsv;
+size_t g_starCatalogCount = 1000000;
+bool g_atmosphereBenchmark = false;
+
+void parseArguments(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc && argv[i + 1][0] != '-';
+        if (arg == "--seed" && hasValue)
+            g_scenario.seed = static_cast<unsigned int>(std::strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--planets" && hasValue)
+            g_scenario.planets = std::atoi(argv[++i]);
+        else if (arg == "--moons" && hasValue)
+            g_scenario.moonsPerPlanet = std::atoi(argv[++i]);
+        else if (arg == "--ring-particles" && hasValue)
+            g_scenario.ringParticles = std::atoi(argv[++i]);
+        else if (arg == "--asteroids" && hasValue)
+            g_scenario.asteroids = std::atoi(argv[++i]);
+        else if (arg == "--sweep")
+            g_sweepMaxBodies = hasValue ? std::atoi(argv[++i]) : 102400;
+        else if (arg == "--lod-benchmark")
+            g_lodBenchmarkBodies = hasValue ? std::atoi(argv[++i]) : 100000;
+        else if (arg == "--lights" && hasValue)
+            g_scenario.lights = std::atoi(argv[++i]);
+        else if (arg == "--light-benchmark")
+            g_lightBenchmark = true;
+        else if (arg == "--impostor-px" && hasValue)
+            g_impostorPixels = static_cast<float>(std::atof(argv[++i]));
+        else if (arg == "--point-px" && hasValue)
+            g_pointPixels = static_cast<float>(std::atof(argv[++i]));
+        else if (arg == "--golden") {
+            g_goldenRun = true;
+            if (hasValue)
+                g_goldenReferenceDir = argv[++i];
+        } else if (arg == "--golden-update")
+            g_goldenUpdate = true;
+        else if (arg == "--golden-out" && hasValue)
+            g_goldenOutputDir = argv[++i];
+        else if (arg == "--golden-case" && hasValue)
+            g_goldenCase = argv[++i];
+        else if (arg == "--jobs" && hasValue)
+            g_goldenJobs = std::atoi(argv[++i]);
+        else if (arg == "--gl-fallback")
+            g_glFallback = true;
+        else if (arg == "--true-scale")
+            g_scenario.trueScale = true;
+        else if (arg == "--target-frame-ms" && hasValue)
+            g_targetFrameMs = static_cast<float>(std::atof(argv[++i]));
+        else if (arg == "--vram-budget" && hasValue)
+            g_vramBudgetBytes = static_cast<size_t>(std::strtoul(argv[++i], nullptr, 10)) << 20;
+        else if (arg == "--exposure" && hasValue) {
+            g_exposure = static_cast<float>(std::atof(argv[++i]));
+            g_autoExposure = false;
+        } else if (arg == "--bloom" && hasValue)
+            g_bloomStrength = static_cast<float>(std::atof(argv[++i]));
+        else if (arg == "--star-magnitude" && hasValue)
+            g_starMagnitudeLimit = static_cast<float>(std::atof(argv[++i]));
+        else if (arg == "--make-star-catalog" && hasValue) {
+            g_starCatalogOut = argv[++i];
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                g_starCatalogCount = static_cast<size_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--import-star-catalog" && i + 2 < argc) {
+            g_starCatalogCsv = argv[++i];
+            g_starCatalogOut = argv[++i];
+        }
+        else if (arg == "--atmosphere-benchmark")
+            g_atmosphereBenchmark = true;
+        else if (arg == "--pack" && hasValue) {
+            g_packArchive = argv[++i];
+            g_packFiles.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        else
+            std::cerr << "Warning: ignoring unknown argument " << arg << std::endl;
+    }
 }
 
 int main(int argc, char **argv) {
+    parseArguments(argc, argv);
+    if (!g_packArchive.empty()) {
+        g_jobs.start();
+        const bool packed = writeAssetArchive(g_packArchive, g_packFiles);
+        g_jobs.stop();
+        return packed ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (!g_starCatalogOut.empty()) {
+        std::vector<StarRecord> stars;
+        if (g_starCatalogCsv.empty())
+            generateStarCatalog(g_starCatalogCount, g_scenario.seed, stars);
+        else if (!importStarCatalog(g_starCatalogCsv, stars))
+            return EXIT_FAILURE;
+        return writeStarCatalog(g_starCatalogOut, stars) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (g_atmosphereBenchmark)
+        return runAtmosphereBenchmark();
+    if (!g_goldenCase.empty())
+        return runGoldenCase(g_goldenCase);
+    if (g_goldenRun || g_goldenUpdate)
+        return runGoldenSuite(argv[0]);
+
     init();
+    if (g_sweepMaxBodies > 0) {
+        const bool allocationFree = runScalingSweep(g_sweepMaxBodies, "scaling.csv");
+        clear();
+        return allocationFree ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (g_lodBenchmarkBodies > 0) {
+        runLodBenchmark(g_lodBenchmarkBodies, "lod_benchmark.csv");
+        clear();
+        return EXIT_SUCCESS;
+    }
+    if (g_lightBenchmark) {
+        runLightBenchmark("light_benchmark.csv");
+        clear();
+        return EXIT_SUCCESS;
+    }
+    bool firstFrame = true;
     while (!glfwWindowShouldClose(g_window)) {
-        update(static_cast<float>(glfwGetTime()));
-        render();
+        if (!isSimulationFrozen)
+            g_dirty |= DIRTY_SIMULATION;
+        if (isCameraMoving())
+            g_dirty |= DIRTY_CAMERA;
+        if (isTextureResidencyPending())
+            g_dirty |= DIRTY_RESOURCES;
+        if (g_autoExposure && !g_exposureMeter.isConverged(g_exposure))
+            g_dirty |= DIRTY_EXPOSURE;
+        if (g_dirty == 0) {
+            // Nothing would change on screen: sleep until an event wakes us up
+            collectGpuGarbage();
+            glfwWaitEventsTimeout(kIdleWaitSeconds);
+            lastFrame = static_cast<float>(glfwGetTime()); // Time spent idle is not a frame
+            continue;
+        }
+        g_dirty = 0;
+
+        const double now = glfwGetTime();
+        const Clock::time_point frameStart = Clock::now();
+        const unsigned long long allocationsBefore = g_heapAllocations.load();
+        g_frameArena.reset();
+        update(static_cast<float>(now));
+        renderFrame();
+        updateTextureResidency();
+        g_gl.endFrame();
+        g_frameStats.frameMs = elapsedMs(frameStart);
+        updateStatsOverlay(now);
+        g_frameStats.heapAllocations = g_heapAllocations.load() - allocationsBefore;
         glfwSwapBuffers(g_window);
+        if (firstFrame) {
+            std::printf("First frame after %.1f ms (target: 150 ms)\n", elapsedMs(g_processStart));
+            firstFrame = false;
+        }
+        collectGpuGarbage();
         glfwPollEvents();
     }
     clear();
@@ -0,0 +1,18 @@
+#version 330 core
+
+uniform float logDepthScale; // 1 / log2(1 + far), for the LOG_DEPTH variant (no glClipControl / float depth buffer)
+
+in vec4 fColor;
+in float fDepthW;
+
+out vec4 color;
+
+void main() {
+    color = fColor; // Blended: alpha scales the point down to the energy of the disk
+
+#ifdef LOG_DEPTH
+    // Reversed depth: 1 at the camera, 0 at the far distance. Written in this variant
+    // only, since writing gl_FragDepth turns early depth testing off.
+    gl_FragDepth = 1.0 - log2(1.0 + fDepthW) * logDepthScale;
+#endif
+}
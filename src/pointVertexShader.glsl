@@ -0,0 +1,64 @@
+// Sub-pixel body drawn as a point carrying the light the whole sphere would send to the eye.
+#version 330 core
+
+const float PI = 3.14159265;
+
+layout(location = 3) in mat4 aModelMat; // Per draw (locations 3-6): center and radius of the unit sphere
+layout(location = 7) in vec4 aColor;
+layout(location = 8) in uint aMaterial;
+
+uniform mat4 viewMat;
+uniform mat4 projMat;
+uniform vec3 camPos;
+uniform vec3 lightPos;
+uniform float pixelScale; // Pixels per unit of tangent: viewport height / 2 * projMat[1][1]
+uniform sampler2DArray bodyTextures;
+uniform float emissiveIntensity; // Radiance of emissive materials (above 1 into an HDR target)
+uniform vec3 ambientSH[9];       // Sky irradiance / pi in spherical harmonics (see Environment lighting in main.cpp)
+
+// Per material: x = layer in the bound array, y = textured, z = emissive (the sun)
+layout(std140) uniform Materials {
+    ivec4 materials[16];
+};
+
+// ambientIrradiance of fragmentShader.glsl averaged over the disk seen from v:
+// the same cosine convolution again, 1, 2/3 and 1/4 per band
+vec3 diskAmbient(vec3 v) {
+    return ambientSH[0] + 2.0 / 3.0 * (ambientSH[1] * v.y + ambientSH[2] * v.z + ambientSH[3] * v.x) +
+           0.25 * (ambientSH[4] * v.x * v.y + ambientSH[5] * v.y * v.z + ambientSH[6] * (3.0 * v.z * v.z - 1.0) +
+                   ambientSH[7] * v.x * v.z + ambientSH[8] * (v.x * v.x - v.y * v.y));
+}
+
+out vec4 fColor;   // Disk-averaged color, alpha = share of the point covered by the disk
+out float fDepthW; // View distance
+
+void main()
+{
+    vec3 center = aModelMat[3].xyz;
+    float radius = length(aModelMat[0].xyz);
+    vec4 viewPosition = viewMat * vec4(center, 1.0);
+    float distance = length(viewPosition.xyz);
+    float pixelRadius = pixelScale * radius / sqrt(max(distance * distance - radius * radius, 1.0e-4 * distance * distance));
+    gl_PointSize = max(1.0, 2.0 * pixelRadius);
+    float coverage = min(PI * pixelRadius * pixelRadius / (gl_PointSize * gl_PointSize), 1.0);
+
+    // Average color of the texture: its last mip level
+    ivec4 material = materials[aMaterial];
+    vec3 baseColor = material.y != 0 ? textureLod(bodyTextures, vec3(0.5, 0.5, float(material.x)), 32.0).rgb : aColor.rgb;
+
+    // Lighting of fragmentShader.glsl averaged over the visible disk: the diffuse term
+    // of a Lambertian sphere is 2/3 of the Lambert phase function (specular neglected)
+    vec3 lighting;
+    if (material.z != 0) {
+        lighting = baseColor * emissiveIntensity;
+    } else {
+        float cosPhase = dot(normalize(lightPos - center), normalize(camPos - center));
+        float phaseAngle = acos(clamp(cosPhase, -1.0, 1.0));
+        float phase = (sin(phaseAngle) + (PI - phaseAngle) * cosPhase) / PI;
+        lighting = baseColor * (diskAmbient(normalize(camPos - center)) + 2.0 / 3.0 * phase);
+    }
+    fColor = vec4(lighting, coverage);
+
+    gl_Position = projMat * viewPosition;
+    fDepthW = gl_Position.w;
+}
@@ -0,0 +1,122 @@
+#version 330 core
+
+const int kMaxSteps = 32; // Samples of a ray crossing the whole width of the rings
+
+uniform mat4 projMat;
+uniform float logDepthScale; // 1 / log2(1 + far), for the LOG_DEPTH variant (no glClipControl / float depth buffer)
+uniform float ringHalfThickness; // In radii of the planet
+
+in vec3 fLocal;
+flat in vec3 fCameraLocal;
+flat in vec3 fLightLocal;
+flat in mat4 fModelView;
+flat in float fPlanetRadius;
+
+// Share of the Sun's disk (angular radius sunRadius, towards l) that the planet,
+// the unit sphere at the origin, leaves visible from p
+float planetShadow(vec3 p, vec3 l, float sunRadius) {
+    if (dot(p, l) >= 0.0)
+        return 1.0; // Sunward of the planet
+    float distance = length(p);
+    float planetRadius = asin(min(1.0 / distance, 1.0));
+    float separation = atan(length(cross(l, -p)), dot(l, -p));
+    return 1.0 - diskOverlap(sunRadius, planetRadius, separation) / (PI * sunRadius * sunRadius);
+}
+
+// Extinction per unit length in the slab, from the opacity at normal incidence
+float extinction(float opacity) {
+    return -log(1.0 - 0.98 * opacity) / (2.0 * ringHalfThickness);
+}
+
+out vec4 color;
+
+void main() {
+    vec3 origin = fCameraLocal;
+    vec3 dir = normalize(fLocal - fCameraLocal);
+    float h = ringHalfThickness;
+    float width = ringRadii.y - ringRadii.x;
+
+    // Level of detail of the profile from the footprint of the ray on the mid-plane,
+    // taken before any discard (the samples below sit in a loop)
+    vec3 onPlane = origin + (abs(dir.y) > 1.0e-6 ? max(-origin.y / dir.y, 0.0) : 0.0) * dir;
+    float lod = log2(max(fwidth(length(onPlane.xz) / width) * float(textureSize(ringProfile, 0)), 1.0));
+
+    // The part of the ray inside the slab |y| <= h...
+    float tNear = 0.0;
+    float tFar = 1.0e30;
+    if (abs(dir.y) > 1.0e-6) {
+        float t0 = (-h - origin.y) / dir.y;
+        float t1 = (h - origin.y) / dir.y;
+        tNear = max(min(t0, t1), 0.0);
+        tFar = max(t0, t1);
+    } else if (abs(origin.y) > h) {
+        discard;
+    }
+    // ...and inside the cylinder of the outer edge
+    float a = dot(dir.xz, dir.xz);
+    float b = dot(origin.xz, dir.xz);
+    float c = dot(origin.xz, origin.xz) - ringRadii.y * ringRadii.y;
+    if (a > 1.0e-12) {
+        float disc = b * b - a * c;
+        if (disc <= 0.0)
+            discard;
+        float s = sqrt(disc);
+        tNear = max(tNear, (-b - s) / a);
+        tFar = min(tFar, (-b + s) / a);
+    } else if (c > 0.0) {
+        discard;
+    }
+    // The planet hides what lies behind it
+    float pb = dot(origin, dir);
+    float pd = pb * pb - (dot(origin, origin) - 1.0);
+    if (pd > 0.0 && -pb - sqrt(pd) > 0.0)
+        tFar = min(tFar, -pb - sqrt(pd));
+    if (tFar <= tNear)
+        discard;
+
+    // Enough steps to resolve the profile along the radial span crossed: one
+    // face-on, up to kMaxSteps edge-on
+    float span = (tFar - tNear) * sqrt(a);
+    int steps = clamp(int(ceil(span / width * float(kMaxSteps))), 1, kMaxSteps);
+    float dt = (tFar - tNear) / float(steps);
+
+    vec3 l = normalize(fLightLocal);
+    float sunRadius = asin(min(sunSphere.w / (length(fLightLocal) * fPlanetRadius), 1.0));
+    float sunSlope = max(abs(l.y), 1.0e-3);
+
+    // Front to back: light scattered at each sample, attenuated by what is in front
+    vec3 radiance = vec3(0.0);
+    float transmittance = 1.0;
+    float firstHit = -1.0;
+    for (int i = 0; i < steps; ++i) {
+        float t = tNear + (float(i) + 0.5) * dt;
+        vec3 p = origin + t * dir;
+        float u = (length(p.xz) - ringRadii.x) / width;
+        if (u < 0.0 || u > 1.0)
+            continue;
+        vec4 profile = textureLod(ringProfile, u, lod);
+        float sigma = extinction(profile.a);
+        if (sigma <= 0.0)
+            continue;
+        // Sunlight reaching p through the ring towards the Sun and past the planet
+        float towardsSun = (l.y >= 0.0 ? h - p.y : h + p.y) / sunSlope;
+        float sunlight = exp(-sigma * towardsSun) * planetShadow(p, l, sunRadius);
+        float absorbed = 1.0 - exp(-sigma * dt);
+        radiance += transmittance * absorbed * profile.rgb * (0.5 + sunlight); // Ambient as in fragmentShader.glsl
+        transmittance *= 1.0 - absorbed;
+        if (firstHit < 0.0)
+            firstHit = t;
+    }
+    if (transmittance > 0.998)
+        discard;
+    float alpha = 1.0 - transmittance;
+    color = vec4(radiance / alpha, alpha);
+
+    // Depth of the first sample that scatters, not of the box
+    vec4 clip = projMat * (fModelView * vec4(origin + firstHit * dir, 1.0));
+#ifdef LOG_DEPTH
+    gl_FragDepth = 1.0 - log2(1.0 + clip.w) * logDepthScale;
+#else
+    gl_FragDepth = clip.z / clip.w;
+#endif
+}
@@ -0,0 +1,29 @@
+// Box around a planet's rings; the fragment shader ray-marches the ring slab inside it.
+#version 330 core
+
+layout(location = 0) in vec3 aPos;      // Box corner, in the ring's frame (see Mesh::genRingProxy)
+layout(location = 3) in mat4 aModelMat; // Per draw (locations 3-6): the ring's frame, in radii of the planet
+
+uniform mat4 viewMat;
+uniform mat4 projMat;
+uniform vec3 lightPos; // Light position (sun's position)
+
+out vec3 fLocal;            // Point on the box, in the ring's frame
+flat out vec3 fCameraLocal; // Camera and light in the ring's frame
+flat out vec3 fLightLocal;
+flat out mat4 fModelView;
+flat out float fPlanetRadius; // World units per unit of the ring's frame
+
+void main()
+{
+    // Relative to the planet, so that nothing cancels however far it is
+    mat4 modelView = viewMat * aModelMat;
+    mat3 toLocal = inverse(mat3(aModelMat));
+    fLocal = aPos;
+    fCameraLocal = -inverse(mat3(modelView)) * modelView[3].xyz;
+    fLightLocal = toLocal * (lightPos - aModelMat[3].xyz);
+    fModelView = modelView;
+    fPlanetRadius = length(aModelMat[0].xyz);
+
+    gl_Position = projMat * modelView * vec4(aPos, 1.0);
+}
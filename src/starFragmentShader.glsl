@@ -0,0 +1,14 @@
+#version 330 core
+
+in vec3 fColor;
+in float fIntensity;
+flat in float fPointSize;
+
+out vec4 color; // Added to the framebuffer
+
+void main() {
+    vec2 d = gl_PointCoord * 2.0 - 1.0;
+    float profile = fPointSize > 1.0 ? max(1.0 - dot(d, d), 0.0) : 1.0;
+    color = vec4(fColor * fIntensity * profile, 1.0);
+    gl_FragDepth = 0.0; // Also at the far depth when clip z is mapped to [-1, 1]
+}
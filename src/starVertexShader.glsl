@@ -0,0 +1,47 @@
+// One catalog star: a point at infinity, sized and weighted by its magnitude.
+#version 330 core
+
+layout(location = 0) in vec2 aDirection;  // Octahedral encoding of the unit direction
+layout(location = 1) in float aMagnitude; // In hundredths
+layout(location = 2) in float aColorIndex; // B-V mapped from [-0.4, 2.0] to [0, 1]
+
+uniform mat4 viewProjection;     // Projection times the rotation of the view (stars are at infinity)
+uniform float limitingMagnitude; // Faintest magnitude drawn
+uniform float maxPointSize;      // Pixels
+
+out vec3 fColor;
+out float fIntensity;
+flat out float fPointSize;
+
+vec3 decodeOctahedral(vec2 e) {
+    vec3 d = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (d.z < 0.0)
+        d.xy = (1.0 - abs(d.yx)) * vec2(d.x >= 0.0 ? 1.0 : -1.0, d.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(d);
+}
+
+// Rough color of a star from its B-V index: blue-white, white, yellow, orange-red
+vec3 starColor(float bv) {
+    vec3 color = mix(vec3(0.64, 0.74, 1.0), vec3(1.0), smoothstep(-0.3, 0.3, bv));
+    color = mix(color, vec3(1.0, 0.92, 0.74), smoothstep(0.3, 0.9, bv));
+    return mix(color, vec3(1.0, 0.72, 0.46), smoothstep(0.9, 1.7, bv));
+}
+
+void main()
+{
+    float magnitude = aMagnitude * 0.01;
+
+    // Stars at the limit are faint, each magnitude brighter is 2.512 times the flux;
+    // the last half magnitude fades in so that stars do not pop when zooming
+    float intensity = 0.08 * pow(10.0, 0.4 * (limitingMagnitude - magnitude)) *
+                      smoothstep(limitingMagnitude, limitingMagnitude - 0.5, magnitude);
+    // Up to one pixel the flux goes into brightness, beyond into the size of the
+    // disk, whose profile 1 - r^2 averages 0.39 over the point
+    fPointSize = clamp(sqrt(intensity), 1.0, maxPointSize);
+    gl_PointSize = fPointSize;
+    fIntensity = fPointSize > 1.0 ? intensity / (0.39 * fPointSize * fPointSize) : intensity;
+    fColor = starColor(mix(-0.4, 2.0, aColorIndex));
+
+    vec4 position = viewProjection * vec4(decodeOctahedral(aDirection), 1.0);
+    gl_Position = vec4(position.xy, 0.0, position.w); // Farthest depth, which is 0 with reversed depth
+}
@@ -0,0 +1,42 @@
+#version 330 core
+
+uniform sampler2D sceneTexture; // Offscreen HDR target, rendered at a fraction of the window size
+uniform vec2 texelSize;         // 1 / size of the offscreen target
+uniform vec2 uvMin;             // Centers of the first and last rendered texels: bilinear
+uniform vec2 uvMax;             // filtering must not read past the rendered area
+uniform float sharpness;        // 0: plain bilinear upscale
+uniform sampler2D bloomTexture; // Top of the bloom pyramid
+uniform vec2 bloomUvScale;      // Part of it that was rendered to
+uniform vec2 bloomUvMax;
+uniform float bloomStrength;    // 0: no bloom
+uniform float exposure;
+
+in vec2 fTexCoord;
+in vec2 fScreenCoord;
+
+out vec4 color;
+
+vec3 sampleScene(vec2 uv) {
+    return texture(sceneTexture, clamp(uv, uvMin, uvMax)).rgb;
+}
+
+// Filmic curve fitted to ACES (Narkowicz): toe in the shadows, highlights roll off to white
+vec3 toneMap(vec3 x) {
+    return clamp((x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14), 0.0, 1.0);
+}
+
+void main() {
+    vec3 c = sampleScene(fTexCoord);
+    if (sharpness > 0.0) {
+        vec3 n = sampleScene(fTexCoord + vec2(0.0, texelSize.y));
+        vec3 s = sampleScene(fTexCoord - vec2(0.0, texelSize.y));
+        vec3 e = sampleScene(fTexCoord + vec2(texelSize.x, 0.0));
+        vec3 w = sampleScene(fTexCoord - vec2(texelSize.x, 0.0));
+        // Unsharp mask, clamped to the neighbourhood so that edges do not ring
+        vec3 sharpened = c + sharpness * (4.0 * c - n - s - e - w) * 0.25;
+        c = clamp(sharpened, min(c, min(min(n, s), min(e, w))), max(c, max(max(n, s), max(e, w))));
+    }
+    if (bloomStrength > 0.0)
+        c += bloomStrength * texture(bloomTexture, min(fScreenCoord * bloomUvScale, bloomUvMax)).rgb;
+    color = vec4(toneMap(c * exposure), 1.0);
+}
@@ -0,0 +1,15 @@
+#version 330 core
+
+uniform vec2 uvScale; // Part of the source texture that was rendered to
+
+out vec2 fTexCoord;
+out vec2 fScreenCoord; // In [0, 1] over the viewport
+
+// Full-screen triangle generated from the vertex index: no vertex buffer needed.
+// Also draws the bloom passes.
+void main() {
+    vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2); // (0,0) (2,0) (0,2)
+    fTexCoord = p * uvScale;
+    fScreenCoord = p;
+    gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);
+}
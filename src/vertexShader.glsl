@@ -4,27 +4,44 @@
 layout(location = 0) in vec3 aPos;
 layout(location = 1) in vec3 aNormal;
 layout(location = 2) in vec2 aTexCoord;
+layout(location = 3) in mat4 aModelMat; // Per draw (locations 3-6)
+layout(location = 7) in vec4 aColor;    // Per draw: color of untextured objects
+layout(location = 8) in uint aMaterial; // Per draw: slot in the material table
+layout(location = 9) in uint aShadows;  // Per draw: occluder list (first | count << 24), ringed (bit 31) and atmosphere (bit 30) flags
 
-uniform mat4 modelMat;
 uniform mat4 viewMat;
 uniform mat4 projMat;
+uniform vec3 ringAxis; // Normal of the ring plane, in the frame of the planet
 
 out vec3 fPosition; // Fragment position in world space
 out vec3 fNormal;   // Fragment normal in world space
 out vec2 fTexCoord; // Fragment texture coordinate
+flat out vec3 fObjectColor;
+flat out uint fMaterial;
+flat out uint fShadows;
+flat out vec3 fCenter;    // Center of the body in world space
+flat out vec4 fRingPlane; // Normal of the ring plane, planet radius; 0 without rings
+out float fDepthW;  // Clip-space w (view distance), for logarithmic depth
 
 void main()
 {
     // Transform the vertex position to world space
-    vec4 worldPosition = modelMat * vec4(aPos, 1.0);
+    vec4 worldPosition = aModelMat * vec4(aPos, 1.0);
     fPosition = worldPosition.xyz;
 
     // Transform the normal to world space
-    fNormal = mat3(transpose(inverse(modelMat))) * aNormal;
+    fNormal = mat3(transpose(inverse(aModelMat))) * aNormal;
 
     // Pass the texture coordinate to the fragment shader
     fTexCoord = aTexCoord;
+    fObjectColor = aColor.rgb;
+    fMaterial = aMaterial;
+    fShadows = aShadows;
+    fCenter = aModelMat[3].xyz;
+    fRingPlane = (aShadows & 0x80000000u) != 0u ? vec4(normalize(mat3(aModelMat) * ringAxis), length(aModelMat[0].xyz))
+                                                 : vec4(0.0);
 
     // Transform the vertex position to clip space
     gl_Position = projMat * viewMat * worldPosition;
-}
\ No newline at end of file
+    fDepthW = gl_Position.w;
+}